@@ -0,0 +1,268 @@
+/// bench_alloc.cpp -- heap allocations of a request, with and without pools
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-24
+///
+
+#include "json_writer.hpp"
+#include "mysql_conn.hpp"
+#include "res_buf.hpp"
+#include "sql_res.hpp"
+#include "sql_stmt.hpp"
+
+#include <mysql/mysql.h>
+#include <cppzmq.hpp>
+
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// every allocation the process makes goes through here, including those of
+// operator new, zmq and the mysql client
+static size_t s_allocs;
+
+extern "C" {
+void *__libc_malloc (size_t n);
+void *__libc_calloc (size_t n, size_t size);
+void *__libc_realloc (void *p, size_t n);
+void __libc_free (void *p);
+
+void *malloc (size_t n) throw ()
+{
+    ++s_allocs;
+    return __libc_malloc (n);
+}
+
+void *calloc (size_t n, size_t size) throw ()
+{
+    ++s_allocs;
+    return __libc_calloc (n, size);
+}
+
+void *realloc (void *p, size_t n) throw ()
+{
+    ++s_allocs;
+    return __libc_realloc (p, n);
+}
+
+void free (void *p) throw ()
+{
+    __libc_free (p);
+}
+}
+
+static double now ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report (const char *name, size_t n, double secs, size_t allocs)
+{
+    cout << setw (40) << left << name << setw (14) << right << fixed
+         << setprecision (0) << n / secs << " reqs/sec" << setw (10)
+         << setprecision (2) << (double) allocs / n << " allocs/req" << endl
+         << flush;
+}
+
+// the columns of a row fetched, as the prepared statement keeps them
+struct fake_row
+{
+    fake_row ();
+    MYSQL_BIND binds[3];
+    int64_t id;
+    char name[32];
+    double score;
+    unsigned long len;
+    my_bool not_null;
+};
+
+fake_row::fake_row () : id (1234567), score (98.5), not_null (false)
+{
+    memset (binds, 0, sizeof (binds));
+    strcpy (name, "a user name");
+    len = strlen (name);
+    for (size_t i = 0; i < 3; ++i)
+        binds[i].is_null = &not_null;
+    binds[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    binds[0].buffer = &id;
+    binds[1].buffer_type = MYSQL_TYPE_STRING;
+    binds[1].buffer = name;
+    binds[1].length = &len;
+    binds[2].buffer_type = MYSQL_TYPE_DOUBLE;
+    binds[2].buffer = &score;
+}
+
+// puts the envelope in front of the results, the message being freed as zmq
+// would once it's sent
+static void send_res (sql_res &res)
+{
+    char stack[res_buf::default_headroom];
+    res_buf head (stack, sizeof (stack));
+    json_writer hw (head);
+    hw.begin_object (4);
+    hw.key ("id");
+    hw.uint64 (res.id);
+    hw.key ("code");
+    hw.int64 (res.err);
+    hw.key ("message");
+    const char *msg = err_to_str (res.err);
+    hw.str (msg, strlen (msg));
+    hw.key ("results");
+    res.res.put ('}');
+    if (!res.res.prepend (head.data (), head.size ()))
+        abort ();
+    cppzmq::message_t out (res.res.release ());
+}
+
+static sql_stmt read_req (const string &req, sql_params &area,
+                          const stmt_registry &stmts, buf_pool *bufs)
+{
+    sql_stmt sql (cppzmq::packet_t (),
+                  cppzmq::message_t (req.data (), req.size ()),
+                  cppzmq::packet_t (), area, stmts);
+    sql.bufs = bufs;
+    if (sql.err)
+        abort ();
+    return sql;
+}
+
+// what a worker does for an autocommit select, short of talking to the
+// server: decodes the request, looks up the statement, encodes the rows,
+// and puts the envelope in front of them
+static void run_req (const string &req, sql_params &area,
+                     const stmt_registry &stmts, buf_pool *bufs,
+                     const fake_row &row, size_t rows)
+{
+    sql_stmt sql = read_req (req, area, stmts, bufs);
+    res_buf rb = bufs ? res_buf (*bufs) : res_buf ();
+    json_writer w (rb);
+    w.begin_array (rows);
+    for (size_t r = 0; r < rows; ++r) {
+        w.begin_array (3);
+        for (size_t i = 0; i < 3; ++i)
+            w.column (row.binds[i]);
+        w.end_array ();
+    }
+    w.end_array ();
+    sql_res res (move (sql), move (rb));
+    send_res (res);
+}
+
+// the same, with the statement run on the server, binding the params, and
+// fetching the rows into the binds kept by the prepared statement
+static void exec_req (const string &req, sql_params &area,
+                      const stmt_registry &stmts, buf_pool *bufs,
+                      mysql_conn &conn)
+{
+    sql_res res = conn.execute (read_req (req, area, stmts, bufs));
+    if (res.err)
+        abort ();
+    send_res (res);
+}
+
+static void bench_alloc (const char *name, buf_pool *bufs, size_t rows,
+                         size_t n)
+{
+    stmt_registry stmts;
+    tr1::shared_ptr<mysql_stmt> st (
+        new mysql_stmt ("get_user", "select id, name, score from users"
+                        " where id = ?", false, "bench", 1));
+    stmts.by_name[st->name] = st;
+    stmts.by_id->push_back (st);
+
+    string req = "{\"id\": 12345, \"sql\": \"get_user\", "
+        "\"params\": [1234567]}";
+    sql_params area;
+    fake_row row;
+    // the first requests grow the area, and fill the pool
+    for (size_t i = 0; i < 100; ++i)
+        run_req (req, area, stmts, bufs, row, rows);
+
+    size_t allocs = s_allocs;
+    double start = now ();
+    for (size_t i = 0; i < n; ++i)
+        run_req (req, area, stmts, bufs, row, rows);
+    double secs = now () - start;
+    report (name, n, secs, s_allocs - allocs);
+}
+
+// the allocations of the mysql client are counted too, so this shows what
+// a request costs the worker once its statement is prepared
+static void bench_exec (const char *name, buf_pool *bufs, const string &host,
+                        unsigned short port, const string &user,
+                        const string &pass, const string &db, size_t n)
+{
+    stmt_registry stmts;
+    tr1::shared_ptr<mysql_stmt> st (
+        new mysql_stmt ("get_user", "select cast(? as signed), 'a user name',"
+                        " 98.5", false, "bench", 1));
+    MYSQL *init = 0;
+    string err = st->init_results (init, host, port, user, pass, db, 10);
+    if (init)
+        mysql_close (init);
+    if (!err.empty ()) {
+        cerr << "failed to init result info: " << err << endl << flush;
+        exit (1);
+    }
+    stmts.by_name[st->name] = st;
+    stmts.by_id->push_back (st);
+
+    string req = "{\"id\": 12345, \"sql\": \"get_user\", "
+        "\"params\": [1234567]}";
+    sql_params area;
+    mysql_conn conn (host, port, user, pass, db, 10);
+    // the first requests connect, prepare the statement, and grow the
+    // binds, the area and the pool
+    for (size_t i = 0; i < 100; ++i)
+        exec_req (req, area, stmts, bufs, conn);
+
+    size_t allocs = s_allocs;
+    double start = now ();
+    for (size_t i = 0; i < n; ++i)
+        exec_req (req, area, stmts, bufs, conn);
+    double secs = now () - start;
+    report (name, n, secs, s_allocs - allocs);
+}
+
+// the execute path is only run against a server, if one is given
+int main (int argc, char **argv)
+{
+    if (argc != 1 && argc != 2 && argc != 7) {
+        cerr << "usage: " << argv[0]
+             << " [requests [host port user password db]]" << endl << flush;
+        return 1;
+    }
+    size_t total = argc > 1 ? strtoul (argv[1], 0, 0) : 1000000;
+
+    // as many as a worker keeps
+    buf_pool bufs (res_buf::initial_size + res_buf::default_headroom, 16);
+    bench_alloc ("1 row, heap", 0, 1, total);
+    bench_alloc ("1 row, pooled", &bufs, 1, total);
+    bench_alloc ("50 rows, heap", 0, 50, total / 10);
+    bench_alloc ("50 rows, pooled", &bufs, 50, total / 10);
+    // too large for the pool's buffers, so both end up on the heap
+    bench_alloc ("500 rows, heap", 0, 500, total / 100);
+    bench_alloc ("500 rows, pooled", &bufs, 500, total / 100);
+
+    if (argc < 7)
+        return 0;
+    if (mysql_library_init (0, 0, 0)) {
+        cerr << "failed to init mysql client" << endl << flush;
+        return 1;
+    }
+    unsigned short port = strtoul (argv[3], 0, 0);
+    bench_exec ("1 row, executed, heap", 0, argv[2], port, argv[4], argv[5],
+                argv[6], total / 100);
+    bench_exec ("1 row, executed, pooled", &bufs, argv[2], port, argv[4],
+                argv[5], argv[6], total / 100);
+    mysql_library_end ();
+    return 0;
+}
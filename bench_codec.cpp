@@ -0,0 +1,386 @@
+/// bench_codec.cpp -- micro benchmarks of request/response encoding
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-15
+///
+
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+#include "mp_reader.hpp"
+#include "mp_writer.hpp"
+#include "res_buf.hpp"
+#include "sql_params.hpp"
+
+#include <json/json.h>
+#include <mysql/mysql.h>
+#include <cppzmq.hpp>
+
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static double now ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report (const char *name, size_t n, double secs, const char *unit)
+{
+    cout << setw (40) << left << name << setw (14) << right << fixed
+         << setprecision (0) << n / secs << " " << unit << "/sec" << endl
+         << flush;
+}
+
+// a row of a typical wide select: ids, a price, names & descriptions, a time
+struct fake_row
+{
+    fake_row ();
+    vector<MYSQL_BIND> binds;
+
+    int64_t id;
+    uint64_t owner;
+    double price;
+    string name;
+    string desc;
+    string note;
+    MYSQL_TIME created;
+    unsigned long lens[8];
+    my_bool nulls[8];
+};
+
+fake_row::fake_row ()
+    : binds (8), id (1234567), owner (987654321), price (12.5),
+      name ("a product name"),
+      desc ("a longer description, with \"quotes\" and a\ttab in it, which is "
+            "about the size of what we usually have in the tables"),
+      note ("")
+{
+    memset (&binds[0], 0, sizeof (MYSQL_BIND) * binds.size ());
+    memset (&created, 0, sizeof (created));
+    created.year = 2011;
+    created.month = 8;
+    created.day = 15;
+    created.hour = 12;
+    for (size_t i = 0; i < binds.size (); ++i) {
+        nulls[i] = false;
+        binds[i].is_null = &nulls[i];
+        binds[i].length = &lens[i];
+    }
+    binds[0].buffer_type = MYSQL_TYPE_LONGLONG;
+    binds[0].buffer = &id;
+    binds[1].buffer_type = MYSQL_TYPE_LONGLONG;
+    binds[1].buffer = &owner;
+    binds[1].is_unsigned = true;
+    binds[2].buffer_type = MYSQL_TYPE_DOUBLE;
+    binds[2].buffer = &price;
+    binds[3].buffer_type = MYSQL_TYPE_STRING;
+    binds[3].buffer = &name[0];
+    lens[3] = name.size ();
+    binds[4].buffer_type = MYSQL_TYPE_STRING;
+    binds[4].buffer = &desc[0];
+    lens[4] = desc.size ();
+    binds[5].buffer_type = MYSQL_TYPE_STRING;
+    binds[5].buffer = &note[0];
+    lens[5] = 0;
+    nulls[5] = true;
+    binds[6].buffer_type = MYSQL_TYPE_TIMESTAMP;
+    binds[6].buffer = &created;
+    binds[7].buffer_type = MYSQL_TYPE_LONGLONG;
+    binds[7].buffer = &id;
+}
+
+// the ostringstream & json-c way results used to be generated
+static void old_row (ostream &rs, const vector<MYSQL_BIND> &binds)
+{
+    for (size_t i = 0; i < binds.size (); ++i) {
+        if (i)
+            rs << ",";
+        if (*binds[i].is_null) {
+            rs << "null";
+            continue;
+        }
+        void *buf = binds[i].buffer;
+        size_t len = binds[i].length ? *binds[i].length : 0;
+        switch (binds[i].buffer_type) {
+        case MYSQL_TYPE_LONGLONG:
+            if (binds[i].is_unsigned)
+                rs << "\"" << *(uint64_t *) buf << "\"";
+            else
+                rs << "\"" << *(int64_t *) buf << "\"";
+            break;
+        case MYSQL_TYPE_DOUBLE:
+            rs << *(double *) buf;
+            break;
+        case MYSQL_TYPE_STRING:
+            if (true) {
+                struct json_object *o =
+                    json_object_new_string_len ((char *) buf, len);
+                rs << json_object_to_json_string (o);
+                json_object_put (o);
+            }
+            break;
+        case MYSQL_TYPE_TIMESTAMP:
+            if (true) {
+                MYSQL_TIME *t = (MYSQL_TIME *) buf;
+                rs << "\"" << setw (4) << setfill ('0') << t->year
+                   << "-" << setw (2) << t->month << "-" << setw (2) << t->day
+                   << "T" << setw (2) << t->hour << ":" << setw (2)
+                   << t->minute << ":" << setw (2) << t->second << "\"";
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static size_t old_results (const fake_row &row, size_t rows)
+{
+    ostringstream rs;
+    rs << "[";
+    for (size_t r = 0; r < rows; ++r) {
+        if (r)
+            rs << ",";
+        rs << "[";
+        old_row (rs, row.binds);
+        rs << "]";
+    }
+    rs << "]";
+    string res = rs.str ();
+
+    ostringstream ss;
+    ss << "{\"id\": " << 1 << ", \"code\": " << 0
+       << ", \"message\": \"success\", \"results\": " << res << "}";
+    cppzmq::message_t msg (ss.str ());
+    return msg.size ();
+}
+
+// json objects need closing, msgpack maps do not
+static void close_envelope (json_writer &, res_buf &rb) {rb.put ('}');}
+static void close_envelope (mp_writer &, res_buf &) {}
+
+template <typename Writer>
+static size_t new_results (const fake_row &row, size_t rows)
+{
+    res_buf rb;
+    Writer w (rb);
+    w.begin_array (rows);
+    for (size_t r = 0; r < rows; ++r) {
+        w.begin_array (row.binds.size ());
+        for (size_t i = 0; i < row.binds.size (); ++i)
+            w.column (row.binds[i]);
+        w.end_array ();
+    }
+    w.end_array ();
+
+    char stack[res_buf::default_headroom];
+    res_buf head (stack, sizeof (stack));
+    Writer hw (head);
+    hw.begin_object (4);
+    hw.key ("id");
+    hw.uint64 (1);
+    hw.key ("code");
+    hw.int64 (0);
+    hw.key ("message");
+    hw.str ("success", 7);
+    hw.key ("results");
+    close_envelope (hw, rb);
+    if (!rb.prepend (head.data (), head.size ()))
+        abort ();
+    cppzmq::message_t msg (rb.release ());
+    return msg.size ();
+}
+
+static void bench_results (size_t rows_per_res, size_t total)
+{
+    fake_row row;
+    size_t n = total / rows_per_res;
+    size_t bytes = 0;
+
+    ostringstream name;
+    name << "results, " << rows_per_res << " rows, ostringstream";
+    double start = now ();
+    for (size_t i = 0; i < n; ++i)
+        bytes += old_results (row, rows_per_res);
+    report (name.str ().c_str (), n * rows_per_res, now () - start, "rows");
+
+    name.str ("");
+    name << "results, " << rows_per_res << " rows, json_writer";
+    start = now ();
+    size_t json_bytes = 0;
+    for (size_t i = 0; i < n; ++i)
+        json_bytes += new_results<json_writer> (row, rows_per_res);
+    report (name.str ().c_str (), n * rows_per_res, now () - start, "rows");
+
+    name.str ("");
+    name << "results, " << rows_per_res << " rows, mp_writer";
+    start = now ();
+    size_t mp_bytes = 0;
+    for (size_t i = 0; i < n; ++i)
+        mp_bytes += new_results<mp_writer> (row, rows_per_res);
+    report (name.str ().c_str (), n * rows_per_res, now () - start, "rows");
+    cout << "  bytes per response: json " << json_bytes / n << ", msgpack "
+         << mp_bytes / n << endl << flush;
+    bytes += json_bytes + mp_bytes;
+
+    if (!bytes)
+        abort ();
+}
+
+// the json-c way requests used to be parsed: a tree for every request, then
+// walked again for the values of params
+static size_t old_parse (char *req, size_t len)
+{
+    struct json_tokener *parser = json_tokener_new ();
+    struct json_object *o = json_tokener_parse_ex (parser, req, len);
+    json_tokener_free (parser);
+    if (!o)
+        abort ();
+
+    size_t id = json_object_get_int (json_object_object_get (o, "id"));
+    string name = json_object_get_string (json_object_object_get (o, "sql"));
+    struct json_object *txn = json_object_object_get (o, "txn");
+    size_t seq = txn ? json_object_get_int (txn) : 0;
+    struct json_object *params = json_object_object_get (o, "params");
+    size_t n = params ? json_object_array_length (params) : 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct json_object *p = json_object_array_get_idx (params, i);
+        void *v = 0;
+        switch (json_object_get_type (p)) {
+        case json_type_int:
+            v = malloc (8);
+            *(int64_t *) v = json_object_get_int (p);
+            break;
+        case json_type_double:
+            v = malloc (8);
+            *(double *) v = json_object_get_double (p);
+            break;
+        case json_type_string:
+            v = strdup (json_object_get_string (p));
+            break;
+        case json_type_array:
+            if (true) {
+                size_t l = json_object_array_length (p);
+                v = malloc (l + 1);
+                for (size_t j = 0; j < l; ++j) {
+                    ((unsigned char *) v)[j] = json_object_get_int (
+                        json_object_array_get_idx (p, j));
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        free (v);
+    }
+    json_object_put (o);
+    return id + seq + name.size () + n;
+}
+
+static size_t new_parse (char *req, size_t len, sql_params &area)
+{
+    sql_req rq;
+    json_reader (req, len).read (rq, area);
+    area.name.assign (rq.sql, rq.sql_len);
+    return rq.id + rq.txn_seq + area.name.size () + area.params.size ();
+}
+
+static void bench_parse (const char *name, const string &req, size_t n)
+{
+    // requests are decoded in place, so each run gets a fresh copy, as it
+    // would have been received from zmq
+    vector<char> buf (req.size () + 1);
+    size_t sum = 0;
+
+    string title = string ("parse, ") + name + ", json-c";
+    double start = now ();
+    for (size_t i = 0; i < n; ++i) {
+        memcpy (&buf[0], req.data (), req.size ());
+        buf[req.size ()] = 0;
+        sum += old_parse (&buf[0], req.size ());
+    }
+    report (title.c_str (), n, now () - start, "reqs");
+
+    sql_params area;
+    title = string ("parse, ") + name + ", json_reader";
+    start = now ();
+    for (size_t i = 0; i < n; ++i) {
+        memcpy (&buf[0], req.data (), req.size ());
+        sum += new_parse (&buf[0], req.size (), area);
+    }
+    report (title.c_str (), n, now () - start, "reqs");
+
+    if (!sum)
+        abort ();
+}
+
+static void bench_mp_parse (size_t n)
+{
+    // the same as the medium json request
+    res_buf rb (0);
+    mp_writer w (rb);
+    w.begin_object (4);
+    w.key ("id");
+    w.uint64 (12345);
+    w.key ("txn");
+    w.uint64 (678);
+    w.key ("sql");
+    w.str ("update_user_profile", 19);
+    w.key ("params");
+    w.begin_array (10);
+    w.int64 (1234567);
+    w.str ("some name", 9);
+    w.str ("a \"quoted\" bio\nover lines", 25);
+    w.float64 (3.25);
+    w.null ();
+    w.int64 (9876543210LL);
+    w.bytes ((const unsigned char *) "\1\2\3\4\5\6\7\10", 8);
+    w.str ("zh_CN", 5);
+    w.int64 (42);
+    w.int64 (43);
+
+    sql_params area;
+    size_t sum = 0;
+    double start = now ();
+    for (size_t i = 0; i < n; ++i) {
+        sql_req rq;
+        mp_reader (rb.data (), rb.size ()).read (rq, area);
+        area.name.assign (rq.sql, rq.sql_len);
+        sum += rq.id + area.params.size ();
+    }
+    report ("parse, medium, mp_reader", n, now () - start, "reqs");
+    cout << "  request bytes: msgpack " << rb.size () << endl << flush;
+
+    if (!sum)
+        abort ();
+}
+
+int main (int argc, char **argv)
+{
+    size_t total = argc > 1 ? strtoul (argv[1], 0, 0) : 1000000;
+
+    bench_results (1, total / 10);
+    bench_results (100, total);
+    bench_results (10000, total);
+
+    bench_parse ("small", "{\"id\": 12345, \"sql\": \"get_user\", "
+                 "\"params\": [1234567]}", total);
+    bench_parse ("medium", "{\"id\": 12345, \"txn\": 678, "
+                 "\"sql\": \"update_user_profile\", \"params\": [1234567, "
+                 "\"some name\", \"a \\\"quoted\\\" bio\\nover lines\", 3.25, "
+                 "null, [\"long\", \"9876543210\"], [1, 2, 3, 4, 5, 6, 7, 8], "
+                 "\"zh_CN\", 42, 43]}", total);
+    bench_mp_parse (total);
+
+    return 0;
+}
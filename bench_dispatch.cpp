@@ -0,0 +1,184 @@
+/// bench_dispatch.cpp -- latency of passing requests from broker to worker
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-19
+///
+
+#include "mpmc_queue.hpp"
+
+#include <cppzmq.hpp>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+
+static double now ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// round trips per second, and the mean latency of a round trip
+static void report (const char *name, size_t n, double secs)
+{
+    cout << setw (40) << left << name << setw (14) << right << fixed
+         << setprecision (0) << n / secs << " trips/sec" << setw (10)
+         << setprecision (2) << secs / n * 1e6 << " usec/trip" << endl
+         << flush;
+}
+
+// a request as the broker passes it over: the origin label, the caller's
+// identity, and a small json body
+static cppzmq::packet_t fake_req ()
+{
+    cppzmq::packet_t p;
+    cppzmq::message_t origin ((size_t) 1);
+    *(unsigned char *) origin.data () = 0;
+    origin.label (true);
+    p.push_back (std::move (origin));
+    cppzmq::message_t id ("\0abcd", 5);
+    id.label (true);
+    p.push_back (std::move (id));
+    p.push_back (cppzmq::message_t ("{\"id\": 1, \"sql\": \"bench_noop\"}"));
+    return p;
+}
+
+// the inproc path: a router on the broker side, a dealer on the worker side,
+// each request and response taking a send and a receive on both sockets
+struct inproc_arg
+{
+    zmq::context_t *ctx;
+    size_t n;
+};
+
+static void *inproc_worker (void *p)
+{
+    inproc_arg *arg = (inproc_arg *) p;
+    zmq::socket_t sock (*arg->ctx, ZMQ_DEALER);
+    sock.connect ("inproc://bench-dispatch");
+    for (size_t i = 0; i < arg->n; ++i) {
+        cppzmq::packet_t req;
+        sock >> req;
+        sock << req;
+    }
+    return 0;
+}
+
+static void bench_inproc (size_t n)
+{
+    zmq::context_t ctx (1);
+    zmq::socket_t sock (ctx, ZMQ_XREQ);
+    sock.bind ("inproc://bench-dispatch");
+
+    inproc_arg arg = {&ctx, n};
+    pthread_t thread;
+    pthread_create (&thread, 0, &inproc_worker, &arg);
+
+    double start = now ();
+    for (size_t i = 0; i < n; ++i) {
+        sock << fake_req ();
+        cppzmq::packet_t res;
+        sock >> res;
+    }
+    double secs = now () - start;
+    pthread_join (thread, 0);
+
+    report ("inproc sockets", n, secs);
+}
+
+// the queue path: the frames are passed by pointer, with an eventfd to wake
+// the other side up
+struct queue_arg
+{
+    mpmc_queue<cppzmq::packet_t *> *reqs;
+    mpmc_queue<cppzmq::packet_t *> *ress;
+    int req_wake;
+    int res_wake;
+    size_t n;
+};
+
+static void wait_fd (int fd)
+{
+    uint64_t n;
+    while (true) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+            abort ();
+        if (read (fd, &n, sizeof (n)) == sizeof (n))
+            return;
+    }
+}
+
+static void wake_fd (int fd)
+{
+    uint64_t one = 1;
+    while (write (fd, &one, sizeof (one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void *queue_worker (void *p)
+{
+    queue_arg *arg = (queue_arg *) p;
+    for (size_t i = 0; i < arg->n; ++i) {
+        wait_fd (arg->req_wake);
+        cppzmq::packet_t *req;
+        while (!arg->reqs->pop (req))
+            ;
+        while (!arg->ress->push (req))
+            ;
+        wake_fd (arg->res_wake);
+    }
+    return 0;
+}
+
+static void bench_queue (size_t n)
+{
+    mpmc_queue<cppzmq::packet_t *> reqs (1024), ress (1024);
+    queue_arg arg = {&reqs, &ress, eventfd (0, EFD_NONBLOCK),
+                     eventfd (0, EFD_NONBLOCK), n};
+    pthread_t thread;
+    pthread_create (&thread, 0, &queue_worker, &arg);
+
+    double start = now ();
+    for (size_t i = 0; i < n; ++i) {
+        cppzmq::packet_t *req = new cppzmq::packet_t (fake_req ());
+        // the envelope is split off before the request is queued
+        cppzmq::packet_t addr = req->unseal ();
+        while (!reqs.push (req))
+            ;
+        wake_fd (arg.req_wake);
+        wait_fd (arg.res_wake);
+        cppzmq::packet_t *res;
+        while (!ress.pop (res))
+            ;
+        res->seal (std::move (addr));
+        delete res;
+    }
+    double secs = now () - start;
+    pthread_join (thread, 0);
+    close (arg.req_wake);
+    close (arg.res_wake);
+
+    report ("mpmc queue + eventfd", n, secs);
+}
+
+int main (int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul (argv[1], 0, 0) : 100000;
+
+    bench_inproc (n);
+    bench_queue (n);
+
+    return 0;
+}
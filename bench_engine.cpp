@@ -0,0 +1,183 @@
+/// bench_engine.cpp -- throughput of blocking threads against async fibers
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-22
+///
+
+#include "conn_pool.hpp"
+
+#include <cppzmq.hpp>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static double now ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report (const char *name, size_t n, double secs)
+{
+    cout << setw (40) << left << name << setw (14) << right << fixed
+         << setprecision (0) << n / secs << " reqs/sec" << endl << flush;
+}
+
+// the statement keeps the server busy for a while, without keeping it
+// working, so what's measured is how many are kept in flight at once
+static const char *stmts_dir = "/tmp";
+static const char *stmts_file = "bench_engine.sqls";
+static const char *listen_addr = "tcp://127.0.0.1:3499";
+
+struct db_params
+{
+    string host;
+    unsigned short port;
+    string user;
+    string password;
+    string db;
+    size_t cap;
+};
+
+struct no_dbs
+{
+    string operator () (const string &) const {return "";}
+};
+
+// runs a pool in the child, until killed, as the pool never stops
+static pid_t start_pool (const db_params &p, size_t threads, bool async)
+{
+    pid_t pid = fork ();
+    if (pid)
+        return pid;
+
+    try {
+        zmq::context_t ctx (1);
+        conn_pool pool (ctx, listen_addr, p.host, p.port, p.user, p.password,
+                        p.db, 10, p.cap, 60, 1, false, threads, async);
+        pool.init_stmts (stmts_dir, stmts_file, 10, no_dbs ());
+        pool.start ();
+        while (true)
+            pause ();
+    } catch (const exception &e) {
+        cerr << "failed to start pool: " << e.what () << endl << flush;
+    }
+    _exit (1);
+}
+
+struct client
+{
+    zmq::context_t *ctx;
+    size_t total;
+    size_t window;
+    pthread_t thread;
+};
+
+static cppzmq::message_t sleep_req (size_t id)
+{
+    char buf[64];
+    int len = snprintf (buf, sizeof (buf),
+                        "{\"id\": %lu, \"sql\": \"bench_sleep\"}",
+                        (unsigned long) id);
+    return cppzmq::message_t (buf, len);
+}
+
+static void *run_client (void *p)
+{
+    client *c = (client *) p;
+    zmq::socket_t sock (*c->ctx, ZMQ_DEALER);
+    sock.connect (listen_addr);
+
+    size_t sent = 0, recvd = 0;
+    while (recvd < c->total) {
+        while (sent < c->total && sent - recvd < c->window) {
+            cppzmq::packet_t req;
+            req.push_back (sleep_req (sent + 1));
+            sock << req;
+            ++sent;
+        }
+        cppzmq::packet_t res;
+        sock >> res;
+        assert (res.size () == 1);
+        ++recvd;
+    }
+    return 0;
+}
+
+// twice as many requests in flight as there are connections, so the pool
+// is never waiting for the clients
+static void bench_engine (const db_params &p, size_t threads, bool async,
+                          size_t total)
+{
+    pid_t pid = start_pool (p, threads, async);
+    // the connections are made as the first requests come
+    sleep (1);
+    if (waitpid (pid, 0, WNOHANG) == pid)
+        return;
+
+    zmq::context_t ctx (1);
+    const size_t clients = 8;
+    vector<client> cs (clients);
+    double start = now ();
+    for (size_t i = 0; i < clients; ++i) {
+        cs[i].ctx = &ctx;
+        cs[i].total = total / clients;
+        cs[i].window = p.cap * 2 / clients + 1;
+        pthread_create (&cs[i].thread, 0, &run_client, &cs[i]);
+    }
+    for (size_t i = 0; i < clients; ++i)
+        pthread_join (cs[i].thread, 0);
+    double secs = now () - start;
+
+    kill (pid, SIGKILL);
+    waitpid (pid, 0, 0);
+
+    char name[64];
+    snprintf (name, sizeof (name), "%s, %lu threads, %lu conns",
+              async ? "async" : "blocking", (unsigned long) threads,
+              (unsigned long) p.cap);
+    report (name, total / clients * clients, secs);
+}
+
+int main (int argc, char **argv)
+{
+    db_params p;
+    p.host = argc > 1 ? argv[1] : "127.0.0.1";
+    p.port = argc > 2 ? strtoul (argv[2], 0, 0) : 3306;
+    p.user = argc > 3 ? argv[3] : "root";
+    p.password = argc > 4 ? argv[4] : "";
+    p.db = argc > 5 ? argv[5] : "test";
+    p.cap = argc > 6 ? strtoul (argv[6], 0, 0) : 64;
+    size_t total = argc > 7 ? strtoul (argv[7], 0, 0) : 20000;
+
+    string path = string (stmts_dir) + "/" + stmts_file;
+    {
+        ofstream f (path.c_str ());
+        f << "bench_sleep" << endl << "select sleep (0.005)" << endl;
+    }
+
+    // a thread for each connection is what the blocking calls need to
+    // keep them all busy, fewer threads cap the requests in flight
+    bench_engine (p, p.cap, false, total);
+    bench_engine (p, 4, false, total);
+    bench_engine (p, 1, true, total);
+    bench_engine (p, 2, true, total);
+    bench_engine (p, 4, true, total);
+
+    unlink (path.c_str ());
+    return 0;
+}
@@ -0,0 +1,212 @@
+/// bench_mysqlcp.cpp -- benchmarks of a running mysqlcp
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-18
+///
+
+#include <cppzmq.hpp>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static double now ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report (const char *name, size_t n, double secs, const char *unit)
+{
+    cout << setw (40) << left << name << setw (14) << right << fixed
+         << setprecision (0) << n / secs << " " << unit << "/sec" << endl
+         << flush;
+}
+
+struct client
+{
+    zmq::context_t *ctx;
+    const vector<string> *endpoints;
+    size_t total;
+    size_t window;
+    // for txns, which have to be continued where they're begun
+    size_t endpoint;
+    pthread_t thread;
+};
+
+// an unknown statement is answered by the worker before touching the
+// database, so what's measured is the forwarding done by the broker
+static cppzmq::message_t noop_req (size_t id)
+{
+    char buf[64];
+    int len = snprintf (buf, sizeof (buf),
+                        "{\"id\": %lu, \"sql\": \"bench_noop\"}",
+                        (unsigned long) id);
+    return cppzmq::message_t (buf, len);
+}
+
+// keeps a window of requests in flight, so the broker is never starved
+static void *run_client (void *p)
+{
+    client *c = (client *) p;
+    zmq::socket_t sock (*c->ctx, ZMQ_DEALER);
+    // requests are spread over the shards
+    for (size_t i = 0; i < c->endpoints->size (); ++i)
+        sock.connect ((*c->endpoints)[i].c_str ());
+
+    size_t sent = 0, recvd = 0;
+    while (recvd < c->total) {
+        while (sent < c->total && sent - recvd < c->window) {
+            cppzmq::packet_t req;
+            req.push_back (noop_req (sent + 1));
+            sock << req;
+            ++sent;
+        }
+        cppzmq::packet_t res;
+        sock >> res;
+        assert (res.size () == 1);
+        ++recvd;
+    }
+    return 0;
+}
+
+static void bench_forward (zmq::context_t &ctx,
+                           const vector<string> &endpoints, size_t clients,
+                           size_t total, size_t window)
+{
+    vector<client> cs (clients);
+    double start = now ();
+    for (size_t i = 0; i < clients; ++i) {
+        cs[i].ctx = &ctx;
+        cs[i].endpoints = &endpoints;
+        cs[i].total = total / clients;
+        cs[i].window = window;
+        pthread_create (&cs[i].thread, 0, &run_client, &cs[i]);
+    }
+    for (size_t i = 0; i < clients; ++i)
+        pthread_join (cs[i].thread, 0);
+    double secs = now () - start;
+
+    char name[64];
+    snprintf (name, sizeof (name), "forward, %lu clients, window %lu",
+              (unsigned long) clients, (unsigned long) window);
+    report (name, total / clients * clients, secs, "msgs");
+}
+
+static cppzmq::message_t txn_req (size_t id, size_t seq, const char *sql,
+                                   const char *params = 0)
+{
+    char buf[128];
+    int len = snprintf (buf, sizeof (buf),
+                        "{\"id\": %lu, \"txn\": %lu, \"sql\": \"%s\"%s%s}",
+                        (unsigned long) id, (unsigned long) seq, sql,
+                        params ? ", \"params\": " : "", params ? params : "");
+    return cppzmq::message_t (buf, len);
+}
+
+// sends a request within the txn, if any, and waits for the response
+// returns false if the statement failed
+static bool exec_txn (zmq::socket_t &sock, cppzmq::message_t &txn,
+                      size_t &seq, cppzmq::message_t &&req)
+{
+    cppzmq::packet_t p;
+    if (!txn.empty ())
+        p.push_back (txn);
+    p.push_back (std::move (req));
+    sock << p;
+
+    cppzmq::packet_t res;
+    sock >> res;
+    if (res.size () == 2)
+        txn = std::move (res.front ());
+    // the response is nul terminated for strstr, the frame itself isn't
+    string body ((const char *) res.back ().data (), res.back ().size ());
+    const char *t = strstr (body.c_str (), "\"txn\":");
+    seq = t ? strtoul (t + 6, 0, 10) : 0;
+    return strstr (body.c_str (), "\"code\":0");
+}
+
+// begin, a single insert, and commit, which is the worst case for workers
+// going in and out of txns
+// the rows are inserted by test_insert of the test statements, and kept
+static void *run_txns (void *p)
+{
+    client *c = (client *) p;
+    zmq::socket_t sock (*c->ctx, ZMQ_DEALER);
+    sock.connect ((*c->endpoints)[c->endpoint].c_str ());
+
+    size_t id = 0;
+    for (size_t i = 0; i < c->total; ++i) {
+        cppzmq::message_t txn;
+        size_t seq = 0;
+        if (!exec_txn (sock, txn, seq, txn_req (++id, 0, "begin"))
+            || !exec_txn (sock, txn, seq,
+                          txn_req (++id, seq, "test_insert", "[123, \"abc\"]"))
+            || !exec_txn (sock, txn, seq, txn_req (++id, seq, "commit"))) {
+            cerr << "short txn failed" << endl << flush;
+            abort ();
+        }
+    }
+    return 0;
+}
+
+static void bench_txns (zmq::context_t &ctx, const vector<string> &endpoints,
+                        size_t clients, size_t total)
+{
+    vector<client> cs (clients);
+    double start = now ();
+    for (size_t i = 0; i < clients; ++i) {
+        cs[i].ctx = &ctx;
+        cs[i].endpoints = &endpoints;
+        cs[i].total = total / clients;
+        cs[i].window = 1;
+        cs[i].endpoint = i % endpoints.size ();
+        pthread_create (&cs[i].thread, 0, &run_txns, &cs[i]);
+    }
+    for (size_t i = 0; i < clients; ++i)
+        pthread_join (cs[i].thread, 0);
+    double secs = now () - start;
+
+    char name[64];
+    snprintf (name, sizeof (name), "short txns, %lu clients",
+              (unsigned long) clients);
+    report (name, total / clients * clients, secs, "txns");
+}
+
+int main (int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    unsigned long port = argc > 2 ? strtoul (argv[2], 0, 0) : 3406;
+    size_t shards = argc > 3 ? strtoul (argv[3], 0, 0) : 1;
+    size_t total = argc > 4 ? strtoul (argv[4], 0, 0) : 1000000;
+
+    // the broker shards listen on consecutive ports
+    vector<string> endpoints;
+    for (size_t i = 0; i < shards; ++i) {
+        char buf[128];
+        snprintf (buf, sizeof (buf), "tcp://%s:%lu", host, port + i);
+        endpoints.push_back (buf);
+    }
+
+    zmq::context_t ctx (1);
+    bench_forward (ctx, endpoints, 1, total / 10, 1);
+    bench_forward (ctx, endpoints, 1, total, 100);
+    bench_forward (ctx, endpoints, 4, total, 100);
+    bench_forward (ctx, endpoints, 16, total, 100);
+    // short txns touch the database, so far fewer of them
+    bench_txns (ctx, endpoints, 1, total / 100);
+    bench_txns (ctx, endpoints, 16, total / 100);
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+/// codec.hpp -- wire encodings
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-17
+///
+
+#ifndef INCLUDED_CODEC_HPP
+#define INCLUDED_CODEC_HPP
+
+#include <cstddef>
+
+// requests are encoded either in json or in msgpack, and responses are
+// encoded the same way as the requests they answer
+enum codec
+{
+    json_codec, msgpack_codec,
+};
+
+// a json request always starts with an object, and a msgpack one with a map,
+// so the first byte tells which is which
+static inline codec sniff_codec (const void *data, size_t size)
+{
+    if (!size)
+        return json_codec;
+    unsigned char c = *(const unsigned char *) data;
+    if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf)
+        return msgpack_codec;
+    return json_codec;
+}
+
+#endif // INCLUDED_CODEC_HPP
@@ -5,162 +5,754 @@
 ///
 
 #include "conn_pool.hpp"
+#include "json_writer.hpp"
+#include "mp_writer.hpp"
 #include "mysql_conn.hpp"
+#include "res_buf.hpp"
 #include "sql_res.hpp"
 #include "sql_stmt.hpp"
+#include "stmt_cache.hpp"
 
 #include <cppzmq.hpp>
 #include <vconf/vconf.h>
 
 #include <boost/thread/locks.hpp>
 
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <climits>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <sstream>
+#include <iterator>
 #include <stdexcept>
 
 using namespace std;
 using namespace boost;
 
+// the shards listen on consecutive ports, starting from the one configured
+static string shard_addr (const string &listen, size_t i)
+{
+    if (!i)
+        return listen;
+    size_t colon = listen.rfind (':');
+    char *end = 0;
+    unsigned long port = colon == string::npos ? 0
+        : strtoul (listen.c_str () + colon + 1, &end, 10);
+    if (!port || *end || port + i > USHRT_MAX)
+        throw invalid_argument ("bad listening address for shards");
+    char buf[16];
+    snprintf (buf, sizeof (buf), "%lu", port + i);
+    return listen.substr (0, colon + 1) + buf;
+}
+
+static string inproc_addr (const char *name, size_t i)
+{
+    char buf[64];
+    snprintf (buf, sizeof (buf), "inproc://%s-%lu", name, (unsigned long) i);
+    return buf;
+}
+
+// statements looked into at once, each thread with its own connection
+static const size_t init_threads = 8;
+// connections warmed up at once
+static const size_t warm_threads = 16;
+// requests waiting to be taken by the workers of a shard
+static const size_t jobs_size = 16384;
+// longer than the longest txn idle timeout, in seconds
+static const size_t wheel_size = 2048;
+// the slot of a txn not kept in its shard yet
+static const size_t no_slot = (size_t) -1;
+
+static int new_eventfd (int flags)
+{
+    int fd = eventfd (0, flags | EFD_NONBLOCK);
+    if (fd < 0)
+        throw runtime_error ("failed to create eventfd");
+    return fd;
+}
+
+static void notify (int fd)
+{
+    uint64_t one = 1;
+    while (write (fd, &one, sizeof (one)) < 0 && errno == EINTR)
+        ;
+}
+
+// returns false if there's nothing to take
+static bool take (int fd)
+{
+    uint64_t n;
+    ssize_t ret;
+    while ((ret = read (fd, &n, sizeof (n))) < 0 && errno == EINTR)
+        ;
+    return ret == sizeof (n);
+}
+
+conn_pool::shard::shard (zmq::context_t &ctx, size_t i, const string &addr)
+    : n (i), listen (addr), server (ctx, ZMQ_XREP), hops (ctx, ZMQ_PULL),
+      sqls (ctx, ZMQ_XREQ), txns (ctx, ZMQ_XREP), jobs (jobs_size),
+      jobs_wake (new_eventfd (EFD_SEMAPHORE)), replies (jobs_size),
+      replies_wake (new_eventfd (0)), idle_txns (wheel_size, time (0)),
+      stream_seq (0)
+{
+}
+
+conn_pool::shard::~shard ()
+{
+    close (jobs_wake);
+    close (replies_wake);
+    for (size_t i = 0; i < open_txns.size (); ++i)
+        delete open_txns[i];
+    for (size_t i = 0; i < open_streams.size (); ++i)
+        delete open_streams[i];
+    for (size_t i = 0; i < spare_jobs.size (); ++i)
+        delete spare_jobs[i];
+}
+
+// a worker rarely has more than a few responses on their way out at once
+static const size_t worker_bufs = 16;
+
+conn_pool::worker::worker (size_t i)
+    : n (i), bufs (res_buf::initial_size + res_buf::default_headroom,
+                   worker_bufs),
+      sock (0), from_txns (false), in_txn (false), conn (0), fan (0),
+      lookups (0)
+{
+}
+
+conn_pool::fan_out::fan_out (size_t n)
+    : stmt (0), next (0), done (0), refs (1), wake (new_eventfd (0)),
+      helpers (n)
+{
+    for (size_t i = 0; i < n; ++i)
+        helpers[i].fan = this;
+}
+
+// the answers of the batch before are cleared once put together, so only
+// the sizes change
+void conn_pool::fan_out::reset (sql_stmt &s, size_t n)
+{
+    stmt = &s;
+    parts.resize (n);
+    errs.assign (n, success);
+    msgs.resize (n);
+    next = 0;
+    done = 0;
+}
+
+conn_pool::fan_out::~fan_out ()
+{
+    close (wake);
+}
+
+conn_pool::open_stream::open_stream ()
+    : unacked (0), wake (new_eventfd (0)), next (0), slot (no_slot), seq (0),
+      sent (0), acked (0)
+{
+}
+
+conn_pool::open_stream::~open_stream ()
+{
+    close (wake);
+}
+
 conn_pool::conn_pool (zmq::context_t &ctx, const string &listen,
                       const string &host, unsigned short port,
                       const string &user, const string &pass, const string &db,
-                      size_t db_timeout, size_t cap, size_t idle_timeout)
-    : threads_ (cap), started_ (false), seq_ (0), ctx_ (ctx),
-      listen_ (listen), server_ (ctx_, ZMQ_XREP), sqls_ (ctx_, ZMQ_XREQ),
-      txns_ (ctx_, ZMQ_XREP), stmts_read_ (false), host_ (host), port_ (port),
-      user_ (user), password_ (pass), db_ (db), db_timeout_ (db_timeout),
+                      size_t db_timeout, size_t cap, size_t idle_timeout,
+                      size_t shards, bool inproc, size_t threads, bool async,
+                      size_t min_conns, size_t reap_timeout, size_t stmt_cap,
+                      size_t parallel_cap)
+    : threads_ (inproc || !threads ? cap : threads), inproc_ (inproc),
+      async_ (async), min_conns_ (min_conns), reap_timeout_ (reap_timeout),
+      last_reap_ (0),
+      stmt_cap_ (stmt_cap), parallel_cap_ (parallel_cap), started_ (false),
+      seq_ (0), ctx_ (ctx), stmts_ (0), stmts_read_ (false),
+      stmts_timeout_ (0), host_ (host), port_ (port), user_ (user),
+      password_ (pass), db_ (db), db_timeout_ (db_timeout),
       idle_timeout_ (idle_timeout)
 {
     if (listen.empty ())
         throw invalid_argument ("bad listening address");
     if (host.empty () || !port || user.empty ())
         throw invalid_argument ("bad db configuration");
+    // the shard of a txn is kept in a byte of the txn frame
+    if (!shards || shards > threads_.size () || shards > cap
+        || shards > UCHAR_MAX)
+        throw invalid_argument ("bad number of broker shards");
+    if (async && inproc)
+        throw invalid_argument ("async workers only talk through queues");
+    if (min_conns > cap)
+        throw invalid_argument ("bad minimum number of connections");
+    if (!parallel_cap)
+        throw invalid_argument ("bad number of parallel connections");
+#ifndef HAVE_MYSQL_NONBLOCK
+    if (async)
+        throw invalid_argument ("mysql client has no non-blocking api");
+#endif
+
+    for (size_t i = 0; i < shards; ++i) {
+        shards_.push_back (tr1::shared_ptr<shard> (
+                               new shard (ctx_, i, shard_addr (listen, i))));
+    }
+    size_t workers = async_ ? cap : threads_.size ();
+    for (size_t i = 0; i < workers; ++i)
+        workers_.push_back (tr1::shared_ptr<worker> (new worker (i)));
+    // the workers of the inproc fallback own their connections
+    // the others are only connected when first used
+    for (size_t i = 0; !inproc_ && i < cap; ++i) {
+        conns_.push_back (tr1::shared_ptr<mysql_conn> (
+                              new mysql_conn (host, port, user, pass, db,
+                                              db_timeout, async_, stmt_cap)));
+        closed_conns_.push_back (conns_.back ().get ());
+    }
 }
 
 conn_pool::~conn_pool ()
 {
-    if (!started_)
-        return;
+    if (started_) {
+        for (size_t i = 0; i < threads_.size (); ++i)
+            pthread_join (threads_[i], 0);
+    }
+    delete stmts_;
+}
 
-    for (size_t i = 0; i < threads_.size (); ++i)
-        pthread_join (threads_[i], 0);
+// waits for a request for at most timeout seconds, forever if negative
+// returns false if timed out
+bool conn_pool::wait_sql (worker &w, long timeout)
+{
+    // out of txns, the worker takes requests for the shard, and answers the
+    // txn requests sent to it after its txn ends
+    zmq_pollitem_t polls[2] = {
+        {*w.txns, -1, ZMQ_POLLIN, 0},
+        {*w.sqls, -1, ZMQ_POLLIN, 0}
+    };
+    int ret = zmq::poll (polls, w.in_txn ? 1 : 2,
+                         timeout < 0 ? -1 : timeout * 1000000);
+    if (!ret)
+        return false;
+    w.from_txns = polls[0].revents & ZMQ_POLLIN;
+    w.sock = w.from_txns ? w.txns.get () : w.sqls.get ();
+    return true;
 }
 
-sql_stmt conn_pool::read_sql (size_t n, zmq::socket_t &sock)
+sql_stmt conn_pool::read_sql (worker &w)
 {
     cppzmq::packet_t req;
-    sock >> req;
+    *w.sock >> req;
     cppzmq::packet_t addr = req.unseal ();
-    assert (req.size () == 1);
+    assert (!req.empty ());
+
+    // the request, and then the blob frames, if any
+    cppzmq::message_t body (std::move (req.front ()));
+    req.pop_front ();
+    return read_stmt (w, std::move (addr), std::move (body),
+                      std::move (req));
+}
+
+// marks the worker as looking up statements even if the lookup throws
+struct lookup_guard
+{
+    lookup_guard (volatile size_t &lookups) : lookups_ (lookups)
+        {__sync_fetch_and_add (&lookups_, 1);}
+    ~lookup_guard () {__sync_fetch_and_add (&lookups_, 1);}
+private:
+    volatile size_t &lookups_;
+};
 
-    return sql_stmt (addr, req.front (), stmts_);
+// the statements are looked up without locking, and a reload may swap them
+// for others meanwhile, but won't free them until the lookup is done
+sql_stmt conn_pool::read_stmt (worker &w, cppzmq::packet_t &&addr,
+                               cppzmq::message_t &&body,
+                               cppzmq::packet_t &&blobs)
+{
+    lookup_guard g (w.lookups);
+    sql_stmt sql (std::move (addr), std::move (body), std::move (blobs),
+                  w.params, *stmts_);
+    sql.bufs = &w.bufs;
+    return sql;
+}
+
+template <typename Writer>
+static void write_envelope (Writer &w, const sql_res &res, bool has_res)
+{
+    w.begin_object (2 + !!res.id + !!res.txn_seq + res.more + has_res);
+    if (res.id) {
+        w.key ("id");
+        w.uint64 (res.id);
+    }
+    w.key ("code");
+    w.int64 (res.err);
+    w.key ("message");
+    if (res.msg.empty ()) {
+        const char *msg = err_to_str (res.err);
+        w.str (msg, strlen (msg));
+    } else
+        w.str (res.msg);
+    if (res.txn_seq) {
+        w.key ("txn");
+        w.uint64 (res.txn_seq);
+    }
+    if (res.more) {
+        w.key ("more");
+        w.boolean (true);
+    }
+    if (has_res)
+        w.key ("results");
+}
+
+// the caller's envelope in labels, the response, and then the blob frames
+cppzmq::packet_t conn_pool::pack_res (sql_res &&res)
+{
+    assert (!res.empty);
+
+    // the envelope is generated on the stack, and then put in front of the
+    // results, which are never copied if there's enough headroom
+    char stack[res_buf::default_headroom];
+    res_buf head (stack, sizeof (stack));
+    // a batch has results, even if any of its statements fails
+    bool has_res = !res.res.empty ();
+    if (res.enc == msgpack_codec) {
+        mp_writer w (head);
+        write_envelope (w, res, has_res);
+    } else {
+        json_writer w (head);
+        write_envelope (w, res, has_res);
+        if (has_res)
+            res.res.put ('}');
+        else
+            w.end_object ();
+    }
+
+    cppzmq::packet_t p (std::move (res.addr));
+    if (!has_res)
+        p.push_back (head.release ());
+    else if (res.res.prepend (head.data (), head.size ()))
+        p.push_back (res.res.release ());
+    else {
+        head.append (res.res.data (), res.res.size ());
+        p.push_back (head.release ());
+    }
+    // the blobs the results refer to
+    while (has_res && !res.blobs.empty ()) {
+        p.push_back (std::move (res.blobs.front ()));
+        res.blobs.pop_front ();
+    }
+    return p;
 }
 
 void conn_pool::write_res (zmq::socket_t &sock, sql_res &&res)
 {
     if (res.empty)
         return;
+    sock << pack_res (std::move (res));
+}
 
-    ostringstream ss;
-    ss << "{";
-    if (res.id)
-        ss << "\"id\": " << res.id << ", ";
-    ss << "\"code\": " << res.err << ", \"message\": \"" << res.msg << "\"";
-    if (res.txn_seq)
-        ss << ", \"txn\": " << res.txn_seq;
-    if (!res.err && !res.res.empty ())
-        ss << ", \"results\": " << res.res;
-    ss << "}";
-
-    cppzmq::message_t msg (ss.str ());
-    cppzmq::packet_t p (std::move (res.addr));
-    p.push_back (msg);
-
-    sock << p;
+// responses from within txns are given the txn frame by the broker
+void conn_pool::write_res (worker &w, sql_res &&res)
+{
+    write_res (w.in_txn ? *w.txns : *w.sqls, std::move (res));
 }
 
-sql_res conn_pool::proc_sqls (size_t n, sql_res &&res, mysql_conn &conn)
+sql_res conn_pool::proc_sqls (worker &w, sql_res &&res, mysql_conn &conn)
 {
-    zmq::socket_t sqls (ctx_, ZMQ_DEALER);
-    sqls.connect ("inproc://sql-dealer");
+    w.in_txn = false;
 
-    write_res (sqls, res);
+    write_res (w, res);
 
     while (true) {
-        sql_stmt sql = read_sql (n, sqls);
+        wait_sql (w, -1);
+        sql_stmt sql = read_sql (w);
         if (sql.err) {
-            write_res (sqls, sql_res (sql));
+            write_res (w, sql_res (sql));
             continue;
-        } else if (sql.txn_seq) {
+        } else if (sql.txn_seq || w.from_txns) {
             // we're not doing txn here
-            write_res (sqls, sql_res (move (sql), bad_txn));
+            write_res (w, sql_res (move (sql), bad_txn));
             continue;
         }
         sql_res res = conn.execute (sql);
         if (sql.begins_txn ())
             return res;
         else
-            write_res (sqls, res);
+            write_res (w, res);
     }
 }
 
-sql_res conn_pool::proc_txn (size_t n, sql_res &&res, mysql_conn &conn,
+sql_res conn_pool::proc_txn (worker &w, sql_res &&res, mysql_conn &conn,
                              size_t seq)
 {
-    zmq::socket_t txn (ctx_, ZMQ_DEALER);
-    txn.connect ("inproc://txn-router");
+    w.in_txn = true;
 
     assert (!res.empty);
     cppzmq::packet_t addr (res.addr);
-    write_res (txn, res);
+    codec enc = res.enc;
+    write_res (w, res);
 
     while (true) {
-        zmq_pollitem_t polls[1] = {{txn, -1, ZMQ_POLLIN, 0}};
-        int ret = zmq::poll (polls, 1, idle_timeout_ * 1000000);
-        if (ret == 0) {
+        if (!wait_sql (w, idle_timeout_)) {
             // txn timed out, exit the txn
             conn.rollback ();
             // conn.close ();
-            return sql_res (addr, seq, txn_timeout);
+            return sql_res (std::move (addr), enc, seq, txn_timeout);
         }
 
-        assert (ret == 1);
-        assert (polls[0].revents & ZMQ_POLLIN);
-        sql_stmt sql = read_sql (n, txn);
+        sql_stmt sql = read_sql (w);
         if (sql.err)
-            write_res (txn, sql_res (move (sql)));
-        else if (sql.begins_txn ()) {
+            write_res (w, sql_res (move (sql)));
+        else if (sql.begins_txn () || sql.atomic) {
             return sql_res (move (sql), bad_txn,
                             "nested transactions not allowed");
         } else if (sql.txn_seq != seq)
-            write_res (txn, sql_res (move (sql), bad_txn));
+            write_res (w, sql_res (move (sql), bad_txn));
         else if (addr.back () != sql.addr.back ())
-            write_res (txn, sql_res (move (sql), bad_caller));
+            write_res (w, sql_res (move (sql), bad_caller));
         else {
             sql_res res = conn.execute (sql);
             if (sql.ends_txn () || res.err == db_txn)
                 return res;
             else
-                write_res (txn, res);
+                write_res (w, res);
+        }
+    }
+}
+
+// takes the connection used last, so the others are left to be reaped
+// opens another if the open ones are all busy
+// returns null if every connection is held
+mysql_conn *conn_pool::acquire ()
+{
+    unique_lock<mutex> lk (conns_lock_);
+    mysql_conn *conn = 0;
+    if (!idle_conns_.empty ()) {
+        conn = idle_conns_.back ().first;
+        idle_conns_.pop_back ();
+    } else if (!closed_conns_.empty ()) {
+        conn = closed_conns_.back ();
+        closed_conns_.pop_back ();
+    }
+    return conn;
+}
+
+void conn_pool::release (mysql_conn *conn)
+{
+    unique_lock<mutex> lk (conns_lock_);
+    // the connection may have been closed for an error
+    if (conn->is_open ())
+        idle_conns_.push_back (make_pair (conn, time (0)));
+    else
+        closed_conns_.push_back (conn);
+}
+
+// has a connection left unused for reap_timeout_ seconds closed, if there
+// are more than min_conns_ open
+// connections are opened as soon as they're needed, but only closed one a
+// second, so the pool doesn't flap under a load that comes and goes
+// called by the broker of the first shard whenever it wakes up, and the
+// connection is closed by a worker, as it talks to the server, which would
+// hold up the requests the broker passes on
+void conn_pool::reap_conns ()
+{
+    time_t now = time (0);
+    if (!reap_timeout_ || now < last_reap_ + 1)
+        return;
+    last_reap_ = now;
+
+    pair<mysql_conn *, time_t> idle;
+    {
+        unique_lock<mutex> lk (conns_lock_);
+        // the ones held, taken out to be connected, or being closed count
+        // as open
+        size_t open = conns_.size () - closed_conns_.size ();
+        if (idle_conns_.empty () || open <= min_conns_
+            || idle_conns_.front ().second + (time_t) reap_timeout_ > now)
+            return;
+        idle = idle_conns_.front ();
+        idle_conns_.pop_front ();
+    }
+
+    job *j = new job;
+    j->reap = idle.first;
+    if (dispatch (shard_of (0), j))
+        return;
+    // the workers are too far behind, try again later
+    delete j;
+    unique_lock<mutex> lk (conns_lock_);
+    idle_conns_.push_front (idle);
+}
+
+void conn_pool::close_conn (mysql_conn *conn)
+{
+    conn->close ();
+    unique_lock<mutex> lk (conns_lock_);
+    closed_conns_.push_back (conn);
+}
+
+// runs a request of a txn, the broker making sure no other request of the
+// txn is run meanwhile
+sql_res conn_pool::run_txn (job &j, sql_stmt &&sql)
+{
+    open_txn &t = *j.txn;
+    if (sql.err)
+        return sql_res (move (sql));
+    else if (sql.begins_txn () || sql.atomic) {
+        return sql_res (move (sql), bad_txn,
+                        "nested transactions not allowed");
+    } else if (sql.txn_seq != t.seq)
+        return sql_res (move (sql), bad_txn);
+    else if (t.addr.back () != sql.addr.back ())
+        return sql_res (move (sql), bad_caller);
+
+    sql_res res = t.conn->execute (sql);
+    if (sql.ends_txn () || res.err == db_txn) {
+        release (t.conn);
+        j.ends = true;
+    }
+    return res;
+}
+
+sql_res conn_pool::run_job (worker &w, job &j)
+{
+    if (j.timeout) {
+        // txn timed out, exit the txn
+        open_txn &t = *j.txn;
+        t.conn->rollback ();
+        release (t.conn);
+        j.ends = true;
+        return sql_res (cppzmq::packet_t (t.addr), t.enc, t.seq, txn_timeout);
+    }
+
+    // the request, and then the blob frames, if any
+    assert (!j.frames.empty ());
+    cppzmq::message_t body (std::move (j.frames.front ()));
+    j.frames.pop_front ();
+    sql_stmt sql = read_stmt (w, std::move (j.addr), std::move (body),
+                              std::move (j.frames));
+    // hands the stream, if any, to the job when the request is done
+    chunk_sink sink (*this, w, j);
+    sql.sink = &sink;
+    if (j.txn)
+        return run_txn (j, move (sql));
+    if (sql.err)
+        return sql_res (move (sql));
+    else if (sql.txn_seq) {
+        // we're not doing txn here
+        return sql_res (move (sql), bad_txn);
+    }
+
+    mysql_conn *conn = acquire ();
+    if (!conn) {
+        // every connection is held by a txn
+        return sql_res (move (sql), busy);
+    }
+    sql_res res = sql.parallel ? run_parallel (w, move (sql), *conn)
+        : conn->execute (sql);
+    if (sql.begins_txn () && !res.err) {
+        // the connection is held by the txn until it ends
+        j.txn = new open_txn (conn, next_txn (), res.addr, res.enc);
+        res.txn_seq = j.txn->seq;
+    } else
+        release (conn);
+    return res;
+}
+
+// how long a caller may take to ack a chunk, in milliseconds, kept short, as
+// the worker, and its connection, wait meanwhile
+static const int ack_timeout = 5000;
+
+// the worker waits for the caller to ack the chunks sent before, as the rows
+// are fetched no faster than the caller takes them, while the server can well
+// wait for the rows to be read
+// a caller that acks nothing for ack_timeout fails the stream, so a caller
+// gone away takes a worker for seconds, not for the txn idle timeout
+void conn_pool::chunk_sink::send (sql_res &&chunk)
+{
+    if (!stream_)
+        stream_ = new open_stream;
+    open_stream &s = *stream_;
+    while (s.unacked >= stream_window) {
+        if (!fiber_loop::poll (s.wake, POLLIN, ack_timeout))
+            throw coded_error (stream_timeout);
+        take (s.wake);
+    }
+
+    shard &sh = pool_.shard_of (w_.n);
+    job *c = &s.chunks[s.next++ % stream_window];
+    c->frames = pool_.pack_res (std::move (chunk));
+    c->addr = c->frames.unseal ();
+    c->txn = j_.txn;
+    c->stream = &s;
+    c->chunk = true;
+    __sync_fetch_and_add (&s.unacked, 1);
+    while (!sh.replies.push (c))
+        sched_yield ();
+    notify (sh.replies_wake);
+}
+
+// the statements are taken in order, but may be done in any order
+void conn_pool::run_parts (fan_out &f, mysql_conn &conn)
+{
+    size_t i;
+    while ((i = __sync_fetch_and_add (&f.next, 1)) < f.parts.size ()) {
+        f.errs[i] = conn.execute (*f.stmt, f.stmt->params->entries[i],
+                                  f.parts[i], f.msgs[i]);
+        if (__sync_add_and_fetch (&f.done, 1) == f.parts.size ())
+            notify (f.wake);
+    }
+}
+
+void conn_pool::let_go (fan_out *f)
+{
+    if (!__sync_sub_and_fetch (&f->refs, 1))
+        delete f;
+}
+
+// a helper taken after all the statements are taken has nothing to do, and
+// one finding no connection leaves the statements to the others
+void conn_pool::help (fan_out &f)
+{
+    if (f.next < f.parts.size ()) {
+        mysql_conn *conn = acquire ();
+        if (conn) {
+            run_parts (f, *conn);
+            release (conn);
         }
     }
+    let_go (&f);
+}
+
+// the answers are put together in the order of the statements, and the
+// batch is answered by the code of the first failure, as if run in order
+// the helpers are dispatched only if the workers aren't too far behind
+sql_res conn_pool::run_parallel (worker &w, sql_stmt &&sql, mysql_conn &conn)
+{
+    // the batch taken last is reused, unless a helper of it hasn't been
+    // taken yet, and none but the worker adds to its refs
+    if (w.fan && w.fan->refs > 1) {
+        let_go (w.fan);
+        w.fan = 0;
+    }
+    if (!w.fan)
+        w.fan = new fan_out (parallel_cap_ - 1);
+    fan_out *f = w.fan;
+    size_t n = sql.params->entries.size ();
+    f->reset (sql, n);
+    shard &sh = shard_of (w.n);
+    for (size_t i = 1; i < min (n, parallel_cap_); ++i) {
+        __sync_fetch_and_add (&f->refs, 1);
+        if (!dispatch (sh, &f->helpers[i - 1])) {
+            let_go (f);
+            break;
+        }
+    }
+    run_parts (*f, conn);
+    while (f->done < n) {
+        fiber_loop::poll (f->wake, POLLIN, -1);
+        take (f->wake);
+    }
+
+    res_buf rb = sql.bufs ? res_buf (*sql.bufs) : res_buf ();
+    if (sql.enc == msgpack_codec) {
+        mp_writer wr (rb);
+        wr.begin_array (n);
+        for (size_t i = 0; i < n; ++i)
+            wr.raw (f->parts[i].data (), f->parts[i].size ());
+    } else {
+        json_writer wr (rb);
+        wr.begin_array (n);
+        for (size_t i = 0; i < n; ++i)
+            wr.raw (f->parts[i].data (), f->parts[i].size ());
+        wr.end_array ();
+    }
+    sql_res res (move (sql), move (rb));
+    for (size_t i = 0; i < n && !res.err; ++i) {
+        res.err = f->errs[i];
+        res.msg = f->msgs[i];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        f->parts[i] = res_buf ();
+        f->msgs[i].clear ();
+    }
+    return res;
+}
+
+// takes the requests of the shard, out of txns, or of any txn begun by the
+// workers of the shard, so an open txn holds a connection, but not a worker
+void conn_pool::proc_jobs (worker &w)
+{
+    // the connections are used by whichever worker takes the requests
+    mysql_thread_init ();
+
+    shard &sh = shard_of (w.n);
+    while (true) {
+        // a fiber only waits by itself, the others on the loop keep running
+        fiber_loop::poll (sh.jobs_wake, POLLIN, -1);
+
+        // every count of the eventfd stands for a job, but other workers
+        // may take it first, if woken up at the same time
+        if (!take (sh.jobs_wake))
+            continue;
+        job *j;
+        // pushed before counted, by the broker, or by the workers running
+        // parallel batches, so it must be there
+        while (!sh.jobs.pop (j))
+            sched_yield ();
+        if (j->reap) {
+            close_conn (j->reap);
+            delete j;
+            continue;
+        } else if (j->fan) {
+            // the job belongs to the batch, which may be gone once let go
+            help (*j->fan);
+            continue;
+        }
+
+        sql_res res = run_job (w, *j);
+        j->frames = pack_res (move (res));
+        j->addr = j->frames.unseal ();
+        // responses can't be dropped, wait for the broker to catch up
+        while (!sh.replies.push (j))
+            sched_yield ();
+        notify (sh.replies_wake);
+    }
 }
 
 void conn_pool::real_proc (size_t n)
 {
-    mysql_conn conn (host_, port_, user_, password_, db_, db_timeout_);
+    worker &w = *workers_[n];
+    if (!inproc_) {
+        proc_jobs (w);
+        return;
+    }
+
+    // the identity the txn router knows the worker by lives as long as the
+    // worker, stale txn requests are told apart by the txn seq
+    size_t sh = shard_of (n).n;
+    w.sqls.reset (new zmq::socket_t (ctx_, ZMQ_DEALER));
+    w.sqls->connect (inproc_addr ("sql-dealer", sh).c_str ());
+    w.txns.reset (new zmq::socket_t (ctx_, ZMQ_DEALER));
+    w.txns->connect (inproc_addr ("txn-router", sh).c_str ());
 
+    mysql_conn conn (host_, port_, user_, password_, db_, db_timeout_, false,
+                     stmt_cap_);
+    w.conn = &conn;
     sql_res res;
     while (true) {
-        res = proc_sqls (n, move (res), conn);
+        res = proc_sqls (w, move (res), conn);
         size_t seq = next_txn ();
         res.txn_seq = seq;
-        res = proc_txn (n, move (res), conn, seq);
+        res = proc_txn (w, move (res), conn, seq);
     }
 }
 
@@ -175,7 +767,345 @@ void *conn_pool::proc (void *p)
     return 0;
 }
 
-void conn_pool::start ()
+void *conn_pool::run_fibers (void *p)
+{
+    assert (p);
+    ((fiber_loop *) p)->run ();
+    return 0;
+}
+
+// in the order of the statements files
+static bool stmt_order (const mysql_stmt *a, const mysql_stmt *b)
+{
+    int c = a->file.compare (b->file);
+    return c ? c < 0 : a->lineno < b->lineno;
+}
+
+void *conn_pool::init_some (void *p)
+{
+    assert (p);
+    init_arg &arg = *(init_arg *) p;
+    conn_pool &pool = arg.pool;
+    mysql_thread_init ();
+    MYSQL *conn = 0;
+    try {
+        while (true) {
+            size_t i = __sync_fetch_and_add (&arg.next, 1);
+            if (i >= arg.stmts.size ())
+                break;
+            // each error is written by only the thread taking the statement
+            arg.errs[i] = arg.stmts[i]->init_results (
+                conn, pool.host_, pool.port_, pool.user_, pool.password_,
+                pool.db_, arg.timeout);
+        }
+    } catch (const std::exception &e) {
+        unique_lock<mutex> lk (arg.lock);
+        if (arg.fatal.empty ())
+            arg.fatal = e.what ();
+    }
+    if (conn)
+        mysql_close (conn);
+    mysql_thread_end ();
+    return 0;
+}
+
+// finds out the results of all the statements, a round trip each, over a
+// few connections at once, so many statements don't take long
+// the version of the schema the statements are looked into against, empty
+// if it can't be found out, and the cache not to be used
+static string cached_version (const string &host, unsigned short port,
+                              const string &user, const string &password,
+                              const string &db, size_t timeout)
+{
+    MYSQL *conn = 0;
+    try {
+        conn = connect_mysql (host, port, user, password, db, timeout);
+        string version = schema_version (conn);
+        mysql_close (conn);
+        return version;
+    } catch (const std::exception &e) {
+        cerr << "not using statements cache: " << e.what () << endl << flush;
+        if (conn)
+            mysql_close (conn);
+        return "";
+    }
+}
+
+// the statements taken over from the old ones are known already
+void conn_pool::init_results (stmt_map &stmts, const stmt_map *old)
+{
+    vector<mysql_stmt *> unknown;
+    stmt_map::iterator it;
+    for (it = stmts.begin (); it != stmts.end (); ++it) {
+        stmt_map::const_iterator o;
+        if (old && (o = old->find (it->first)) != old->end ()
+            && o->second == it->second)
+            continue;
+        unknown.push_back (it->second.get ());
+    }
+    if (unknown.empty ())
+        return;
+
+    stmt_cache cache;
+    string version;
+    if (!stmts_cache_.empty ()) {
+        version = cached_version (host_, port_, user_, password_, db_,
+                                  stmts_timeout_);
+        if (!version.empty ())
+            cache.load (stmts_cache_, version);
+    }
+
+    init_arg arg (*this, stmts_timeout_);
+    size_t cached = 0;
+    for (size_t i = 0; i < unknown.size (); ++i) {
+        if (cache.find (*unknown[i]))
+            ++cached;
+        else
+            arg.stmts.push_back (unknown[i]);
+    }
+    if (!stmts_cache_.empty ()) {
+        clog << "loaded results of " << cached << " of " << unknown.size ()
+             << " statements from cache" << endl << flush;
+    }
+    sort (arg.stmts.begin (), arg.stmts.end (), &stmt_order);
+    arg.errs.resize (arg.stmts.size ());
+
+    vector<pthread_t> threads (min (arg.stmts.size (), init_threads));
+    for (size_t i = 0; i < threads.size (); ++i) {
+        if (pthread_create (&threads[i], 0, &conn_pool::init_some, &arg)) {
+            // the threads started take all the statements
+            threads.resize (i);
+            break;
+        }
+    }
+    if (threads.empty ())
+        init_some (&arg);
+    for (size_t i = 0; i < threads.size (); ++i)
+        pthread_join (threads[i], 0);
+
+    if (!arg.fatal.empty ()) {
+        cerr << arg.fatal << endl << flush;
+        throw runtime_error ("");
+    }
+    size_t failed = 0;
+    for (size_t i = 0; i < arg.stmts.size (); ++i) {
+        if (arg.errs[i].empty ())
+            continue;
+        const mysql_stmt &stmt = *arg.stmts[i];
+        cerr << stmt.file << ":" << stmt.lineno << ": " << stmt.name
+             << ": failed to init result info due to: " << arg.errs[i]
+             << "; sql: " << endl << stmt.sql << endl;
+        ++failed;
+    }
+    if (failed) {
+        cerr << failed << " of " << arg.stmts.size ()
+             << " statements failed to init result info" << endl;
+    }
+    cerr << flush;
+
+    // the statements dropped from the files are dropped from the cache,
+    // and those that failed are asked about again next time
+    if (version.empty () || arg.stmts.empty ())
+        return;
+    stmt_cache fresh;
+    for (it = stmts.begin (); it != stmts.end (); ++it)
+        fresh.add (*it->second);
+    for (size_t i = 0; i < arg.stmts.size (); ++i) {
+        if (!arg.errs[i].empty ())
+            fresh.remove (*arg.stmts[i]);
+    }
+    try {
+        fresh.save (stmts_cache_, version);
+    } catch (const std::exception &e) {
+        cerr << e.what () << endl << flush;
+    }
+}
+
+static bool entry_order (const stmt_map::iterator &a,
+                         const stmt_map::iterator &b)
+{
+    return stmt_order (a->second.get (), b->second.get ());
+}
+
+// reads the statements files into new statements, taking over the old
+// statements unchanged, which keep their results, and stay prepared on the
+// connections
+// the statements of the names known keep their ids, and the new ones are
+// given ids in the order of the files, so the same files give the same ids
+stmt_registry *conn_pool::load_stmts ()
+{
+    stmt_registry *reg = new stmt_registry;
+    try {
+        stmt_map &stmts = reg->by_name;
+        tr1::unordered_set<string> including;
+        read_stmts (stmts, stmts_dir_, stmts_file_, including, find_db_);
+
+        const stmt_registry *old = stmts_;
+        stmt_list &by_id = *reg->by_id;
+        if (old)
+            by_id.resize (old->by_id->size ());
+        vector<stmt_map::iterator> fresh;
+        for (stmt_map::iterator it = stmts.begin (); it != stmts.end ();
+             ++it) {
+            stmt_map::const_iterator o;
+            if (!old || (o = old->by_name.find (it->first))
+                == old->by_name.end ()) {
+                fresh.push_back (it);
+                continue;
+            }
+            if (o->second->sql == it->second->sql
+                && o->second->insert_id == it->second->insert_id
+                && o->second->stream == it->second->stream)
+                it->second = o->second;
+            else
+                it->second->id = o->second->id;
+            by_id[it->second->id] = it->second;
+        }
+        sort (fresh.begin (), fresh.end (), &entry_order);
+        for (size_t i = 0; i < fresh.size (); ++i) {
+            fresh[i]->second->id = by_id.size ();
+            by_id.push_back (fresh[i]->second);
+        }
+
+        init_results (stmts, old ? &old->by_name : 0);
+    } catch (...) {
+        delete reg;
+        throw;
+    }
+    return reg;
+}
+
+void conn_pool::reload_stmts ()
+{
+    unique_lock<mutex> lk (reload_lock_);
+    if (!stmts_read_)
+        throw logic_error ("init statements first, and then reload them");
+
+    stmt_registry *stmts;
+    try {
+        stmts = load_stmts ();
+    } catch (const std::exception &) {
+        // told why already
+        cerr << "failed to reload statements, keeping the ones loaded before"
+             << endl << flush;
+        return;
+    }
+
+    stmt_registry *old = stmts_;
+    __sync_synchronize ();
+    stmts_ = stmts;
+    __sync_synchronize ();
+
+    // the workers looking up statements at the swap may be reading the old
+    // ones, until their counts of lookups move on
+    for (size_t i = 0; i < workers_.size (); ++i) {
+        volatile size_t &lookups = workers_[i]->lookups;
+        size_t n = lookups;
+        while ((n & 1) && lookups == n)
+            usleep (100);
+    }
+    delete old;
+    clog << "reloaded " << stmts->by_name.size () << " statements" << endl
+         << flush;
+}
+
+// the connections are never freed while the pool runs, and their counters
+// only grow, so they're summed without stopping the workers
+stmt_stats conn_pool::prepared_stats ()
+{
+    stmt_stats sum;
+    vector<const mysql_conn *> conns;
+    for (size_t i = 0; i < conns_.size (); ++i)
+        conns.push_back (conns_[i].get ());
+    for (size_t i = 0; i < workers_.size (); ++i) {
+        if (workers_[i]->conn)
+            conns.push_back (workers_[i]->conn);
+    }
+    for (size_t i = 0; i < conns.size (); ++i) {
+        const stmt_stats &st = conns[i]->stats ();
+        sum.hits += st.hits;
+        sum.misses += st.misses;
+        sum.evicts += st.evicts;
+    }
+    return sum;
+}
+
+void *conn_pool::warm_conns (void *p)
+{
+    assert (p);
+    warm_arg &arg = *(warm_arg *) p;
+    mysql_thread_init ();
+    while (true) {
+        size_t i = __sync_fetch_and_add (&arg.next, 1);
+        if (i >= arg.conns.size ())
+            break;
+        try {
+            arg.conns[i]->warm_up (arg.pool.stmts_->by_name);
+        } catch (const coded_error &e) {
+            // left to be connected when used, like without warming up
+            cerr << "failed to warm up connection: " << e.what () << endl
+                 << flush;
+            __sync_fetch_and_add (&arg.failed, 1);
+        }
+        __sync_fetch_and_add (&arg.done, 1);
+    }
+    mysql_thread_end ();
+    return 0;
+}
+
+// opens the connections kept open, the min of an elastic pool, or all of
+// them, and prepares the statements on each, several connections at a time
+void conn_pool::warm_up ()
+{
+    if (inproc_)
+        return;
+
+    warm_arg arg (*this);
+    size_t n = reap_timeout_ ? min_conns_ : conns_.size ();
+    for (size_t i = 0; i < n; ++i)
+        arg.conns.push_back (acquire ());
+    if (arg.conns.empty ())
+        return;
+
+    clog << "warming up " << n << " connections, with "
+         << stmts_->by_name.size () << " statements each" << endl << flush;
+    struct timeval start;
+    gettimeofday (&start, 0);
+
+    vector<pthread_t> threads (min (n, warm_threads));
+    for (size_t i = 0; i < threads.size (); ++i) {
+        if (pthread_create (&threads[i], 0, &conn_pool::warm_conns, &arg))
+            throw runtime_error ("failed to create more threads");
+    }
+    size_t reported = 0;
+    for (size_t ticks = 1; ; ++ticks) {
+        usleep (100000);
+        size_t done = __sync_fetch_and_add (&arg.done, 0);
+        if (done == n)
+            break;
+        if (!(ticks % 10) && done != reported) {
+            clog << "warmed up " << done << " of " << n << " connections"
+                 << endl << flush;
+            reported = done;
+        }
+    }
+    for (size_t i = 0; i < threads.size (); ++i)
+        pthread_join (threads[i], 0);
+    for (size_t i = 0; i < n; ++i)
+        release (arg.conns[i]);
+
+    struct timeval end;
+    gettimeofday (&end, 0);
+    double secs = end.tv_sec - start.tv_sec
+        + (end.tv_usec - start.tv_usec) / 1e6;
+    clog << "warmed up " << n - arg.failed << " connections in " << secs
+         << " seconds";
+    if (arg.failed)
+        clog << ", " << arg.failed << " failed";
+    clog << endl << flush;
+}
+
+void conn_pool::start (bool warm)
 {
     if (!stmts_read_)
         throw logic_error ("init statements first, and then start pool");
@@ -183,10 +1113,31 @@ void conn_pool::start ()
     if (started_)
         return;
 
+    // before listening, so no request waits for a connection to be made
+    if (warm)
+        warm_up ();
+
     // create the zmq sockets
-    server_.bind (listen_.c_str ());
-    sqls_.bind ("inproc://sql-dealer");
-    txns_.bind ("inproc://txn-router");
+    // inproc sockets have to be bound before being connected to
+    for (size_t i = 0; i < shards_.size (); ++i) {
+        shard &sh = *shards_[i];
+        sh.server.bind (sh.listen.c_str ());
+        sh.hops.bind (inproc_addr ("broker-hop", i).c_str ());
+        if (inproc_) {
+            sh.sqls.bind (inproc_addr ("sql-dealer", i).c_str ());
+            sh.txns.bind (inproc_addr ("txn-router", i).c_str ());
+        }
+    }
+    for (size_t i = 0; i < shards_.size (); ++i) {
+        shard &sh = *shards_[i];
+        sh.peers.resize (shards_.size ());
+        for (size_t j = 0; j < shards_.size (); ++j) {
+            if (j == i)
+                continue;
+            sh.peers[j].reset (new zmq::socket_t (ctx_, ZMQ_PUSH));
+            sh.peers[j]->connect (inproc_addr ("broker-hop", j).c_str ());
+        }
+    }
 
     // start the exec threads
     pthread_attr_t attr;
@@ -194,15 +1145,34 @@ void conn_pool::start ()
         throw bad_alloc ();
     if (pthread_attr_setstacksize (&attr, 64 << 10))
         throw invalid_argument ("bad stack size");
+    if (async_) {
+        // the loops serving a shard are those numbered the same modulo the
+        // number of shards, and the workers of the shard are dealt out to
+        // them in turn
+        size_t shards = shards_.size ();
+        for (size_t i = 0; i < threads_.size (); ++i)
+            loops_.push_back (tr1::shared_ptr<fiber_loop> (new fiber_loop));
+        for (size_t i = 0; i < workers_.size (); ++i) {
+            size_t sh = i % shards;
+            size_t loops = (threads_.size () - sh + shards - 1) / shards;
+            fiber_loop &loop = *loops_[sh + i / shards % loops * shards];
+            loop.spawn (&conn_pool::proc, new proc_arg (*this, i), 64 << 10);
+        }
+    }
     for (size_t i = 0; i < threads_.size (); ++i) {
-        if (pthread_create (&threads_[i], &attr, &conn_pool::proc,
-                            new proc_arg (*this, i)))
+        if (async_ ? pthread_create (&threads_[i], &attr,
+                                     &conn_pool::run_fibers, loops_[i].get ())
+            : pthread_create (&threads_[i], &attr, &conn_pool::proc,
+                              new proc_arg (*this, i)))
             throw runtime_error ("failed to create more threads");
     }
 
-    // start the server thread
-    if (pthread_create (&svrth_, &attr, &conn_pool::serve, this))
-        throw runtime_error ("failed to create more threads");
+    // start the server threads
+    for (size_t i = 0; i < shards_.size (); ++i) {
+        if (pthread_create (&shards_[i]->thread, &attr, &conn_pool::serve,
+                            new serve_arg (*this, *shards_[i])))
+            throw runtime_error ("failed to create more threads");
+    }
 
     started_ = true;
 }
@@ -220,80 +1190,525 @@ size_t conn_pool::next_txn ()
 void *conn_pool::serve (void *p)
 {
     assert (p);
-    ((conn_pool *) p)->real_serve ();
+    serve_arg *arg = (serve_arg *) p;
+    conn_pool &pool = arg->pool;
+    shard &sh = arg->sh;
+    delete arg;
+    pool.real_serve (sh);
     return 0;
 }
 
-void conn_pool::proc_res (bool from_txn)
+// every request passed to the workers carries the shard it came in from, in
+// a label before the caller's envelope, so that the response can be sent out
+// from the same shard
+static cppzmq::message_t origin_label (size_t n)
+{
+    cppzmq::message_t m ((size_t) 1);
+    *(unsigned char *) m.data () = n;
+    m.label (true);
+    return m;
+}
+
+// the txn frame handed to callers is the identity of the txn, followed by
+// the shard it's kept in
+// on the inproc path, the identity is the one zmq generated for the worker
+// in txn, which always starts with a zero byte, and on the queue path, it's
+// a zero byte followed by the slot of the txn, so the broker can tell a txn
+// frame from a request
+static cppzmq::message_t txn_frame (const cppzmq::message_t &id, size_t n)
+{
+    cppzmq::message_t m (id.size () + 1);
+    memcpy (m.data (), id.data (), id.size ());
+    ((unsigned char *) m.data ())[id.size ()] = n;
+    return m;
+}
+
+static const size_t txn_id_size = 5;
+
+static cppzmq::message_t txn_id (size_t slot)
+{
+    cppzmq::message_t m (txn_id_size);
+    unsigned char *p = (unsigned char *) m.data ();
+    p[0] = 0;
+    for (size_t i = txn_id_size - 1; i > 0; --i, slot >>= 8)
+        p[i] = slot & 0xff;
+    return m;
+}
+
+// returns false if it's not the identity of a txn
+static bool slot_of (const cppzmq::message_t &id, size_t &slot)
+{
+    if (id.size () != txn_id_size)
+        return false;
+    const unsigned char *p = (const unsigned char *) id.data ();
+    slot = 0;
+    for (size_t i = 1; i < txn_id_size; ++i)
+        slot = (slot << 8) | p[i];
+    return true;
+}
+
+// the stream frame handed to callers with each chunk is a byte of one, as
+// no request starts with it, the slot of the stream, its seq, and then the
+// shard it's kept in
+// the caller acks the chunk by sending the frame back, alone, and is never
+// answered
+static const size_t stream_frame_size = 10;
+
+static cppzmq::message_t stream_frame (size_t slot, size_t seq, size_t n)
+{
+    cppzmq::message_t m (stream_frame_size);
+    unsigned char *p = (unsigned char *) m.data ();
+    p[0] = 1;
+    for (size_t i = 4; i > 0; --i, slot >>= 8, seq >>= 8) {
+        p[i] = slot & 0xff;
+        p[i + 4] = seq & 0xff;
+    }
+    p[stream_frame_size - 1] = n;
+    return m;
+}
+
+static bool is_ack (const cppzmq::packet_t &req)
+{
+    return req.size () == 1 && req.front ().size () == stream_frame_size
+        && *(const char *) req.front ().data () == 1;
+}
+
+enum hop_kind
+{
+    hop_req, hop_res, hop_ack,
+};
+
+// labels can't go through pipes, so the envelope is sent as plain frames,
+// after a frame telling what's passed over, and how many labels there are
+static void send_hop (zmq::socket_t &sock, hop_kind kind,
+                      cppzmq::packet_t &&env, cppzmq::packet_t &&body)
+{
+    cppzmq::packet_t p;
+    cppzmq::message_t head ((size_t) 2);
+    ((unsigned char *) head.data ())[0] = kind;
+    ((unsigned char *) head.data ())[1] = env.size ();
+    p.push_back (std::move (head));
+    while (!env.empty ()) {
+        env.front ().label (false);
+        p.push_back (std::move (env.front ()));
+        env.pop_front ();
+    }
+    while (!body.empty ()) {
+        p.push_back (std::move (body.front ()));
+        body.pop_front ();
+    }
+    sock << p;
+}
+
+// sends a response out of the shard the request came in from
+void conn_pool::to_caller (shard &sh, cppzmq::packet_t &&env,
+                           cppzmq::packet_t &&res)
+{
+    assert (!env.empty () && env.front ().size () == 1);
+    size_t origin = *(const unsigned char *) env.front ().data ();
+    env.pop_front ();
+
+    if (origin != sh.n) {
+        send_hop (*sh.peers[origin], hop_res, std::move (env), std::move (res));
+        return;
+    }
+    // the txn frame if any, the response, and then the blob frames, if any
+    while (!res.empty ()) {
+        env.push_back (std::move (res.front ()));
+        res.pop_front ();
+    }
+
+    sh.server << env;
+}
+
+// answers a request in place of the workers
+void conn_pool::reject (shard &sh, cppzmq::packet_t &&env,
+                        const cppzmq::message_t &body, error e)
+{
+    // answer in whatever the caller seems to speak
+    codec enc = sniff_codec (body.data (), body.size ());
+    cppzmq::packet_t res = pack_res (sql_res (std::move (env), enc, 0, e));
+    cppzmq::packet_t addr = res.unseal ();
+    to_caller (sh, std::move (addr), std::move (res));
+}
+
+// returns false if the workers are too far behind
+bool conn_pool::dispatch (shard &sh, job *j)
+{
+    if (!sh.jobs.push (j))
+        return false;
+    notify (sh.jobs_wake);
+    return true;
+}
+
+// passes a request to the workers of this shard
+// a txn request starts with the identity of the worker or the txn
+void conn_pool::to_worker (shard &sh, cppzmq::packet_t &&env,
+                           cppzmq::packet_t &&req, bool txn)
+{
+    if (inproc_) {
+        if (txn) {
+            req.front ().label (true);
+            env.push_front (std::move (req.front ()));
+            req.pop_front ();
+        }
+        while (!req.empty ()) {
+            env.push_back (std::move (req.front ()));
+            req.pop_front ();
+        }
+        (txn ? sh.txns : sh.sqls) << env;
+        return;
+    }
+
+    open_txn *t = 0;
+    if (txn) {
+        size_t slot;
+        if (!slot_of (req.front (), slot)) {
+            reject (sh, std::move (env), req[1], bad_proto);
+            return;
+        }
+        req.pop_front ();
+        // the txn has ended, or has never been
+        if (slot >= sh.open_txns.size () || !(t = sh.open_txns[slot])) {
+            reject (sh, std::move (env), req.front (), bad_txn);
+            return;
+        }
+    }
+
+    job *j = new_job (sh);
+    j->addr = std::move (env);
+    j->frames = std::move (req);
+    if (t)
+        to_txn (sh, *t, j);
+    else if (!dispatch (sh, j)) {
+        reject (sh, std::move (j->addr), j->frames.front (), busy);
+        free_job (sh, j);
+    }
+}
+
+// no more jobs are kept than can be queued to the workers at once
+conn_pool::job *conn_pool::new_job (shard &sh)
+{
+    if (sh.spare_jobs.empty ())
+        return new job;
+    job *j = sh.spare_jobs.back ();
+    sh.spare_jobs.pop_back ();
+    return j;
+}
+
+void conn_pool::free_job (shard &sh, job *j)
+{
+    if (sh.spare_jobs.size () >= jobs_size) {
+        delete j;
+        return;
+    }
+    j->addr.clear ();
+    j->frames.clear ();
+    j->txn = 0;
+    j->timeout = false;
+    j->ends = false;
+    j->stream = 0;
+    sh.spare_jobs.push_back (j);
+}
+
+void conn_pool::keep_stream (shard &sh, open_stream *s)
+{
+    if (sh.free_streams.empty ()) {
+        s->slot = sh.open_streams.size ();
+        sh.open_streams.push_back (s);
+    } else {
+        s->slot = sh.free_streams.back ();
+        sh.free_streams.pop_back ();
+        sh.open_streams[s->slot] = s;
+    }
+    // the seq fits in the 4 bytes of the stream frame
+    s->seq = sh.stream_seq++ & 0xffffffff;
+}
+
+// the chunks of the stream have all been sent, so the worker is done with it
+void conn_pool::end_stream (shard &sh, open_stream *s)
+{
+    if (s->slot != no_slot) {
+        sh.open_streams[s->slot] = 0;
+        sh.free_streams.push_back (s->slot);
+    }
+    delete s;
+}
+
+// the acks of a stream ended, or of chunks not sent yet, are ignored
+void conn_pool::ack_chunk (shard &sh, const cppzmq::message_t &frame)
+{
+    const unsigned char *p = (const unsigned char *) frame.data ();
+    size_t slot = 0, seq = 0;
+    for (size_t i = 1; i < 5; ++i) {
+        slot = (slot << 8) | p[i];
+        seq = (seq << 8) | p[i + 4];
+    }
+    open_stream *s;
+    if (slot >= sh.open_streams.size () || !(s = sh.open_streams[slot])
+        || s->seq != seq || s->acked == s->sent)
+        return;
+    ++s->acked;
+    __sync_fetch_and_sub (&s->unacked, 1);
+    notify (s->wake);
+}
+
+// a txn runs one request at a time, the others waiting for their turn
+void conn_pool::to_txn (shard &sh, open_txn &t, job *j)
+{
+    j->txn = &t;
+    if (t.busy) {
+        t.waiting.push_back (j);
+        return;
+    }
+
+    t.busy = true;
+    if (!dispatch (sh, j)) {
+        t.busy = false;
+        reject (sh, std::move (j->addr), j->frames.front (), busy);
+        free_job (sh, j);
+        return;
+    }
+    sh.idle_txns.cancel (t.idle);
+}
+
+// forgets a txn ended, turning the requests waiting for it away
+void conn_pool::end_txn (shard &sh, open_txn *t)
+{
+    sh.idle_txns.cancel (t->idle);
+    if (t->slot != no_slot) {
+        sh.open_txns[t->slot] = 0;
+        sh.free_slots.push_back (t->slot);
+    }
+    while (!t->waiting.empty ()) {
+        job *j = t->waiting.front ();
+        t->waiting.pop_front ();
+        reject (sh, std::move (j->addr), j->frames.front (), bad_txn);
+        free_job (sh, j);
+    }
+    delete t;
+}
+
+void conn_pool::proc_res (shard &sh, bool from_txn)
 {
     cppzmq::packet_t res;
-    (from_txn ? txns_ : sqls_) >> res;
+    (from_txn ? sh.txns : sh.sqls) >> res;
     cppzmq::packet_t p = res.unseal ();
-    assert (res.size () == 1);
+    assert (!res.empty ());
 
     if (from_txn) {
-        cppzmq::message_t txn = move (p.front ());
-        txn.label (false);
+        res.push_front (txn_frame (p.front (), sh.n));
         p.pop_front ();
-        p.push_back (txn);
     }
-    p.push_back (move (res.front ()));
+    to_caller (sh, std::move (p), std::move (res));
+}
+
+void conn_pool::proc_replies (shard &sh)
+{
+    take (sh.replies_wake);
+    job *j;
+    while (sh.replies.pop (j)) {
+        open_txn *t = j->txn;
+        open_stream *s = j->stream;
+        if (j->chunk) {
+            // the txn goes on, with the rest of the results to come
+            // the job belongs to the stream, and is made again by the worker
+            // once the chunk is acked
+            if (s->slot == no_slot)
+                keep_stream (sh, s);
+            ++s->sent;
+            j->frames.push_front (stream_frame (s->slot, s->seq, sh.n));
+            if (t && t->slot != no_slot)
+                j->frames.push_front (txn_frame (txn_id (t->slot), sh.n));
+            to_caller (sh, std::move (j->addr), std::move (j->frames));
+            continue;
+        }
+        if (s)
+            end_stream (sh, s);
+        if (t && j->ends) {
+            end_txn (sh, t);
+            t = 0;
+        } else if (t) {
+            if (t->slot == no_slot) {
+                // just begun, keep it until it ends
+                if (sh.free_slots.empty ()) {
+                    t->slot = sh.open_txns.size ();
+                    sh.open_txns.push_back (t);
+                } else {
+                    t->slot = sh.free_slots.back ();
+                    sh.free_slots.pop_back ();
+                    sh.open_txns[t->slot] = t;
+                }
+            }
+            j->frames.push_front (txn_frame (txn_id (t->slot), sh.n));
+        }
+        to_caller (sh, std::move (j->addr), std::move (j->frames));
+        free_job (sh, j);
 
-    server_ << p;
+        if (!t)
+            continue;
+        // on to the next request of the txn, if any
+        t->busy = false;
+        while (!t->busy && !t->waiting.empty ()) {
+            job *next = t->waiting.front ();
+            t->waiting.pop_front ();
+            to_txn (sh, *t, next);
+        }
+        if (!t->busy)
+            sh.idle_txns.add (t->idle, t, idle_timeout_);
+    }
 }
 
-static void send_bad_proto (zmq::socket_t &server, cppzmq::packet_t &&addr)
+// has the txns idle for too long rolled back by the workers
+void conn_pool::expire_txns (shard &sh)
 {
-    cppzmq::message_t bad_proto ("{\"code\": 1, "
-                                 "\"message\": \"bad protocol\"}");
-    cppzmq::packet_t p (addr);
-    p.push_back (bad_proto);
-    server << addr;
+    vector<open_txn *> expired;
+    sh.idle_txns.advance (time (0), back_inserter (expired));
+    for (size_t i = 0; i < expired.size (); ++i) {
+        open_txn *t = expired[i];
+        t->idle.armed = false;
+
+        job *j = new_job (sh);
+        j->txn = t;
+        j->timeout = true;
+        t->busy = true;
+        if (!dispatch (sh, j)) {
+            // try again later
+            free_job (sh, j);
+            t->busy = false;
+            sh.idle_txns.add (t->idle, t, 1);
+        }
+    }
 }
 
-void conn_pool::proc_req ()
+void conn_pool::proc_req (shard &sh)
 {
     cppzmq::packet_t req;
-    server_ >> req;
+    sh.server >> req;
     cppzmq::packet_t p = req.unseal ();
 
-    if (req.size () != 1 && req.size () != 2) {
-        send_bad_proto (server_, p);
+    // an ack goes to the shard the stream is kept in
+    if (!inproc_ && is_ack (req)) {
+        const cppzmq::message_t &frame = req.front ();
+        size_t owner = ((const unsigned char *) frame.data ())[
+            stream_frame_size - 1];
+        if (owner == sh.n)
+            ack_chunk (sh, frame);
+        else if (owner < shards_.size ()) {
+            send_hop (*sh.peers[owner], hop_ack, cppzmq::packet_t (),
+                      std::move (req));
+        }
         return;
     }
 
-    bool to_txn = req.size () == 2;
+    // the txn frame is the identity of the worker or the txn, which always
+    // starts with a zero byte, while a request never does, followed by the
+    // shard
+    // blob frames may follow the request, so the frames can't be counted
+    bool to_txn = !req.empty () && !req.front ().empty ()
+        && !*(const char *) req.front ().data ();
+    size_t owner = sh.n;
     if (to_txn) {
-        cppzmq::message_t txn = move (req.front ());
+        const cppzmq::message_t &txn = req.front ();
+        owner = txn.size () < 2 ? shards_.size ()
+            : ((const unsigned char *) txn.data ())[txn.size () - 1];
+    }
+    if (req.size () < 1u + to_txn || owner >= shards_.size ()) {
+        // answer in whatever the caller seems to speak
+        codec enc = req.empty () ? json_codec
+            : sniff_codec (req.back ().data (), req.back ().size ());
+        write_res (sh.server, sql_res (std::move (p), enc, 0, bad_proto,
+                                       "bad protocol"));
+        return;
+    }
+
+    p.push_front (origin_label (sh.n));
+    if (to_txn) {
+        // strip the shard off, leaving the identity of the worker or the txn
+        cppzmq::message_t id ((const char *) req.front ().data (),
+                              req.front ().size () - 1);
         req.pop_front ();
-        txn.label (true);
-        p.push_front (move (txn));
+        req.push_front (std::move (id));
+        if (owner != sh.n) {
+            send_hop (*sh.peers[owner], hop_req, std::move (p),
+                      std::move (req));
+            return;
+        }
     }
-    p.push_back (req.front ());
+    to_worker (sh, std::move (p), std::move (req), to_txn);
+}
 
-    (to_txn ? txns_ : sqls_) << p;
+// txn requests for the workers of this shard, responses to the callers of
+// this shard, and acks of the streams of this shard, passed over from the
+// other shards
+void conn_pool::proc_hop (shard &sh)
+{
+    cppzmq::packet_t hop;
+    sh.hops >> hop;
+    assert (hop.size () > 1 && hop.front ().size () == 2);
+    const unsigned char *head = (const unsigned char *) hop.front ().data ();
+    hop_kind kind = (hop_kind) head[0];
+    size_t labels = head[1];
+    hop.pop_front ();
+
+    cppzmq::packet_t p;
+    for (size_t i = 0; i < labels; ++i) {
+        hop.front ().label (true);
+        p.push_back (std::move (hop.front ()));
+        hop.pop_front ();
+    }
+    if (kind == hop_req)
+        to_worker (sh, std::move (p), std::move (hop), true);
+    else if (kind == hop_ack)
+        ack_chunk (sh, hop.front ());
+    else {
+        while (!hop.empty ()) {
+            p.push_back (std::move (hop.front ()));
+            hop.pop_front ();
+        }
+        sh.server << p;
+    }
 }
 
-void conn_pool::real_serve ()
+void conn_pool::real_serve (shard &sh)
 {
-    zmq_pollitem_t polls[3] = {
-        {server_, -1, ZMQ_POLLIN, 0},
-        {sqls_, -1, ZMQ_POLLIN, 0},
-        {txns_, -1, ZMQ_POLLIN, 0}
+    // on the queue path, the responses are polled by their eventfd, in place
+    // of the inproc sockets, and the broker wakes up every second to time
+    // out the idle txns
+    zmq_pollitem_t polls[4] = {
+        {sh.server, -1, ZMQ_POLLIN, 0},
+        {sh.hops, -1, ZMQ_POLLIN, 0},
+        {sh.sqls, -1, ZMQ_POLLIN, 0},
+        {sh.txns, -1, ZMQ_POLLIN, 0}
     };
+    if (!inproc_) {
+        polls[2].socket = 0;
+        polls[2].fd = sh.replies_wake;
+    }
     while (true) {
-        zmq::poll (polls, 3);
+        zmq::poll (polls, inproc_ ? 4 : 3, inproc_ ? -1 : 1000000);
 
         // NOTE: receiving from ZMQ_REP & ZMQ_DEALER sockets are very different
         //       REP sockets automatically appends a blank delimiter to the
         //       front of the message, and the DEALER ones don't
         //       DEALER callers must append the blank message manually
         if (polls[0].revents & ZMQ_POLLIN)
-            proc_req ();
+            proc_req (sh);
         if (polls[1].revents & ZMQ_POLLIN)
-            proc_res (false);
-        if (polls[2].revents & ZMQ_POLLIN)
-            proc_res (true);
+            proc_hop (sh);
+        if (polls[2].revents & ZMQ_POLLIN) {
+            if (inproc_)
+                proc_res (sh, false);
+            else
+                proc_replies (sh);
+        }
+        if (inproc_ && polls[3].revents & ZMQ_POLLIN)
+            proc_res (sh, true);
+        if (!inproc_)
+            expire_txns (sh);
+        // the pool has a single reaper
+        if (!inproc_ && !sh.n)
+            reap_conns ();
     }
 
 }
@@ -7,8 +7,11 @@
 #ifndef INCLUDED_CONN_POOL_HPP
 #define INCLUDED_CONN_POOL_HPP
 
+#include "fiber_loop.hpp"
+#include "mpmc_queue.hpp"
 #include "sql_res.hpp"
 #include "sql_stmt.hpp"
+#include "timer_wheel.hpp"
 
 #include <zmq.hpp>
 
@@ -16,44 +19,368 @@
 
 #include <pthread.h>
 
+#include <ctime>
 #include <deque>
 #include <fstream>
 #include <string>
+#include <tr1/functional>
 #include <tr1/memory>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
+#include <vector>
 
 class mysql_conn;
+struct stmt_stats;
 class conn_pool
 {
 public:
+    // threads is the number of workers, as many as the connections if 0
+    // if async, there's a worker fiber for each connection, and threads is
+    // the number of threads running the fibers, which never block on mysql
+    // on the queue path, cap is the most connections opened, more being
+    // opened only when all the open ones are busy, and those left unused for
+    // reap_timeout seconds are closed, down to min_conns
+    // connections are never closed for being idle if reap_timeout is 0, or
+    // if min_conns is cap
+    // each connection keeps at most stmt_cap statements prepared, or as
+    // many as the server allows if 0
+    // a parallel batch takes at most parallel_cap connections at once,
+    // counting the one of the worker it goes to
     conn_pool (zmq::context_t &ctx, const std::string &listen,
                const std::string &host, unsigned short port,
                const std::string &user, const std::string &pass,
                const std::string &db, size_t db_timeout, size_t cap,
-               size_t idle_timeout);
+               size_t idle_timeout, size_t shards = 1, bool inproc = false,
+               size_t threads = 0, bool async = false, size_t min_conns = 0,
+               size_t reap_timeout = 0, size_t stmt_cap = 0,
+               size_t parallel_cap = 4);
     ~conn_pool ();
-    void start ();
+    // if warming up, the connections kept open are all opened, with all the
+    // statements prepared, before any request is taken
+    // only the connections of the queue path are warmed up
+    void start (bool warm = false);
 
 public:
+    // the results of the statements are loaded from the cache file, if any,
+    // if the schema hasn't changed, and only asked of the server otherwise
     template <typename FindDB>
     void init_stmts (const std::string &dir, const std::string &fn,
-                     size_t timeout, FindDB find_db);
+                     size_t timeout, FindDB find_db,
+                     const std::string &cache = std::string ());
+    // reads the statements files again, finds out the results of only the
+    // statements new or changed, and swaps the statements for the new ones
+    // as a whole, while the requests keep being served
+    // the statements are kept as they are if the files can't be read
+    void reload_stmts ();
+    // how the prepared statements have been found, summed over all the
+    // connections
+    stmt_stats prepared_stats ();
+
+private:
+    struct job;
+    struct open_stream;
+    struct fan_out;
+
+    // the chunks of a stream a worker may have sent and not had acked
+    static const size_t stream_window = 4;
+
+    // a txn begun on the queue path, which isn't bound to any worker
+    // it's owned by the broker of the shard, and handed to whichever worker
+    // is idle along with each of its requests, one request at a time
+    struct open_txn
+    {
+        open_txn (mysql_conn *c, size_t s, const cppzmq::packet_t &a, codec e)
+            : conn (c), seq (s), addr (a), enc (e), slot ((size_t) -1),
+              busy (true) {}
+
+        // held from begin to commit or rollback
+        mysql_conn *conn;
+        size_t seq;
+        // the envelope of the caller who began the txn, who alone may
+        // continue it, and is told if it times out
+        cppzmq::packet_t addr;
+        codec enc;
+        // where the txn is kept in the shard, -1 until it's kept
+        size_t slot;
+        // if a worker is running one of its requests, the requests arriving
+        // meanwhile wait here
+        bool busy;
+        std::deque<job *> waiting;
+        // the idle timeout, armed only while the txn is not busy
+        timer_wheel<open_txn *>::timer idle;
+    };
+
+    // a request passed to a worker, or a response passed back to the broker,
+    // when they talk through queues instead of inproc sockets
+    // the frames are split already, so there's no framing to be redone
+    struct job
+    {
+        job ()
+            : txn (0), timeout (false), ends (false), stream (0),
+              chunk (false), fan (0), reap (0) {}
+
+        // the shard the request came in from, and the caller's envelope
+        cppzmq::packet_t addr;
+        // the request or the response, followed by the blob frames
+        cppzmq::packet_t frames;
+        // the txn the request is run in, or is begun by
+        open_txn *txn;
+        // if the txn is to be rolled back for being idle too long
+        bool timeout;
+        // if the txn has ended, with the connection released
+        bool ends;
+        // the stream the results were sent in, if streamed, and if it's a
+        // chunk of the stream, instead of the last response
+        open_stream *stream;
+        bool chunk;
+        // if a helper of a parallel batch, never passed back to the broker
+        fan_out *fan;
+        // a connection idle for too long, to be closed by the worker, as
+        // closing it talks to the server, so the job is never passed back
+        mysql_conn *reap;
+    };
+
+    // a batch run in parallel, its statements taken one by one by the
+    // worker the request went to, and by the helpers it dispatches to the
+    // other workers of the shard, each with a connection of its own
+    // the worker that took the request waits for the statements taken,
+    // never for the helpers to show up, and takes whatever's left itself
+    // each worker keeps one for the batches it takes, along with the jobs
+    // of the helpers, and only makes another if a helper of the batch before
+    // still holds it, as the helpers may only be taken after all the
+    // statements are done
+    // the batch is freed by the last one to let go of it
+    struct fan_out
+    {
+        fan_out (size_t helpers);
+        ~fan_out ();
+        // readies the batch for a request of n statements
+        void reset (sql_stmt &s, size_t n);
+
+        // the request, and the params area it points into, are the worker's,
+        // and only pointed to, as the worker waits for every
+        // statement taken to be done before answering the request
+        // so they're only read for a statement just taken, and a helper
+        // showing up after the last one is taken never reads them at all
+        sql_stmt *stmt;
+        // the answers to the statements, in order
+        std::vector<res_buf> parts;
+        std::vector<error> errs;
+        std::vector<std::string> msgs;
+        volatile size_t next;
+        volatile size_t done;
+        volatile size_t refs;
+        // notified by whoever is done with the last statement
+        int wake;
+        // dispatched to the other workers of the shard
+        std::vector<job> helpers;
+    };
+
+    // the results of a request streamed on the queue path, in chunks that
+    // the caller acks one by one, by sending back the stream frame of each
+    // the worker never has more than stream_window chunks unacked, so a slow
+    // caller holds up the worker, instead of having the chunks dropped by the
+    // server socket once past its hwm
+    // made by the worker with the first chunk, kept by the broker of the
+    // shard, and freed by the broker when the last response is sent
+    struct open_stream
+    {
+        open_stream ();
+        ~open_stream ();
+
+        // counted up by the worker for each chunk, and down by the broker
+        // for each ack, which notifies the eventfd
+        volatile size_t unacked;
+        int wake;
+        // the chunks are passed to the broker in these jobs, in turn, as a
+        // chunk is only made once the one stream_window before it is acked
+        job chunks[stream_window];
+        size_t next;
+        // only touched by the broker
+        // where the stream is kept in the shard, -1 until it's kept, and the
+        // seq telling its acks from those of a stream kept there before
+        size_t slot;
+        size_t seq;
+        // the chunks sent out, and acked by the caller, so no ack counts
+        // for a chunk still on its way
+        size_t sent;
+        size_t acked;
+    };
+
+    // a broker thread, listening on its own address, with its own workers
+    // zmq sockets can't be shared between threads, so shards share nothing
+    // but the txns that are begun in one shard and continued in another,
+    // which are passed over from shard to shard by the hops sockets
+    struct shard
+    {
+        shard (zmq::context_t &ctx, size_t i, const std::string &addr);
+        ~shard ();
+
+        size_t n;
+        std::string listen;
+        pthread_t thread;
+        zmq::socket_t server;
+        zmq::socket_t hops;
+        // to the hops of the other shards, null for this one
+        std::vector<std::tr1::shared_ptr<zmq::socket_t> > peers;
+        // the inproc fallback
+        zmq::socket_t sqls;
+        zmq::socket_t txns;
+        // requests taken by whichever worker is idle
+        // the eventfd counts the jobs, waking up one worker for each
+        mpmc_queue<job *> jobs;
+        int jobs_wake;
+        // responses from all the workers of the shard
+        mpmc_queue<job *> replies;
+        int replies_wake;
+        // the txns begun by the workers of the shard, indexed by the slot
+        // in their txn frames, and the slots free for reuse
+        std::vector<open_txn *> open_txns;
+        std::vector<size_t> free_slots;
+        timer_wheel<open_txn *> idle_txns;
+        // the streams of the workers of the shard, indexed by the slot in
+        // their stream frames, and the slots free for reuse
+        std::vector<open_stream *> open_streams;
+        std::vector<size_t> free_streams;
+        size_t stream_seq;
+        // the jobs done with, kept for the requests to come, as the broker
+        // alone frees them
+        std::vector<job *> spare_jobs;
+    };
+
+    struct worker
+    {
+        worker (size_t i);
+
+        size_t n;
+        // where the requests are decoded into, and the responses encoded
+        // into, both reused from request to request
+        sql_params params;
+        buf_pool bufs;
+        // the inproc fallback, connected to the sqls and txns of the shard
+        // for the whole life of the worker, and the one last read from
+        std::tr1::shared_ptr<zmq::socket_t> sqls;
+        std::tr1::shared_ptr<zmq::socket_t> txns;
+        zmq::socket_t *sock;
+        bool from_txns;
+        bool in_txn;
+        // the connection the worker owns on the inproc fallback
+        mysql_conn *conn;
+        // the parallel batch the worker took last, if any
+        fan_out *fan;
+        // odd while looking up statements, so a reload knows when the
+        // statements swapped out are no longer read
+        volatile size_t lookups;
+    };
+    // sends the chunks of the results streamed by a worker through the
+    // replies of the shard, in the stream made with the first chunk, which
+    // is handed to the job of the request along with the last response
+    // only on the queue path, as the acks can't be routed to the workers
+    // of the inproc fallback
+    class chunk_sink : public res_sink
+    {
+    public:
+        chunk_sink (conn_pool &p, worker &w, job &j)
+            : pool_ (p), w_ (w), j_ (j), stream_ (0) {}
+        ~chunk_sink () {j_.stream = stream_;}
+        void send (sql_res &&chunk);
+    private:
+        conn_pool &pool_;
+        worker &w_;
+        job &j_;
+        open_stream *stream_;
+    };
+    // the statements are looked into by several threads, each with its own
+    // connection, and the errors are kept to be reported in the order of
+    // the statements in their files
+    struct init_arg
+    {
+        init_arg (conn_pool &p, size_t t)
+            : pool (p), timeout (t), next (0) {}
+        conn_pool &pool;
+        size_t timeout;
+        std::vector<mysql_stmt *> stmts;
+        std::vector<std::string> errs;
+        size_t next;
+        boost::mutex lock;
+        // why a thread couldn't connect, fatal
+        std::string fatal;
+    };
+    struct warm_arg
+    {
+        warm_arg (conn_pool &p) : pool (p), next (0), done (0), failed (0) {}
+        conn_pool &pool;
+        std::vector<mysql_conn *> conns;
+        // taken by the warming threads one by one
+        size_t next;
+        size_t done;
+        size_t failed;
+    };
+    struct serve_arg
+    {
+        serve_arg (conn_pool &p, shard &s) : pool (p), sh (s) {}
+        conn_pool &pool;
+        shard &sh;
+    };
+
+private:
+    stmt_registry *load_stmts ();
+    void init_results (stmt_map &stmts, const stmt_map *old);
+    static void *init_some (void *p);
+    sql_stmt read_stmt (worker &w, cppzmq::packet_t &&addr,
+                        cppzmq::message_t &&body, cppzmq::packet_t &&blobs);
 
 private:
     static void *serve (void *p);
-    void real_serve ();
-    void proc_req ();
-    void proc_res (bool from_txn);
+    void real_serve (shard &sh);
+    void proc_req (shard &sh);
+    void proc_res (shard &sh, bool from_txn);
+    void proc_replies (shard &sh);
+    void proc_hop (shard &sh);
+    void expire_txns (shard &sh);
+    void to_worker (shard &sh, cppzmq::packet_t &&env, cppzmq::packet_t &&req,
+                    bool txn);
+    bool dispatch (shard &sh, job *j);
+    job *new_job (shard &sh);
+    void free_job (shard &sh, job *j);
+    void to_txn (shard &sh, open_txn &t, job *j);
+    void end_txn (shard &sh, open_txn *t);
+    void keep_stream (shard &sh, open_stream *s);
+    void end_stream (shard &sh, open_stream *s);
+    void ack_chunk (shard &sh, const cppzmq::message_t &frame);
+    void to_caller (shard &sh, cppzmq::packet_t &&env,
+                    cppzmq::packet_t &&res);
+    void reject (shard &sh, cppzmq::packet_t &&env,
+                 const cppzmq::message_t &body, error e);
+    shard &shard_of (size_t n) {return *shards_[n % shards_.size ()];}
 
 private:
     static void *proc (void *p);
+    static void *run_fibers (void *p);
     void real_proc (size_t n);
-    sql_res proc_sqls (size_t n, sql_res &&res, mysql_conn &conn);
-    sql_res proc_txn (size_t n, sql_res &&res, mysql_conn &conn,
+    // the queue path
+    void proc_jobs (worker &w);
+    sql_res run_job (worker &w, job &j);
+    sql_res run_txn (job &j, sql_stmt &&sql);
+    sql_res run_parallel (worker &w, sql_stmt &&sql, mysql_conn &conn);
+    void help (fan_out &f);
+    static void run_parts (fan_out &f, mysql_conn &conn);
+    static void let_go (fan_out *f);
+    mysql_conn *acquire ();
+    void release (mysql_conn *conn);
+    void reap_conns ();
+    void close_conn (mysql_conn *conn);
+    void warm_up ();
+    static void *warm_conns (void *p);
+    // the inproc fallback, with a connection per worker
+    sql_res proc_sqls (worker &w, sql_res &&res, mysql_conn &conn);
+    sql_res proc_txn (worker &w, sql_res &&res, mysql_conn &conn,
                       size_t seq);
+    bool wait_sql (worker &w, long timeout);
+    sql_stmt read_sql (worker &w);
+    void write_res (worker &w, sql_res &&res);
     size_t next_txn ();
-    sql_stmt read_sql (size_t n, zmq::socket_t &sock);
+    cppzmq::packet_t pack_res (sql_res &&res);
     void write_res (zmq::socket_t &sock, sql_res &&res);
 
 private:
@@ -66,18 +393,43 @@ private:
 
 private:
     boost::mutex lock_;
-    pthread_t svrth_;
+    std::vector<std::tr1::shared_ptr<shard> > shards_;
+    std::vector<std::tr1::shared_ptr<worker> > workers_;
     std::deque<pthread_t> threads_;
+    // if the broker talks to the workers through inproc sockets
+    bool inproc_;
+    // if async, the workers are fibers, and a thread runs each loop
+    bool async_;
+    std::vector<std::tr1::shared_ptr<fiber_loop> > loops_;
+    // on the queue path, the connections not held by any txn, taken by the
+    // workers for each request out of txns
+    // the open ones are kept as a stack, along with when they were released,
+    // the latest on top, so the ones more than the load needs sink to the
+    // bottom unused, to be closed when they have been idle for long enough
+    std::vector<std::tr1::shared_ptr<mysql_conn> > conns_;
+    boost::mutex conns_lock_;
+    std::deque<std::pair<mysql_conn *, time_t> > idle_conns_;
+    std::vector<mysql_conn *> closed_conns_;
+    size_t min_conns_;
+    size_t reap_timeout_;
+    // when a connection was last reaped, by the broker of the first shard
+    time_t last_reap_;
+    size_t stmt_cap_;
+    size_t parallel_cap_;
     bool started_;
     size_t seq_;
     zmq::context_t &ctx_;
-    std::string listen_;
-    zmq::socket_t server_;
-    zmq::socket_t sqls_;
-    zmq::socket_t txns_;
-    std::tr1::unordered_map<std::string, std::tr1::shared_ptr<mysql_stmt>
-                            > stmts_;
+    // swapped as a whole on reload, and read without locking by the workers
+    // the statements swapped out are freed only when no worker reads them
+    stmt_registry *volatile stmts_;
     bool stmts_read_;
+    // where the statements are read from, kept for reloading
+    boost::mutex reload_lock_;
+    std::string stmts_dir_;
+    std::string stmts_file_;
+    size_t stmts_timeout_;
+    std::string stmts_cache_;
+    std::tr1::function<std::string (const std::string &)> find_db_;
     // db related
     std::string host_;
     unsigned short port_;
@@ -176,6 +528,7 @@ void read_stmts (std::tr1::unordered_map<std::string,
     string include;
     string name, sql;
     bool insert_id = false;
+    bool stream = false;
 
     while (!f.eof ()) {
         ++lineno;
@@ -191,10 +544,11 @@ void read_stmts (std::tr1::unordered_map<std::string,
             // empty line
             if (!sql.empty ()) {
                 add_stmt (stmts, new mysql_stmt (name, sql, insert_id, fn,
-                                                 lineno), find_db);
+                                                 lineno, stream), find_db);
                 name.clear ();
                 sql.clear ();
                 insert_id = false;
+                stream = false;
             }
             continue;
         }
@@ -225,16 +579,17 @@ void read_stmts (std::tr1::unordered_map<std::string,
             name = line;
         else {
             name = line.substr (first, end - first);
+            // the flags follow the name, separated by blanks
             size_t flags = line.find_first_not_of (" \t", end + 1);
-            if (flags == string::npos)
-                // no flags
-                continue;
-            const size_t len2 = sizeof ("insert-id") - 1;
-            if ((!line.compare (flags, len2, "insert-id")
-                 || !line.compare (flags, len2, "insert_id"))
-                && (flags + len2 == line.size ()
-                    || isblank (line[flags + len2])))
-                insert_id = true;
+            while (flags != string::npos) {
+                size_t flag_end = line.find_first_of (" \t", flags);
+                string flag = line.substr (flags, flag_end - flags);
+                if (flag == "insert-id" || flag == "insert_id")
+                    insert_id = true;
+                else if (flag == "stream")
+                    stream = true;
+                flags = line.find_first_not_of (" \t", flag_end);
+            }
         }
         if (name.empty ()) {
             cerr << fn << ":" << lineno << ": sql name should not be empty"
@@ -245,8 +600,8 @@ void read_stmts (std::tr1::unordered_map<std::string,
 
     if (!name.empty ()) {
         if (!sql.empty ()) {
-            add_stmt (stmts, new mysql_stmt (name, sql, insert_id, fn, lineno),
-                      find_db);
+            add_stmt (stmts, new mysql_stmt (name, sql, insert_id, fn, lineno,
+                                             stream), find_db);
         } else {
             cerr << fn << ":" << lineno << ": " << name << ": no sql specified"
                  << endl << flush;
@@ -258,22 +613,15 @@ void read_stmts (std::tr1::unordered_map<std::string,
 
 template <typename FindDB>
 void conn_pool::init_stmts (const std::string &dir, const std::string &fn,
-                            size_t timeout, FindDB find_db)
+                            size_t timeout, FindDB find_db,
+                            const std::string &cache)
 {
-    using namespace std;
-
-    tr1::unordered_set<string> including;
-    read_stmts (stmts_, dir, fn, including, find_db);
-
-    MYSQL *conn = 0;
-    tr1::unordered_map<string, tr1::shared_ptr<mysql_stmt> >::iterator it;
-    for (it = stmts_.begin (); it != stmts_.end (); ++it) {
-        it->second->init_results (conn, host_, port_, user_, password_, db_,
-                                  timeout);
-    }
-
-    if (conn)
-        mysql_close (conn);
+    stmts_dir_ = dir;
+    stmts_file_ = fn;
+    stmts_timeout_ = timeout;
+    stmts_cache_ = cache;
+    find_db_ = find_db;
+    stmts_ = load_stmts ();
 
     stmts_read_ = true;
 }
@@ -10,7 +10,7 @@
 #include <zmq.hpp>
 
 #include <cstring>
-#include <deque>
+#include <new>
 #include <stdexcept>
 #include <string>
 
@@ -45,13 +45,13 @@ namespace cppzmq
                 label_ = rhs.label_;
                 return *this;
             }
-        bool operator == (const message_t &rhs)
+        bool operator == (const message_t &rhs) const
             {
                 if (size () != rhs.size ())
                     return false;
-                return memcmp (data (), rhs.data (), size ());
+                return !memcmp (data (), rhs.data (), size ());
             }
-        bool operator != (const message_t &rhs)
+        bool operator != (const message_t &rhs) const
             {
                 return !(*this == rhs);
             }
@@ -87,87 +87,220 @@ namespace cppzmq
         bool label_;
     };
 
+    // a deque of frames, in a ring kept inside the packet for the few frames
+    // a packet usually has, spilling to the heap only for longer packets
+    // frames are moved in and out of it, and never copied unless asked to
     class packet_t
     {
     public:
-        packet_t () {}
-        packet_t (packet_t &&rhs) : msgs_ (std::move (rhs.msgs_)) {}
-        ~packet_t () {}
-        bool empty () const {return msgs_.empty ();}
-        size_t size () const {return msgs_.size ();}
-        const message_t &front () const {return msgs_.front ();}
-        message_t &front () {return msgs_.front ();}
-        const message_t &back () const {return msgs_.back ();}
-        message_t &back () {return msgs_.back ();}
+        // a power of 2
+        enum {inline_frames = 8};
+
+        packet_t ()
+            : msgs_ (inline_msgs ()), cap_ (inline_frames), head_ (0),
+              size_ (0) {}
+        packet_t (const packet_t &rhs)
+            : msgs_ (inline_msgs ()), cap_ (inline_frames), head_ (0),
+              size_ (0)
+            {
+                for (size_t i = 0; i < rhs.size_; ++i)
+                    push_back (rhs[i]);
+            }
+        packet_t (packet_t &&rhs)
+            : msgs_ (inline_msgs ()), cap_ (inline_frames), head_ (0),
+              size_ (0)
+            {steal (rhs);}
+        ~packet_t ()
+            {
+                clear ();
+                release ();
+            }
+        packet_t &operator = (const packet_t &rhs)
+            {
+                if (this != &rhs) {
+                    clear ();
+                    for (size_t i = 0; i < rhs.size_; ++i)
+                        push_back (rhs[i]);
+                }
+                return *this;
+            }
+        packet_t &operator = (packet_t &&rhs)
+            {
+                if (this != &rhs) {
+                    clear ();
+                    release ();
+                    steal (rhs);
+                }
+                return *this;
+            }
+        bool empty () const {return !size_;}
+        size_t size () const {return size_;}
+        const message_t &front () const {return at (0);}
+        message_t &front () {return at (0);}
+        const message_t &back () const {return at (size_ - 1);}
+        message_t &back () {return at (size_ - 1);}
+        const message_t &operator [] (size_t i) const {return at (i);}
+        message_t &operator [] (size_t i) {return at (i);}
         void push_front (const message_t &m)
             {
                 check_label_front (m);
-                msgs_.push_front (m);
+                new (slot_front ()) message_t (m);
             }
-        void push_front (const message_t &&m)
+        void push_front (message_t &&m)
             {
                 check_label_front (m);
-                msgs_.push_front (m);
+                new (slot_front ()) message_t (std::move (m));
+            }
+        void pop_front ()
+            {
+                at (0).~message_t ();
+                head_ = (head_ + 1) & (cap_ - 1);
+                --size_;
             }
-        void pop_front () {msgs_.pop_front ();}
         void push_back (const message_t &m)
             {
                 check_label_back (m);
-                msgs_.push_back (m);
+                new (slot_back ()) message_t (m);
             }
-        void push_back (const message_t &&m)
+        void push_back (message_t &&m)
             {
                 check_label_back (m);
-                msgs_.push_back (m);
+                new (slot_back ()) message_t (std::move (m));
+            }
+        void pop_back ()
+            {
+                at (size_ - 1).~message_t ();
+                --size_;
+            }
+        void clear ()
+            {
+                while (size_)
+                    pop_back ();
+                head_ = 0;
             }
-        void pop_back () {msgs_.pop_back ();}
 
     public:
         packet_t unseal ()
             {
                 packet_t envelop;
-                while (!msgs_.empty () && msgs_.front ().label ()) {
-                    envelop.msgs_.push_back (std::move (msgs_.front ()));
-                    msgs_.pop_front ();
+                while (size_ && front ().label ()) {
+                    new (envelop.slot_back ()) message_t (std::move (front ()));
+                    pop_front ();
                 }
                 return envelop;
             }
         void seal (const packet_t &p)
             {
-                msgs_.insert (msgs_.begin (), p.msgs_.begin (), p.msgs_.end ());
-                for (size_t i = 0; i < p.msgs_.size (); ++i)
-                    msgs_[i].label (true);
+                for (size_t i = p.size_; i > 0; --i) {
+                    new (slot_front ()) message_t (p[i - 1]);
+                    front ().label (true);
+                }
+            }
+        void seal (packet_t &&p)
+            {
+                while (!p.empty ()) {
+                    new (slot_front ()) message_t (std::move (p.back ()));
+                    front ().label (true);
+                    p.pop_back ();
+                }
             }
 
     public:
         void send (zmq::socket_t &sock) const
             {
-                for (std::deque<message_t>::const_iterator it = msgs_.begin ();
-                     it != msgs_.end (); ++it)
-                    it->send (sock, it + 1 != msgs_.end ());
+                for (size_t i = 0; i < size_; ++i)
+                    at (i).send (sock, i + 1 != size_);
             }
         void recv (zmq::socket_t &sock)
             {
-                msgs_.clear ();
+                clear ();
                 do {
-                    msgs_.push_back (message_t ());
-                } while (msgs_.back ().recv (sock));
+                    new (slot_back ()) message_t ();
+                } while (back ().recv (sock));
             }
 
     private:
+        message_t *inline_msgs ()
+            {return (message_t *) inline_.bytes;}
+        const message_t &at (size_t i) const
+            {return msgs_[(head_ + i) & (cap_ - 1)];}
+        message_t &at (size_t i) {return msgs_[(head_ + i) & (cap_ - 1)];}
+        void *slot_back ()
+            {
+                if (size_ == cap_)
+                    grow ();
+                return &msgs_[(head_ + size_++) & (cap_ - 1)];
+            }
+        void *slot_front ()
+            {
+                if (size_ == cap_)
+                    grow ();
+                head_ = (head_ - 1) & (cap_ - 1);
+                ++size_;
+                return &msgs_[head_];
+            }
+        void grow ()
+            {
+                size_t cap = cap_ * 2;
+                message_t *msgs =
+                    (message_t *) ::operator new (cap * sizeof (message_t));
+                for (size_t i = 0; i < size_; ++i) {
+                    new (&msgs[i]) message_t (std::move (at (i)));
+                    at (i).~message_t ();
+                }
+                release ();
+                msgs_ = msgs;
+                cap_ = cap;
+            }
+        // frees the heap ring, the frames must have been destroyed
+        void release ()
+            {
+                if (msgs_ != inline_msgs ())
+                    ::operator delete (msgs_);
+                msgs_ = inline_msgs ();
+                cap_ = inline_frames;
+                head_ = 0;
+            }
+        // takes the frames of the other packet, which must be empty
+        void steal (packet_t &rhs)
+            {
+                if (rhs.msgs_ != rhs.inline_msgs ()) {
+                    msgs_ = rhs.msgs_;
+                    cap_ = rhs.cap_;
+                    head_ = rhs.head_;
+                    size_ = rhs.size_;
+                    rhs.msgs_ = rhs.inline_msgs ();
+                    rhs.cap_ = inline_frames;
+                    rhs.head_ = 0;
+                    rhs.size_ = 0;
+                    return;
+                }
+                for (size_t i = 0; i < rhs.size_; ++i)
+                    new (slot_back ()) message_t (std::move (rhs[i]));
+                rhs.clear ();
+            }
         void check_label_front (const message_t &m)
             {
-                if (!m.label () && !msgs_.empty () && msgs_.front ().label ())
+                if (!m.label () && size_ && front ().label ())
                     throw std::invalid_argument ("message has to be labeled");
             }
         void check_label_back (const message_t &m)
             {
-                if (m.label () && !msgs_.empty () && !msgs_.back ().label ())
+                if (m.label () && size_ && !back ().label ())
                     throw std::invalid_argument ("message cannot be labeled");
             }
 
     private:
-        std::deque<message_t> msgs_;
+        message_t *msgs_;
+        size_t cap_;
+        size_t head_;
+        size_t size_;
+        union
+        {
+            char bytes[inline_frames * sizeof (message_t)];
+            void *align;
+            long long align_ll;
+        } inline_;
     };
 
     static inline zmq::socket_t &operator << (zmq::socket_t &sock,
@@ -8,7 +8,7 @@
 
 using namespace std;
 
-string err_to_str (error e)
+const char *err_to_str (error e)
 {
     switch (e) {
     case success: return "success";
@@ -25,8 +25,10 @@ string err_to_str (error e)
     case db_stmt: return "statement execution failed, you may retry";
     case db_txn: return "statement execution failed, transaction is doomed";
     case txn_timeout: return "transaction has timed out, do not continue";
+    case stream_timeout: return "chunks were not acked in time, stream dropped";
 
     case not_support: return "statement to execute is not supported";
+    case busy: return "server is too busy, you may retry";
 
     default: return "unknown error";
     }
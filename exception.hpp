@@ -34,11 +34,17 @@ enum error
     // to notify the txn initiater that its txn has timed out
     // sending another req with the same txn id may produce no response at all
     txn_timeout = 0x23,
+    // the caller hasn't acked the chunks of a stream in time, and the rest
+    // of the results are dropped
+    stream_timeout = 0x24,
 
     not_support = 0x31,
+    // the queues to the workers are full
+    busy = 0x32,
 };
 
-std::string err_to_str (error e);
+// the message of the code, which is never freed
+const char *err_to_str (error e);
 
 class coded_error : public std::runtime_error
 {
@@ -0,0 +1,231 @@
+/// fiber_loop.cpp -- fibers sharing a thread impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-22
+///
+
+#include "fiber_loop.hpp"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <stdexcept>
+
+using namespace std;
+
+// NOTE: the epoll events have the same values as their poll counterparts,
+//       so they're passed through as they are
+
+__thread fiber_loop *fiber_loop::current_ = 0;
+
+static long long now_ms ()
+{
+    struct timeval tv;
+    gettimeofday (&tv, 0);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+fiber_loop::fiber_loop ()
+    : epfd_ (epoll_create (64)), running_ (0), live_ (0)
+{
+    if (epfd_ < 0)
+        throw runtime_error ("failed to create epoll fd");
+}
+
+fiber_loop::~fiber_loop ()
+{
+    close (epfd_);
+}
+
+void fiber_loop::spawn (entry_fn f, void *arg, size_t stack_size)
+{
+    tr1::shared_ptr<fiber> fb (new fiber);
+    fb->stack.resize (stack_size);
+    fb->f = f;
+    fb->arg = arg;
+    fb->done = false;
+    fb->waiting = false;
+    fb->fd = -1;
+    fb->events = 0;
+    fb->deadline = -1;
+    fb->ready = 0;
+
+    if (getcontext (&fb->ctx))
+        throw runtime_error ("failed to create fiber");
+    fb->ctx.uc_stack.ss_sp = &fb->stack[0];
+    fb->ctx.uc_stack.ss_size = stack_size;
+    fb->ctx.uc_link = &main_;
+    // makecontext only passes ints along
+    unsigned long long p = (unsigned long) fb.get ();
+    makecontext (&fb->ctx, (void (*) ()) &fiber_loop::trampoline, 2,
+                 (int) (p >> 32), (int) p);
+
+    fibers_.push_back (fb);
+    ++live_;
+}
+
+void fiber_loop::trampoline (int hi, int lo)
+{
+    unsigned long long p = ((unsigned long long) (unsigned) hi << 32)
+        | (unsigned) lo;
+    fiber *f = (fiber *) (unsigned long) p;
+    f->f (f->arg);
+    f->done = true;
+    // back to the loop through uc_link
+}
+
+void fiber_loop::run ()
+{
+    current_ = this;
+    for (size_t i = 0; i < fibers_.size (); ++i)
+        resume (fibers_[i].get ());
+
+    while (live_) {
+        struct epoll_event evs[64];
+        int n = epoll_wait (epfd_, evs, 64, next_timeout ());
+        if (n < 0 && errno != EINTR)
+            throw runtime_error ("failed to wait for fibers");
+        for (int i = 0; i < n; ++i)
+            wake (evs[i].data.fd, evs[i].events);
+        expire ();
+    }
+    current_ = 0;
+}
+
+int fiber_loop::poll (int fd, short events, int timeout)
+{
+    if (current_ && current_->running_)
+        return current_->wait (fd, events, timeout);
+
+    struct pollfd pfd = {fd, events, 0};
+    int ret;
+    while ((ret = ::poll (&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+    if (ret < 0)
+        throw runtime_error ("failed to poll");
+    return ret ? pfd.revents : 0;
+}
+
+void fiber_loop::sleep (int ms)
+{
+    if (current_ && current_->running_) {
+        current_->wait (-1, 0, ms);
+        return;
+    }
+    usleep (ms * 1000);
+}
+
+// waiting on no descriptor, the fiber is only woken up by the deadline
+short fiber_loop::wait (int fd, short events, int timeout)
+{
+    fiber *f = running_;
+    f->waiting = true;
+    f->fd = fd;
+    f->events = events;
+    f->deadline = timeout < 0 ? -1 : now_ms () + timeout;
+    f->ready = 0;
+    if (fd >= 0) {
+        waiting_[fd].fibers.push_back (f);
+        watch (fd);
+    }
+
+    swapcontext (&f->ctx, &main_);
+    return f->ready;
+}
+
+void fiber_loop::resume (fiber *f)
+{
+    assert (!running_);
+    running_ = f;
+    swapcontext (&main_, &f->ctx);
+    running_ = 0;
+    if (f->done)
+        --live_;
+}
+
+// watches the descriptor for what its waiters wait for, or stops watching it
+void fiber_loop::watch (int fd)
+{
+    waiters &ws = waiting_[fd];
+    short events = 0;
+    for (list<fiber *>::iterator it = ws.fibers.begin ();
+         it != ws.fibers.end (); ++it)
+        events |= (*it)->events;
+    if (events == ws.events) {
+        if (!events)
+            waiting_.erase (fd);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    int op = !events ? EPOLL_CTL_DEL : ws.events ? EPOLL_CTL_MOD
+        : EPOLL_CTL_ADD;
+    if (epoll_ctl (epfd_, op, fd, &ev))
+        throw runtime_error ("failed to watch fd");
+    if (events)
+        ws.events = events;
+    else
+        waiting_.erase (fd);
+}
+
+void fiber_loop::wake (int fd, short revents)
+{
+    tr1::unordered_map<int, waiters>::iterator it = waiting_.find (fd);
+    if (it == waiting_.end ())
+        return;
+
+    list<fiber *> &fs = it->second.fibers;
+    for (list<fiber *>::iterator f = fs.begin (); f != fs.end (); ++f) {
+        short ready = revents & ((*f)->events | POLLERR | POLLHUP);
+        if (!ready)
+            continue;
+        fiber *fb = *f;
+        fs.erase (f);
+        watch (fd);
+        fb->waiting = false;
+        fb->ready = ready;
+        resume (fb);
+        return;
+    }
+}
+
+void fiber_loop::expire ()
+{
+    long long now = now_ms ();
+    for (size_t i = 0; i < fibers_.size (); ++i) {
+        fiber *f = fibers_[i].get ();
+        if (!f->waiting || f->deadline < 0 || f->deadline > now)
+            continue;
+        if (f->fd >= 0) {
+            waiting_[f->fd].fibers.remove (f);
+            watch (f->fd);
+        }
+        f->waiting = false;
+        f->ready = 0;
+        resume (f);
+    }
+}
+
+// in milliseconds, until the earliest deadline of the fibers waiting
+int fiber_loop::next_timeout ()
+{
+    long long earliest = -1;
+    for (size_t i = 0; i < fibers_.size (); ++i) {
+        fiber *f = fibers_[i].get ();
+        if (!f->waiting || f->deadline < 0)
+            continue;
+        if (earliest < 0 || f->deadline < earliest)
+            earliest = f->deadline;
+    }
+    if (earliest < 0)
+        return -1;
+    long long now = now_ms ();
+    return earliest > now ? earliest - now : 0;
+}
@@ -0,0 +1,97 @@
+/// fiber_loop.hpp -- fibers sharing a thread, switched on file descriptors
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-22
+///
+
+#ifndef INCLUDED_FIBER_LOOP_HPP
+#define INCLUDED_FIBER_LOOP_HPP
+
+#include <ucontext.h>
+
+#include <cstddef>
+#include <list>
+#include <tr1/memory>
+#include <tr1/unordered_map>
+#include <vector>
+
+// a thread running many fibers, each of which yields to the loop whenever it
+// would block on a file descriptor, so that the others may run meanwhile
+// fibers are never moved to other threads, and never preempted
+class fiber_loop
+{
+public:
+    typedef void *(*entry_fn) (void *arg);
+
+public:
+    fiber_loop ();
+    ~fiber_loop ();
+
+public:
+    // adds a fiber, to be started when the loop runs
+    void spawn (entry_fn f, void *arg, size_t stack_size);
+    // runs the fibers on the calling thread, until all of them return
+    void run ();
+
+public:
+    // the loop running on this thread, null if not on a fiber
+    static fiber_loop *current () {return current_;}
+    // like poll on a single descriptor, with the timeout in milliseconds
+    // on a fiber, only the fiber waits, and the other fibers keep running
+    // returns the events ready, or 0 if timed out
+    static int poll (int fd, short events, int timeout);
+    // sleeps for the milliseconds, only the fiber if on a fiber
+    static void sleep (int ms);
+
+private:
+    struct fiber
+    {
+        ucontext_t ctx;
+        std::vector<char> stack;
+        entry_fn f;
+        void *arg;
+        bool done;
+        // what the fiber is waiting for, if it's waiting
+        bool waiting;
+        int fd;
+        short events;
+        // in milliseconds since the epoch, negative if forever
+        long long deadline;
+        short ready;
+    };
+    // only one fiber at a time is woken up for a descriptor, so that the
+    // fibers waiting on a semaphore don't all rush for the same count
+    struct waiters
+    {
+        waiters () : events (0) {}
+        std::list<fiber *> fibers;
+        // the events the descriptor is watched for
+        short events;
+    };
+
+private:
+    fiber_loop (const fiber_loop &);
+    fiber_loop &operator = (const fiber_loop &);
+
+private:
+    static void trampoline (int hi, int lo);
+    short wait (int fd, short events, int timeout);
+    void resume (fiber *f);
+    void watch (int fd);
+    void wake (int fd, short revents);
+    void expire ();
+    int next_timeout ();
+
+private:
+    static __thread fiber_loop *current_;
+
+private:
+    int epfd_;
+    ucontext_t main_;
+    std::vector<std::tr1::shared_ptr<fiber> > fibers_;
+    fiber *running_;
+    size_t live_;
+    std::tr1::unordered_map<int, waiters> waiting_;
+};
+
+#endif // INCLUDED_FIBER_LOOP_HPP
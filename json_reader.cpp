@@ -0,0 +1,547 @@
+/// json_reader.cpp -- json request decoder impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-16
+///
+
+#include "exception.hpp"
+#include "json_reader.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+static void malformed ()
+{
+    throw coded_error (bad_req, "malformed json");
+}
+
+char json_reader::peek ()
+{
+    skip_ws ();
+    if (p_ == end_)
+        malformed ();
+    return *p_;
+}
+
+void json_reader::expect (char c)
+{
+    if (peek () != c)
+        malformed ();
+    ++p_;
+}
+
+bool json_reader::next_elem (char close, bool first)
+{
+    char c = peek ();
+    if (c == close) {
+        ++p_;
+        return false;
+    }
+    if (!first) {
+        if (c != ',')
+            malformed ();
+        ++p_;
+    }
+    return true;
+}
+
+static int hex_value (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    else if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static unsigned read_hex4 (const char *&p, const char *end)
+{
+    if (end - p < 4)
+        malformed ();
+    unsigned u = 0;
+    for (int i = 0; i < 4; ++i) {
+        int v = hex_value (*p++);
+        if (v < 0)
+            malformed ();
+        u = (u << 4) | v;
+    }
+    return u;
+}
+
+static char *put_utf8 (char *out, unsigned u)
+{
+    if (u < 0x80)
+        *out++ = u;
+    else if (u < 0x800) {
+        *out++ = 0xc0 | (u >> 6);
+        *out++ = 0x80 | (u & 0x3f);
+    } else if (u < 0x10000) {
+        *out++ = 0xe0 | (u >> 12);
+        *out++ = 0x80 | ((u >> 6) & 0x3f);
+        *out++ = 0x80 | (u & 0x3f);
+    } else {
+        *out++ = 0xf0 | (u >> 18);
+        *out++ = 0x80 | ((u >> 12) & 0x3f);
+        *out++ = 0x80 | ((u >> 6) & 0x3f);
+        *out++ = 0x80 | (u & 0x3f);
+    }
+    return out;
+}
+
+const char *json_reader::read_str (size_t &len)
+{
+    expect ('"');
+
+    // unescaped strings are never longer, so they're written over the
+    // escaped ones, and terminated where the closing quote used to be
+    char *start = p_;
+    char *out = p_;
+    while (true) {
+        if (p_ == end_)
+            malformed ();
+        char c = *p_++;
+        if (c == '"')
+            break;
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        if (p_ == end_)
+            malformed ();
+        switch (*p_++) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+            if (true) {
+                const char *q = p_;
+                unsigned u = read_hex4 (q, end_);
+                if (u >= 0xd800 && u < 0xdc00 && end_ - q >= 6 && q[0] == '\\'
+                    && q[1] == 'u') {
+                    // surrogate pair
+                    const char *r = q + 2;
+                    unsigned l = read_hex4 (r, end_);
+                    if (l >= 0xdc00 && l < 0xe000) {
+                        u = 0x10000 + ((u - 0xd800) << 10) + (l - 0xdc00);
+                        q = r;
+                    }
+                }
+                p_ = const_cast<char *> (q);
+                out = put_utf8 (out, u);
+            }
+            break;
+        default:
+            malformed ();
+        }
+    }
+
+    *out = 0;
+    len = out - start;
+    return start;
+}
+
+bool json_reader::read_num (int64_t &i, double &d)
+{
+    skip_ws ();
+    char *start = p_;
+    bool is_int = true;
+    for (; p_ != end_; ++p_) {
+        char c = *p_;
+        if (c == '.' || c == 'e' || c == 'E' || c == '+')
+            is_int = false;
+        else if (c != '-' && (c < '0' || c > '9'))
+            break;
+    }
+    // a number can never end a request, the object has to be closed
+    size_t len = p_ - start;
+    if (p_ == end_ || !len)
+        malformed ();
+
+    if (is_int) {
+        const char *q = start;
+        bool neg = *q == '-';
+        if (neg)
+            ++q;
+        if (q == p_)
+            malformed ();
+        uint64_t n = 0;
+        for (; q != p_; ++q) {
+            if (*q == '-')
+                malformed ();
+            unsigned digit = *q - '0';
+            if (n > (~(uint64_t) 0 - digit) / 10) {
+                is_int = false;
+                break;
+            }
+            n = n * 10 + digit;
+        }
+        if (is_int && n <= (uint64_t) numeric_limits<int64_t>::max () + neg) {
+            i = neg ? -(int64_t) (n - 1) - 1 : (int64_t) n;
+            return true;
+        }
+    }
+
+    // too big for integers, or a real floating point number
+    char tmp[64];
+    if (len >= sizeof (tmp))
+        malformed ();
+    memcpy (tmp, start, len);
+    tmp[len] = 0;
+    char *e;
+    d = strtod (tmp, &e);
+    if (*e)
+        malformed ();
+    return false;
+}
+
+size_t json_reader::read_uint ()
+{
+    if (peek () == 'n') {
+        skip_literal ("null");
+        return 0;
+    }
+
+    int64_t i;
+    double d;
+    if (!read_num (i, d) || i < 0)
+        throw coded_error (bad_req, "bad request field");
+    return i;
+}
+
+bool json_reader::read_bool ()
+{
+    switch (peek ()) {
+    case 't':
+        skip_literal ("true");
+        return true;
+    case 'f':
+        skip_literal ("false");
+        return false;
+    case 'n':
+        skip_literal ("null");
+        return false;
+    default:
+        throw coded_error (bad_req, "bad request field");
+    }
+}
+
+void json_reader::skip_literal (const char *lit)
+{
+    size_t len = strlen (lit);
+    skip_ws ();
+    if ((size_t) (end_ - p_) < len || memcmp (p_, lit, len))
+        malformed ();
+    p_ += len;
+}
+
+// fields skipped nest no deeper than this, or a request of nothing but
+// brackets would run a worker out of its stack
+static const size_t max_depth = 32;
+
+void json_reader::skip_value (size_t depth)
+{
+    size_t len;
+    int64_t i;
+    double d;
+    char c = peek ();
+    if ((c == '{' || c == '[') && depth >= max_depth)
+        throw coded_error (bad_req, "request nested too deeply");
+    switch (c) {
+    case '{':
+        ++p_;
+        for (bool first = true; next_elem ('}', first); first = false) {
+            read_str (len);
+            expect (':');
+            skip_value (depth + 1);
+        }
+        break;
+    case '[':
+        ++p_;
+        for (bool first = true; next_elem (']', first); first = false)
+            skip_value (depth + 1);
+        break;
+    case '"':
+        read_str (len);
+        break;
+    case 't':
+        skip_literal ("true");
+        break;
+    case 'f':
+        skip_literal ("false");
+        break;
+    case 'n':
+        skip_literal ("null");
+        break;
+    default:
+        read_num (i, d);
+        break;
+    }
+}
+
+static bool key_is (const char *k, size_t len, const char *name)
+{
+    return len == strlen (name) && !memcmp (k, name, len);
+}
+
+void json_reader::read (sql_req &req, sql_params &params)
+{
+    params.clear ();
+    bytes_reserved_ = false;
+
+    expect ('{');
+    for (bool first = true; next_elem ('}', first); first = false) {
+        size_t len;
+        const char *k = read_str (len);
+        expect (':');
+        if (key_is (k, len, "id"))
+            req.id = read_uint ();
+        else if (key_is (k, len, "sql"))
+            read_name (req);
+        else if (key_is (k, len, "txn"))
+            req.txn_seq = read_uint ();
+        else if (key_is (k, len, "blob_frames"))
+            req.blob_frames = read_bool ();
+        else if (key_is (k, len, "stream"))
+            req.stream = read_bool ();
+        else if (key_is (k, len, "batch"))
+            read_batch (req, params);
+        else if (key_is (k, len, "atomic"))
+            req.atomic = read_bool ();
+        else if (key_is (k, len, "parallel"))
+            req.parallel = read_bool ();
+        else if (key_is (k, len, "rows"))
+            read_rows (req, params);
+        else if (key_is (k, len, "on_error")) {
+            if (peek () != '"')
+                throw coded_error (bad_req, "bad request field");
+            const char *v = read_str (len);
+            if (key_is (v, len, "stop"))
+                req.stop_on_error = true;
+            else if (key_is (v, len, "continue"))
+                req.stop_on_error = false;
+            else
+                throw coded_error (bad_req, "bad request field");
+        } else if (key_is (k, len, "params"))
+            read_params (req, params);
+        else
+            skip_value ();
+    }
+    skip_ws ();
+    if (p_ != end_)
+        malformed ();
+
+    if (!req.id)
+        throw coded_error (bad_req, "no id specified");
+    if (!req.sql && !req.by_id && !req.batch)
+        throw coded_error (bad_req, "no statement specified");
+}
+
+void json_reader::read_name (sql_req &req)
+{
+    if (isdigit ((unsigned char) peek ())) {
+        req.stmt_id = read_uint ();
+        req.by_id = true;
+    } else if (peek () == '"')
+        req.sql = read_str (req.sql_len);
+    else
+        throw coded_error (bad_req, "bad statement name");
+}
+
+// an array of objects, each with the statement and its params, which are
+// decoded after those of the statements before
+void json_reader::read_batch (sql_req &req, sql_params &params)
+{
+    req.batch = true;
+    expect ('[');
+    for (bool first = true; next_elem (']', first); first = false) {
+        params.entries.push_back (sql_entry ());
+        sql_entry &e = params.entries.back ();
+        e.first = params.params.size ();
+        expect ('{');
+        for (bool f = true; next_elem ('}', f); f = false) {
+            size_t len;
+            const char *k = read_str (len);
+            expect (':');
+            if (key_is (k, len, "sql"))
+                read_name (e.req);
+            else if (key_is (k, len, "params"))
+                read_params (e.req, params);
+            else
+                skip_value ();
+        }
+        e.count = params.params.size () - e.first;
+    }
+}
+
+// an array of the params of each run, decoded one after another
+void json_reader::read_rows (sql_req &req, sql_params &params)
+{
+    req.bulk = true;
+    expect ('[');
+    for (bool first = true; next_elem (']', first); first = false) {
+        params.entries.push_back (sql_entry ());
+        sql_entry &e = params.entries.back ();
+        e.first = params.params.size ();
+        read_params (e.req, params);
+        e.count = params.params.size () - e.first;
+    }
+}
+
+void json_reader::read_params (sql_req &req, sql_params &params)
+{
+    if (peek () == 'n') {
+        skip_literal ("null");
+        return;
+    } else if (peek () != '[') {
+        skip_value ();
+        if (!req.err) {
+            req.err = bad_arg;
+            req.msg = "params must be an array";
+        }
+        return;
+    }
+
+    req.has_params = true;
+    expect ('[');
+    for (bool first = true; next_elem (']', first); first = false) {
+        params.params.push_back (sql_param ());
+        sql_param &param = params.params.back ();
+        param.type = null;
+        try {
+            read_param (param, params);
+        } catch (const coded_error &e) {
+            // the value has been consumed, keep on to find the rest fields
+            if (e.code () != bad_arg)
+                throw;
+            if (!req.err) {
+                req.err = e.code ();
+                req.msg = e.what ();
+            }
+            param.type = null;
+        }
+    }
+}
+
+void json_reader::read_param (sql_param &param, sql_params &params)
+{
+    switch (peek ()) {
+    case 'n':
+        skip_literal ("null");
+        param.type = null;
+        break;
+    case '"':
+        if (true) {
+            size_t len;
+            param.str = read_str (len);
+            param.len = len;
+            param.type = text;
+        }
+        break;
+    case '[':
+        read_array_param (param, params);
+        break;
+    case '{':
+        read_blob_ref (param, params);
+        break;
+    case 't': case 'f':
+        skip_value ();
+        throw coded_error (bad_arg, "unsupported parameter type");
+    default:
+        if (read_num (param.i, param.d))
+            param.type = integer;
+        else
+            param.type = floating_point;
+    }
+}
+
+void json_reader::read_array_param (sql_param &param, sql_params &params)
+{
+    // either [type, value] in strings, or binaries in byte values
+    if (!bytes_reserved_) {
+        // every byte takes at least a digit, so the bytes never move
+        params.bytes.reserve (end_ - p_);
+        bytes_reserved_ = true;
+    }
+    size_t start = params.bytes.size ();
+
+    expect ('[');
+    const char *strs[2] = {0, 0};
+    size_t n = 0, nstr = 0;
+    bool bad = false;
+    for (bool first = true; next_elem (']', first); first = false, ++n) {
+        char c = peek ();
+        if (c == '"') {
+            size_t len;
+            const char *s = read_str (len);
+            if (nstr < 2)
+                strs[nstr] = s;
+            ++nstr;
+        } else if (c == '-' || (c >= '0' && c <= '9')) {
+            int64_t i;
+            double d;
+            if (read_num (i, d))
+                params.bytes.push_back ((unsigned char) i);
+            else
+                bad = true;
+        } else {
+            skip_value ();
+            bad = true;
+        }
+    }
+
+    if (n == 2 && nstr == 2) {
+        params.bytes.resize (start);
+        set_typed_param (param, strs[0], strs[1]);
+    } else if (!nstr && !bad) {
+        param.type = binary;
+        param.str = (const char *) params.bytes.data () + start;
+        param.len = params.bytes.size () - start;
+    } else {
+        params.bytes.resize (start);
+        throw coded_error (bad_arg, "unrecognized parameter type");
+    }
+}
+
+void json_reader::read_blob_ref (sql_param &param, sql_params &params)
+{
+    // {"blob": k}, k being the index of the frame following the request
+    expect ('{');
+    bool found = false, bad = false;
+    for (bool first = true; next_elem ('}', first); first = false) {
+        size_t len;
+        const char *k = read_str (len);
+        expect (':');
+        char c = peek ();
+        if (key_is (k, len, "blob") && c >= '0' && c <= '9' && !found) {
+            int64_t i;
+            double d;
+            if (read_num (i, d)) {
+                param.u = i;
+                found = true;
+            } else
+                bad = true;
+        } else {
+            skip_value ();
+            bad = true;
+        }
+    }
+    if (!found || bad)
+        throw coded_error (bad_arg, "unrecognized parameter type");
+
+    param.type = binary;
+    param.str = 0;
+    param.len = 0;
+    params.blob_refs.push_back (params.params.size () - 1);
+}
@@ -0,0 +1,58 @@
+/// json_reader.hpp -- json request decoder decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-16
+///
+
+#ifndef INCLUDED_JSON_READER_HPP
+#define INCLUDED_JSON_READER_HPP
+
+#include "sql_params.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+
+// decodes a request in a single pass, without building any object tree
+// strings are unescaped in place and point into the request buffer, which
+// therefore has to outlive the decoded params
+class json_reader
+{
+public:
+    json_reader (char *p, size_t len)
+        : p_ (p), end_ (p + len), bytes_reserved_ (false) {}
+    // throws coded_error on malformed requests
+    void read (sql_req &req, sql_params &params);
+
+private:
+    void skip_ws ()
+        {
+            while (p_ != end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n'
+                                  || *p_ == '\r'))
+                ++p_;
+        }
+    char peek ();
+    void expect (char c);
+    bool next_elem (char close, bool first);
+    const char *read_str (size_t &len);
+    bool read_num (int64_t &i, double &d);
+    size_t read_uint ();
+    bool read_bool ();
+    void skip_literal (const char *lit);
+    // depth is how deep in the fields skipped the value is
+    void skip_value (size_t depth = 0);
+    void read_name (sql_req &req);
+    void read_batch (sql_req &req, sql_params &params);
+    void read_rows (sql_req &req, sql_params &params);
+    void read_params (sql_req &req, sql_params &params);
+    void read_param (sql_param &param, sql_params &params);
+    void read_array_param (sql_param &param, sql_params &params);
+    void read_blob_ref (sql_param &param, sql_params &params);
+
+private:
+    char *p_;
+    char *end_;
+    bool bytes_reserved_;
+};
+
+#endif // INCLUDED_JSON_READER_HPP
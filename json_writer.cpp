@@ -0,0 +1,272 @@
+/// json_writer.cpp -- json response encoder impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-15
+///
+
+#include "json_writer.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+static const char s_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+size_t json_writer::format_uint (char *out, uint64_t n)
+{
+    char tmp[20];
+    char *p = tmp + sizeof (tmp);
+    while (n >= 100) {
+        unsigned i = (n % 100) * 2;
+        n /= 100;
+        *--p = s_digits[i + 1];
+        *--p = s_digits[i];
+    }
+    if (n >= 10) {
+        *--p = s_digits[n * 2 + 1];
+        *--p = s_digits[n * 2];
+    } else
+        *--p = '0' + n;
+
+    size_t len = tmp + sizeof (tmp) - p;
+    memcpy (out, p, len);
+    return len;
+}
+
+static inline char *put_bidigit (char *p, unsigned n)
+{
+    n %= 100;
+    p[0] = s_digits[n * 2];
+    p[1] = s_digits[n * 2 + 1];
+    return p + 2;
+}
+
+size_t json_writer::format_time (char *out, const MYSQL_TIME &t)
+{
+    // 0000-00-00T00:00:00
+    char *p = out;
+    p = put_bidigit (p, t.year / 100);
+    p = put_bidigit (p, t.year);
+    *p++ = '-';
+    p = put_bidigit (p, t.month);
+    *p++ = '-';
+    p = put_bidigit (p, t.day);
+    *p++ = 'T';
+    p = put_bidigit (p, t.hour);
+    *p++ = ':';
+    p = put_bidigit (p, t.minute);
+    *p++ = ':';
+    p = put_bidigit (p, t.second);
+    return p - out;
+}
+
+static const char s_hex[] = "0123456789abcdef";
+
+static inline void escape_char (res_buf &buf, unsigned char c)
+{
+    char *p = buf.reserve (6);
+    p[0] = '\\';
+    switch (c) {
+    case '"': p[1] = '"'; break;
+    case '\\': p[1] = '\\'; break;
+    case '\b': p[1] = 'b'; break;
+    case '\f': p[1] = 'f'; break;
+    case '\n': p[1] = 'n'; break;
+    case '\r': p[1] = 'r'; break;
+    case '\t': p[1] = 't'; break;
+    default:
+        p[1] = 'u';
+        p[2] = '0';
+        p[3] = '0';
+        p[4] = s_hex[c >> 4];
+        p[5] = s_hex[c & 0xf];
+        buf.commit (6);
+        return;
+    }
+    buf.commit (2);
+}
+
+static inline bool needs_escape (unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+void json_writer::escape (res_buf &buf, const char *s, size_t len)
+{
+    const char *end = s + len;
+    const char *run = s;
+
+#ifdef __SSE2__
+    // scan 16 bytes at a time, and copy the clean runs in one go
+    const __m128i quote = _mm_set1_epi8 ('"');
+    const __m128i slash = _mm_set1_epi8 ('\\');
+    const __m128i ctrl = _mm_set1_epi8 (0x1f);
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) s);
+        __m128i m = _mm_or_si128 (
+            _mm_or_si128 (_mm_cmpeq_epi8 (v, quote), _mm_cmpeq_epi8 (v, slash)),
+            // unsigned v <= 0x1f
+            _mm_cmpeq_epi8 (_mm_max_epu8 (v, ctrl), ctrl));
+        int mask = _mm_movemask_epi8 (m);
+        if (!mask) {
+            s += 16;
+            continue;
+        }
+        s += __builtin_ctz (mask);
+        buf.append (run, s - run);
+        escape_char (buf, *s++);
+        run = s;
+    }
+#endif
+
+    for (; s != end; ++s) {
+        if (!needs_escape (*s))
+            continue;
+        buf.append (run, s - run);
+        escape_char (buf, *s);
+        run = s + 1;
+    }
+    buf.append (run, end - run);
+}
+
+void json_writer::key (const char *k, size_t len)
+{
+    str (k, len);
+    buf_.put (':');
+    // the value following shall not be prefixed with a comma
+    first_ |= 1;
+}
+
+void json_writer::int64 (int64_t n, bool quoted)
+{
+    prefix ();
+    char *p = buf_.reserve (23);
+    char *start = p;
+    if (quoted)
+        *p++ = '"';
+    if (n < 0) {
+        *p++ = '-';
+        p += format_uint (p, -(uint64_t) n);
+    } else
+        p += format_uint (p, n);
+    if (quoted)
+        *p++ = '"';
+    buf_.commit (p - start);
+}
+
+void json_writer::uint64 (uint64_t n, bool quoted)
+{
+    prefix ();
+    char *p = buf_.reserve (22);
+    char *start = p;
+    if (quoted)
+        *p++ = '"';
+    p += format_uint (p, n);
+    if (quoted)
+        *p++ = '"';
+    buf_.commit (p - start);
+}
+
+void json_writer::float64 (double d)
+{
+    if (!isfinite (d)) {
+        // json has no nan or inf
+        null ();
+        return;
+    }
+
+    prefix ();
+    // %.17g is lossless, and snprintf on the stack does not allocate
+    char tmp[32];
+    int len = snprintf (tmp, sizeof (tmp), "%.17g", d);
+    assert (len > 0 && (size_t) len < sizeof (tmp));
+    buf_.append (tmp, len);
+}
+
+void json_writer::str (const char *s, size_t len)
+{
+    prefix ();
+    buf_.put ('"');
+    escape (buf_, s, len);
+    buf_.put ('"');
+}
+
+void json_writer::bytes (const unsigned char *p, size_t len)
+{
+    open ('[');
+    if (len) {
+        // at most 4 bytes for each: "255,"
+        char *out = buf_.reserve (len * 4);
+        char *start = out;
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = p[i];
+            if (c >= 100) {
+                *out++ = '0' + c / 100;
+                out = put_bidigit (out, c);
+            } else if (c >= 10)
+                out = put_bidigit (out, c);
+            else
+                *out++ = '0' + c;
+            *out++ = ',';
+        }
+        // no trailing comma
+        buf_.commit (out - start - 1);
+    }
+    close (']');
+}
+
+void json_writer::time (const MYSQL_TIME &t)
+{
+    prefix ();
+    char *p = buf_.reserve (21);
+    p[0] = '"';
+    size_t len = format_time (p + 1, t);
+    p[len + 1] = '"';
+    buf_.commit (len + 2);
+}
+
+void json_writer::column (const MYSQL_BIND &bd)
+{
+    if (bd.is_null && *bd.is_null) {
+        null ();
+        return;
+    }
+
+    const void *buf = bd.buffer;
+    size_t len = bd.length ? *bd.length : 0;
+    switch (bd.buffer_type) {
+    case MYSQL_TYPE_NULL:
+        null ();
+        break;
+    case MYSQL_TYPE_LONGLONG:
+        if (bd.is_unsigned)
+            uint64 (*(const uint64_t *) buf, true);
+        else
+            int64 (*(const int64_t *) buf, true);
+        break;
+    case MYSQL_TYPE_DOUBLE:
+        float64 (*(const double *) buf);
+        break;
+    case MYSQL_TYPE_STRING:
+        str ((const char *) buf, len);
+        break;
+    case MYSQL_TYPE_BLOB:
+        bytes ((const unsigned char *) buf, len);
+        break;
+    case MYSQL_TYPE_TIMESTAMP:
+        time (*(const MYSQL_TIME *) buf);
+        break;
+    default:
+        assert (0);
+        null ();
+    }
+}
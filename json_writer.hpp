@@ -0,0 +1,100 @@
+/// json_writer.hpp -- json response encoder decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-15
+///
+
+#ifndef INCLUDED_JSON_WRITER_HPP
+#define INCLUDED_JSON_WRITER_HPP
+
+#include "res_buf.hpp"
+
+#include <mysql/mysql.h>
+
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+
+// appends json values straight into a res_buf, commas are inserted
+// automatically, so callers only have to open and close the containers
+class json_writer
+{
+public:
+    explicit json_writer (res_buf &buf) : buf_ (buf), first_ (1) {}
+
+public:
+    void begin_array () {open ('[');}
+    // json does not need the sizes, they're for other formats' sake
+    void begin_array (size_t) {open ('[');}
+    void end_array () {close (']');}
+    void begin_object () {open ('{');}
+    void begin_object (size_t) {open ('{');}
+    void end_object () {close ('}');}
+    void key (const char *k) {key (k, strlen (k));}
+    void key (const char *k, size_t len);
+
+    void null ()
+        {
+            prefix ();
+            buf_.append ("null", 4);
+        }
+    void boolean (bool b)
+        {
+            prefix ();
+            if (b)
+                buf_.append ("true", 4);
+            else
+                buf_.append ("false", 5);
+        }
+    // integers are quoted when asked to, for js clients cannot hold 64 bits
+    void int64 (int64_t n, bool quoted = false);
+    void uint64 (uint64_t n, bool quoted = false);
+    void float64 (double d);
+    void str (const char *s, size_t len);
+    void str (const std::string &s) {str (s.data (), s.size ());}
+    // binaries go as arrays of byte values
+    void bytes (const unsigned char *p, size_t len);
+    void time (const MYSQL_TIME &t);
+    // a fetched column in results
+    void column (const MYSQL_BIND &bd);
+    // a value encoded already, by another writer
+    void raw (const char *p, size_t len)
+        {
+            prefix ();
+            buf_.append (p, len);
+        }
+
+public:
+    // the kernels, exposed for the writers of other formats
+    static size_t format_uint (char *out, uint64_t n);
+    static size_t format_time (char *out, const MYSQL_TIME &t);
+    static void escape (res_buf &buf, const char *s, size_t len);
+
+private:
+    void prefix ()
+        {
+            if (first_ & 1)
+                first_ &= ~(uint64_t) 1;
+            else
+                buf_.put (',');
+        }
+    void open (char c)
+        {
+            prefix ();
+            buf_.put (c);
+            first_ = (first_ << 1) | 1;
+        }
+    void close (char c)
+        {
+            first_ >>= 1;
+            buf_.put (c);
+        }
+
+private:
+    res_buf &buf_;
+    // one bit per nesting level, set if no value is written at the level
+    uint64_t first_;
+};
+
+#endif // INCLUDED_JSON_WRITER_HPP
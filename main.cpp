@@ -5,6 +5,7 @@
 ///
 
 #include "conn_pool.hpp"
+#include "mysql_conn.hpp"
 
 #include <vconf/vconf.h>
 
@@ -14,6 +15,8 @@
 #include <boost/lexical_cast.hpp>
 
 #include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <cassert>
 #include <cstdlib>
@@ -26,8 +29,10 @@ using namespace std;
 using namespace boost;
 
 static string s_host, s_port;
-static string s_stmts_file;
-static uint32_t s_db_timeout, s_pool_cap, s_idle_timeout;
+static string s_stmts_file, s_stmts_cache;
+static uint32_t s_db_timeout, s_pool_cap, s_idle_timeout, s_shards;
+static uint32_t s_inproc, s_threads, s_async, s_pool_min, s_reap_timeout;
+static uint32_t s_warm_up, s_stmt_cap, s_parallel_cap;
 
 static string working_dir (int argc, char **argv)
 {
@@ -67,15 +72,42 @@ static void parse_config (struct vconf *conf)
     const char *s = vconf_get_string (conf, "sql_file");
     s_stmts_file = s && s[0] ? s : "sqls";
     clog << "reading statements from file: " << s_stmts_file << endl << flush;
+    s = vconf_get_string (conf, "sql_cache_file");
+    if (s && s[0]) {
+        s_stmts_cache = s;
+        clog << "caching statement results in file: " << s_stmts_cache << endl
+             << flush;
+    }
 
     if (vconf_get_uint (conf, "mysql_conn_timeout", &s_db_timeout))
         s_db_timeout = 180;
     clog << "setting mysql connection timeout to " << s_db_timeout << endl
          << flush;
-    if (vconf_get_uint (conf, "conn_pool_capacity", &s_pool_cap))
+    // conn_pool_capacity is the old name of conn_pool_max
+    if (vconf_get_uint (conf, "conn_pool_max", &s_pool_cap)
+        && vconf_get_uint (conf, "conn_pool_capacity", &s_pool_cap))
         s_pool_cap = 100;
     clog << "setting connection pool capacity to " << s_pool_cap << endl
          << flush;
+    // the pool never shrinks unless told to: conn_pool_min defaults to
+    // conn_pool_max, and with the two equal, no connection is ever closed
+    // for being idle, whatever conn_idle_timeout says
+    // otherwise, the connections idle for conn_idle_timeout seconds are
+    // closed, one a second at most, down to conn_pool_min
+    if (vconf_get_uint (conf, "conn_pool_min", &s_pool_min))
+        s_pool_min = s_pool_cap;
+    else if (s_pool_min > s_pool_cap) {
+        cerr << "more connections kept than the pool capacity: " << s_pool_min
+             << endl << flush;
+        s_pool_min = s_pool_cap;
+    }
+    if (vconf_get_uint (conf, "conn_idle_timeout", &s_reap_timeout))
+        s_reap_timeout = 300;
+    if (s_pool_min < s_pool_cap) {
+        clog << "closing connections idle for " << s_reap_timeout
+             << " seconds, keeping at least " << s_pool_min << endl << flush;
+    } else
+        clog << "never closing idle connections" << endl << flush;
     if (vconf_get_uint (conf, "txn_idle_timeout", &s_idle_timeout))
         s_idle_timeout = 600;
     else if (s_idle_timeout > 1800) {
@@ -85,6 +117,52 @@ static void parse_config (struct vconf *conf)
     }
     clog << "setting transaction idle timeout to " << s_idle_timeout << endl
          << flush;
+    if (vconf_get_uint (conf, "broker_shards", &s_shards) || !s_shards)
+        s_shards = 1;
+    else if (s_shards > s_pool_cap) {
+        cerr << "more broker shards than connections: " << s_shards << endl
+             << flush;
+        s_shards = s_pool_cap;
+    }
+    clog << "running " << s_shards << " broker shards, listening from port "
+         << s_port << " on" << endl << flush;
+    if (vconf_get_uint (conf, "broker_inproc", &s_inproc))
+        s_inproc = 0;
+    clog << "passing requests to workers through "
+         << (s_inproc ? "inproc sockets" : "queues") << endl << flush;
+    if (vconf_get_uint (conf, "mysql_async", &s_async))
+        s_async = 0;
+    if (s_async && s_inproc) {
+        cerr << "async mysql calls need the queues, running blocking calls"
+             << endl << flush;
+        s_async = 0;
+    }
+    // txns are only decoupled from the workers on the queue path
+    // async, a single thread for each shard drives all of its connections
+    if (s_inproc || vconf_get_uint (conf, "worker_threads", &s_threads)
+        || !s_threads)
+        s_threads = s_async ? s_shards : s_pool_cap;
+    else if (s_threads < s_shards) {
+        cerr << "fewer worker threads than broker shards: " << s_threads
+             << endl << flush;
+        s_threads = s_shards;
+    }
+    clog << "running " << s_threads << " worker threads"
+         << (s_async ? ", with async mysql calls" : "") << endl << flush;
+    if (vconf_get_uint (conf, "warm_up", &s_warm_up))
+        s_warm_up = 0;
+    // as many as the server allows, unless told otherwise
+    if (vconf_get_uint (conf, "conn_stmt_cache", &s_stmt_cap))
+        s_stmt_cap = 0;
+    if (s_stmt_cap) {
+        clog << "keeping at most " << s_stmt_cap
+             << " statements prepared on each connection" << endl << flush;
+    }
+    if (vconf_get_uint (conf, "parallel_conns", &s_parallel_cap)
+        || !s_parallel_cap)
+        s_parallel_cap = 4;
+    clog << "running parallel batches on at most " << s_parallel_cap
+         << " connections each" << endl << flush;
 }
 
 struct find_from_conf
@@ -118,6 +196,15 @@ int main (int argc, char **argv)
 
     parse_config (conf);
 
+    // SIGHUP reloads the statements, and SIGUSR1 reports how the prepared
+    // statements have been found, both taken only by sigwait, so the
+    // threads started from now on all have them blocked
+    sigset_t sigs;
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGHUP);
+    sigaddset (&sigs, SIGUSR1);
+    pthread_sigmask (SIG_BLOCK, &sigs, 0);
+
     if (mysql_library_init (0, 0, 0)) {
         cerr << "failed to init mysql library, cannot proceed" << endl << flush;
         exit (1);
@@ -128,19 +215,35 @@ int main (int argc, char **argv)
     string listen = string ("tcp://") + s_host + ":" + s_port;
     conn_pool pool (ctx, listen, db->host, db->port, db->user,
                     db->password ?: "", db->path ? &db->path[1] : "",
-                    s_db_timeout, s_pool_cap, s_idle_timeout);
+                    s_db_timeout, s_pool_cap, s_idle_timeout, s_shards,
+                    s_inproc, s_threads, s_async, s_pool_min,
+                    s_reap_timeout, s_stmt_cap, s_parallel_cap);
 
+    // the db names are looked up again in the config on reload
     pool.init_stmts (working_dir (argc, argv) + "etc/", s_stmts_file,
-                     s_db_timeout, find_from_conf (conf));
-    vconf_free (conf);
+                     s_db_timeout, find_from_conf (conf), s_stmts_cache);
 
-    pool.start ();
+    pool.start (s_warm_up);
 
     vconf_free_url (db);
 
-    while (true)
-        ;
+    while (true) {
+        int sig;
+        if (sigwait (&sigs, &sig))
+            continue;
+        if (sig == SIGHUP) {
+            clog << "reloading statements from file: " << s_stmts_file
+                 << endl << flush;
+            pool.reload_stmts ();
+        } else if (sig == SIGUSR1) {
+            stmt_stats st = pool.prepared_stats ();
+            clog << "prepared statements: " << st.hits << " hits, "
+                 << st.misses << " misses, " << st.evicts << " evicted"
+                 << endl << flush;
+        }
+    }
 
+    vconf_free (conf);
     mysql_library_end ();
     return 0;
 }
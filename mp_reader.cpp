@@ -0,0 +1,458 @@
+/// mp_reader.cpp -- msgpack request decoder impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-17
+///
+
+#include "exception.hpp"
+#include "mp_reader.hpp"
+
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+static void malformed ()
+{
+    throw coded_error (bad_req, "malformed msgpack");
+}
+
+void mp_reader::need (size_t n)
+{
+    if ((size_t) (end_ - p_) < n)
+        malformed ();
+}
+
+uint64_t mp_reader::read_be (size_t n)
+{
+    need (n);
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i)
+        v = (v << 8) | *p_++;
+    return v;
+}
+
+unsigned char mp_reader::byte ()
+{
+    need (1);
+    return *p_++;
+}
+
+unsigned char mp_reader::peek ()
+{
+    need (1);
+    return *p_;
+}
+
+// consumes the header if the next value is a string
+bool mp_reader::str_len (unsigned char c, size_t &len)
+{
+    if ((c & 0xe0) == 0xa0) {
+        ++p_;
+        len = c & 0x1f;
+    } else if (c >= 0xd9 && c <= 0xdb) {
+        ++p_;
+        len = read_be (1 << (c - 0xd9));
+    } else
+        return false;
+    need (len);
+    return true;
+}
+
+const char *mp_reader::read_str (size_t &len)
+{
+    if (!str_len (peek (), len))
+        malformed ();
+    const char *s = (const char *) p_;
+    p_ += len;
+    return s;
+}
+
+size_t mp_reader::read_map ()
+{
+    unsigned char c = byte ();
+    if ((c & 0xf0) == 0x80)
+        return c & 0x0f;
+    else if (c == 0xde || c == 0xdf)
+        return read_be (c == 0xde ? 2 : 4);
+    malformed ();
+    return 0;
+}
+
+// consumes the header if the next value is an array
+bool mp_reader::read_array (size_t &n)
+{
+    unsigned char c = peek ();
+    if ((c & 0xf0) == 0x90) {
+        ++p_;
+        n = c & 0x0f;
+    } else if (c == 0xdc || c == 0xdd) {
+        ++p_;
+        n = read_be (c == 0xdc ? 2 : 4);
+    } else
+        return false;
+    return true;
+}
+
+size_t mp_reader::read_uint ()
+{
+    unsigned char c = byte ();
+    if (c <= 0x7f)
+        return c;
+    else if (c == 0xc0)
+        return 0;
+    else if (c >= 0xcc && c <= 0xcf)
+        return read_be (1 << (c - 0xcc));
+    throw coded_error (bad_req, "bad request field");
+}
+
+bool mp_reader::read_bool ()
+{
+    unsigned char c = byte ();
+    if (c == 0xc3)
+        return true;
+    else if (c == 0xc2 || c == 0xc0)
+        return false;
+    throw coded_error (bad_req, "bad request field");
+}
+
+// fields skipped nest no deeper than this, or a request of nothing but
+// one element arrays would run a worker out of its stack
+static const size_t max_depth = 32;
+
+void mp_reader::skip_value (size_t depth)
+{
+    unsigned char c = peek ();
+    size_t n;
+    bool nested = (c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd
+        || (c & 0xf0) == 0x80 || c == 0xde || c == 0xdf;
+    if (nested && depth >= max_depth)
+        throw coded_error (bad_req, "request nested too deeply");
+    if (str_len (c, n)) {
+        p_ += n;
+        return;
+    } else if (read_array (n)) {
+        for (size_t i = 0; i < n; ++i)
+            skip_value (depth + 1);
+        return;
+    } else if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf) {
+        n = read_map ();
+        for (size_t i = 0; i < n * 2; ++i)
+            skip_value (depth + 1);
+        return;
+    }
+
+    ++p_;
+    if (c <= 0x7f || c >= 0xe0 || c == 0xc0 || c == 0xc2 || c == 0xc3)
+        return;
+    switch (c) {
+    case 0xc4: case 0xc5: case 0xc6:
+        // bin
+        n = read_be (1 << (c - 0xc4));
+        break;
+    case 0xc7: case 0xc8: case 0xc9:
+        // ext, with the type byte
+        n = read_be (1 << (c - 0xc7)) + 1;
+        break;
+    case 0xca:
+        n = 4;
+        break;
+    case 0xcb:
+        n = 8;
+        break;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf:
+        n = 1 << (c - 0xcc);
+        break;
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+        n = 1 << (c - 0xd0);
+        break;
+    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+        // fixext
+        n = (1 << (c - 0xd4)) + 1;
+        break;
+    default:
+        malformed ();
+    }
+    need (n);
+    p_ += n;
+}
+
+static bool key_is (const char *k, size_t len, const char *name)
+{
+    return len == strlen (name) && !memcmp (k, name, len);
+}
+
+void mp_reader::read (sql_req &req, sql_params &params)
+{
+    params.clear ();
+
+    size_t n = read_map ();
+    for (size_t i = 0; i < n; ++i) {
+        size_t len;
+        const char *k = read_str (len);
+        if (key_is (k, len, "id"))
+            req.id = read_uint ();
+        else if (key_is (k, len, "sql"))
+            read_name (req);
+        else if (key_is (k, len, "txn"))
+            req.txn_seq = read_uint ();
+        else if (key_is (k, len, "blob_frames"))
+            req.blob_frames = read_bool ();
+        else if (key_is (k, len, "stream"))
+            req.stream = read_bool ();
+        else if (key_is (k, len, "batch"))
+            read_batch (req, params);
+        else if (key_is (k, len, "atomic"))
+            req.atomic = read_bool ();
+        else if (key_is (k, len, "parallel"))
+            req.parallel = read_bool ();
+        else if (key_is (k, len, "rows"))
+            read_rows (req, params);
+        else if (key_is (k, len, "on_error")) {
+            size_t l;
+            if (!str_len (peek (), l))
+                throw coded_error (bad_req, "bad request field");
+            const char *v = (const char *) p_;
+            p_ += l;
+            if (key_is (v, l, "stop"))
+                req.stop_on_error = true;
+            else if (key_is (v, l, "continue"))
+                req.stop_on_error = false;
+            else
+                throw coded_error (bad_req, "bad request field");
+        } else if (key_is (k, len, "params"))
+            read_params (req, params);
+        else
+            skip_value ();
+    }
+    if (p_ != end_)
+        malformed ();
+
+    if (!req.id)
+        throw coded_error (bad_req, "no id specified");
+    if (!req.sql && !req.by_id && !req.batch)
+        throw coded_error (bad_req, "no statement specified");
+}
+
+void mp_reader::read_name (sql_req &req)
+{
+    unsigned char c = peek ();
+    if (c <= 0x7f || (c >= 0xcc && c <= 0xcf)) {
+        req.stmt_id = read_uint ();
+        req.by_id = true;
+        return;
+    }
+    size_t l;
+    if (!str_len (c, l))
+        throw coded_error (bad_req, "bad statement name");
+    req.sql = (const char *) p_;
+    req.sql_len = l;
+    p_ += l;
+}
+
+// an array of maps, each with the statement and its params, which are
+// decoded after those of the statements before
+void mp_reader::read_batch (sql_req &req, sql_params &params)
+{
+    size_t n;
+    if (!read_array (n))
+        throw coded_error (bad_req, "batch must be an array");
+    req.batch = true;
+    for (size_t i = 0; i < n; ++i) {
+        params.entries.push_back (sql_entry ());
+        sql_entry &e = params.entries.back ();
+        e.first = params.params.size ();
+        size_t m = read_map ();
+        for (size_t j = 0; j < m; ++j) {
+            size_t len;
+            const char *k = read_str (len);
+            if (key_is (k, len, "sql"))
+                read_name (e.req);
+            else if (key_is (k, len, "params"))
+                read_params (e.req, params);
+            else
+                skip_value ();
+        }
+        e.count = params.params.size () - e.first;
+    }
+}
+
+// an array of the params of each run, decoded one after another
+void mp_reader::read_rows (sql_req &req, sql_params &params)
+{
+    size_t n;
+    if (!read_array (n))
+        throw coded_error (bad_req, "rows must be an array");
+    req.bulk = true;
+    for (size_t i = 0; i < n; ++i) {
+        params.entries.push_back (sql_entry ());
+        sql_entry &e = params.entries.back ();
+        e.first = params.params.size ();
+        read_params (e.req, params);
+        e.count = params.params.size () - e.first;
+    }
+}
+
+void mp_reader::read_params (sql_req &req, sql_params &params)
+{
+    if (peek () == 0xc0) {
+        ++p_;
+        return;
+    }
+    size_t n;
+    if (!read_array (n)) {
+        skip_value ();
+        if (!req.err) {
+            req.err = bad_arg;
+            req.msg = "params must be an array";
+        }
+        return;
+    }
+
+    req.has_params = true;
+    for (size_t i = 0; i < n; ++i) {
+        params.params.push_back (sql_param ());
+        sql_param &param = params.params.back ();
+        param.type = null;
+        try {
+            read_param (param, params);
+        } catch (const coded_error &e) {
+            // the value has been consumed, keep on to find the rest fields
+            if (e.code () != bad_arg)
+                throw;
+            if (!req.err) {
+                req.err = e.code ();
+                req.msg = e.what ();
+            }
+            param.type = null;
+        }
+    }
+}
+
+// copies a msgpack string into a nul terminated buffer
+static bool copy_str (char *buf, size_t size, const char *s, size_t len)
+{
+    if (len >= size)
+        return false;
+    memcpy (buf, s, len);
+    buf[len] = 0;
+    return true;
+}
+
+void mp_reader::read_param (sql_param &param, sql_params &params)
+{
+    unsigned char c = peek ();
+    size_t len;
+    if (c == 0xc0) {
+        ++p_;
+        param.type = null;
+    } else if (c <= 0x7f || c >= 0xe0) {
+        ++p_;
+        param.type = integer;
+        param.i = (signed char) c;
+    } else if (c >= 0xcc && c <= 0xcf) {
+        ++p_;
+        uint64_t u = read_be (1 << (c - 0xcc));
+        if (u > (uint64_t) numeric_limits<int64_t>::max ()) {
+            param.type = unsigned_int;
+            param.u = u;
+        } else {
+            param.type = integer;
+            param.i = u;
+        }
+    } else if (c >= 0xd0 && c <= 0xd3) {
+        ++p_;
+        size_t bytes = 1 << (c - 0xd0);
+        uint64_t u = read_be (bytes);
+        // sign extend
+        size_t shift = 64 - bytes * 8;
+        param.type = integer;
+        param.i = shift ? (int64_t) (u << shift) >> shift : (int64_t) u;
+    } else if (c == 0xca) {
+        ++p_;
+        uint32_t u = read_be (4);
+        float f;
+        memcpy (&f, &u, sizeof (f));
+        param.type = floating_point;
+        param.d = f;
+    } else if (c == 0xcb) {
+        ++p_;
+        uint64_t u = read_be (8);
+        param.type = floating_point;
+        memcpy (&param.d, &u, sizeof (param.d));
+    } else if (str_len (c, len)) {
+        param.type = text;
+        param.str = (const char *) p_;
+        param.len = len;
+        p_ += len;
+    } else if (c >= 0xc4 && c <= 0xc6) {
+        ++p_;
+        len = read_be (1 << (c - 0xc4));
+        need (len);
+        param.type = binary;
+        param.str = (const char *) p_;
+        param.len = len;
+        p_ += len;
+    } else if (read_array (len)) {
+        // [type, value]
+        const char *strs[2] = {0, 0};
+        size_t lens[2] = {0, 0};
+        size_t nstr = 0;
+        for (size_t i = 0; i < len; ++i) {
+            size_t l;
+            if (i < 2 && str_len (peek (), l)) {
+                strs[i] = (const char *) p_;
+                lens[i] = l;
+                p_ += l;
+                ++nstr;
+            } else
+                skip_value ();
+        }
+        char type[16], value[64];
+        if (len != 2 || nstr != 2)
+            throw coded_error (bad_arg, "unrecognized parameter type");
+        if (!copy_str (type, sizeof (type), strs[0], lens[0]))
+            throw coded_error (bad_arg, "unrecognized parameter type");
+        if (!copy_str (value, sizeof (value), strs[1], lens[1]))
+            throw coded_error (bad_arg, "bad parameter value");
+        set_typed_param (param, type, value);
+    } else if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf)
+        read_blob_ref (param, params);
+    else {
+        skip_value ();
+        throw coded_error (bad_arg, "unsupported parameter type");
+    }
+}
+
+void mp_reader::read_blob_ref (sql_param &param, sql_params &params)
+{
+    // {"blob": k}, k being the index of the frame following the request
+    size_t n = read_map ();
+    bool found = false, bad = false;
+    for (size_t i = 0; i < n; ++i) {
+        size_t len;
+        const char *k = 0;
+        if (str_len (peek (), len)) {
+            k = (const char *) p_;
+            p_ += len;
+        } else
+            skip_value ();
+        unsigned char c = peek ();
+        if (k && key_is (k, len, "blob") && (c <= 0x7f
+                                             || (c >= 0xcc && c <= 0xcf))
+            && !found) {
+            param.u = read_uint ();
+            found = true;
+        } else {
+            skip_value ();
+            bad = true;
+        }
+    }
+    if (!found || bad)
+        throw coded_error (bad_arg, "unrecognized parameter type");
+
+    param.type = binary;
+    param.str = 0;
+    param.len = 0;
+    params.blob_refs.push_back (params.params.size () - 1);
+}
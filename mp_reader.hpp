@@ -0,0 +1,52 @@
+/// mp_reader.hpp -- msgpack request decoder decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-17
+///
+
+#ifndef INCLUDED_MP_READER_HPP
+#define INCLUDED_MP_READER_HPP
+
+#include "sql_params.hpp"
+
+#include <stdint.h>
+
+#include <cstddef>
+
+// the msgpack counterpart of json_reader
+// strings and binaries are not copied, they point into the request
+class mp_reader
+{
+public:
+    mp_reader (const char *p, size_t len)
+        : p_ ((const unsigned char *) p),
+          end_ ((const unsigned char *) p + len) {}
+    // throws coded_error on malformed requests
+    void read (sql_req &req, sql_params &params);
+
+private:
+    void need (size_t n);
+    uint64_t read_be (size_t n);
+    unsigned char byte ();
+    unsigned char peek ();
+    bool str_len (unsigned char c, size_t &len);
+    const char *read_str (size_t &len);
+    size_t read_map ();
+    bool read_array (size_t &n);
+    size_t read_uint ();
+    bool read_bool ();
+    // depth is how deep in the fields skipped the value is
+    void skip_value (size_t depth = 0);
+    void read_name (sql_req &req);
+    void read_batch (sql_req &req, sql_params &params);
+    void read_rows (sql_req &req, sql_params &params);
+    void read_params (sql_req &req, sql_params &params);
+    void read_param (sql_param &param, sql_params &params);
+    void read_blob_ref (sql_param &param, sql_params &params);
+
+private:
+    const unsigned char *p_;
+    const unsigned char *end_;
+};
+
+#endif // INCLUDED_MP_READER_HPP
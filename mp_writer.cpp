@@ -0,0 +1,201 @@
+/// mp_writer.cpp -- msgpack response encoder impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-17
+///
+
+#include "json_writer.hpp"
+#include "mp_writer.hpp"
+
+#include <cassert>
+
+using namespace std;
+
+static inline char *put_be (char *p, uint64_t n, size_t bytes)
+{
+    for (size_t i = bytes; i > 0; --i) {
+        p[i - 1] = (char) (n & 0xff);
+        n >>= 8;
+    }
+    return p + bytes;
+}
+
+void mp_writer::header (unsigned char fix, unsigned char c16, unsigned char c32,
+                        size_t fixmax, size_t n)
+{
+    char *p = buf_.reserve (5);
+    if (n <= fixmax) {
+        *p = (char) (fix | n);
+        buf_.commit (1);
+    } else if (n <= 0xffff) {
+        *p = (char) c16;
+        put_be (p + 1, n, 2);
+        buf_.commit (3);
+    } else {
+        *p = (char) c32;
+        put_be (p + 1, n, 4);
+        buf_.commit (5);
+    }
+}
+
+void mp_writer::begin_array (size_t n)
+{
+    header (0x90, 0xdc, 0xdd, 15, n);
+}
+
+void mp_writer::begin_object (size_t n)
+{
+    header (0x80, 0xde, 0xdf, 15, n);
+}
+
+void mp_writer::uint64 (uint64_t n, bool)
+{
+    char *p = buf_.reserve (9);
+    if (n < 0x80) {
+        *p = (char) n;
+        buf_.commit (1);
+    } else if (n <= 0xff) {
+        *p = (char) 0xcc;
+        put_be (p + 1, n, 1);
+        buf_.commit (2);
+    } else if (n <= 0xffff) {
+        *p = (char) 0xcd;
+        put_be (p + 1, n, 2);
+        buf_.commit (3);
+    } else if (n <= 0xffffffffULL) {
+        *p = (char) 0xce;
+        put_be (p + 1, n, 4);
+        buf_.commit (5);
+    } else {
+        *p = (char) 0xcf;
+        put_be (p + 1, n, 8);
+        buf_.commit (9);
+    }
+}
+
+void mp_writer::int64 (int64_t n, bool)
+{
+    if (n >= 0) {
+        uint64 (n);
+        return;
+    }
+
+    char *p = buf_.reserve (9);
+    if (n >= -32) {
+        *p = (char) n;
+        buf_.commit (1);
+    } else if (n >= -128) {
+        *p = (char) 0xd0;
+        put_be (p + 1, n, 1);
+        buf_.commit (2);
+    } else if (n >= -32768) {
+        *p = (char) 0xd1;
+        put_be (p + 1, n, 2);
+        buf_.commit (3);
+    } else if (n >= -2147483647LL - 1) {
+        *p = (char) 0xd2;
+        put_be (p + 1, n, 4);
+        buf_.commit (5);
+    } else {
+        *p = (char) 0xd3;
+        put_be (p + 1, n, 8);
+        buf_.commit (9);
+    }
+}
+
+void mp_writer::float64 (double d)
+{
+    uint64_t n;
+    memcpy (&n, &d, sizeof (n));
+    char *p = buf_.reserve (9);
+    *p = (char) 0xcb;
+    put_be (p + 1, n, 8);
+    buf_.commit (9);
+}
+
+void mp_writer::str (const char *s, size_t len)
+{
+    char *p = buf_.reserve (5);
+    if (len < 32) {
+        *p = (char) (0xa0 | len);
+        buf_.commit (1);
+    } else if (len <= 0xff) {
+        *p = (char) 0xd9;
+        put_be (p + 1, len, 1);
+        buf_.commit (2);
+    } else if (len <= 0xffff) {
+        *p = (char) 0xda;
+        put_be (p + 1, len, 2);
+        buf_.commit (3);
+    } else {
+        *p = (char) 0xdb;
+        put_be (p + 1, len, 4);
+        buf_.commit (5);
+    }
+    buf_.append (s, len);
+}
+
+void mp_writer::bytes (const unsigned char *s, size_t len)
+{
+    char *p = buf_.reserve (5);
+    if (len <= 0xff) {
+        *p = (char) 0xc4;
+        put_be (p + 1, len, 1);
+        buf_.commit (2);
+    } else if (len <= 0xffff) {
+        *p = (char) 0xc5;
+        put_be (p + 1, len, 2);
+        buf_.commit (3);
+    } else {
+        *p = (char) 0xc6;
+        put_be (p + 1, len, 4);
+        buf_.commit (5);
+    }
+    buf_.append (s, len);
+}
+
+void mp_writer::time (const MYSQL_TIME &t)
+{
+    char *p = buf_.reserve (20);
+    *p = (char) (0xa0 | 19);
+    size_t len = json_writer::format_time (p + 1, t);
+    assert (len == 19);
+    buf_.commit (len + 1);
+}
+
+void mp_writer::column (const MYSQL_BIND &bd)
+{
+    if (bd.is_null && *bd.is_null) {
+        null ();
+        return;
+    }
+
+    const void *buf = bd.buffer;
+    size_t len = bd.length ? *bd.length : 0;
+    switch (bd.buffer_type) {
+    case MYSQL_TYPE_NULL:
+        null ();
+        break;
+    case MYSQL_TYPE_LONGLONG:
+        if (bd.is_unsigned)
+            uint64 (*(const uint64_t *) buf);
+        else
+            int64 (*(const int64_t *) buf);
+        break;
+    case MYSQL_TYPE_DOUBLE:
+        float64 (*(const double *) buf);
+        break;
+    case MYSQL_TYPE_STRING:
+        str ((const char *) buf, len);
+        break;
+    case MYSQL_TYPE_BLOB:
+        bytes ((const unsigned char *) buf, len);
+        break;
+    case MYSQL_TYPE_TIMESTAMP:
+        time (*(const MYSQL_TIME *) buf);
+        break;
+    default:
+        assert (0);
+        null ();
+    }
+}
@@ -0,0 +1,56 @@
+/// mp_writer.hpp -- msgpack response encoder decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-17
+///
+
+#ifndef INCLUDED_MP_WRITER_HPP
+#define INCLUDED_MP_WRITER_HPP
+
+#include "res_buf.hpp"
+
+#include <mysql/mysql.h>
+
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+
+// the msgpack counterpart of json_writer, with the same interface
+// containers are sized up front, and values are typed natively: integers go
+// as integers, and binaries as raw bytes
+class mp_writer
+{
+public:
+    explicit mp_writer (res_buf &buf) : buf_ (buf) {}
+
+public:
+    void begin_array (size_t n);
+    void end_array () {}
+    void begin_object (size_t n);
+    void end_object () {}
+    void key (const char *k) {str (k, strlen (k));}
+    void key (const char *k, size_t len) {str (k, len);}
+
+    void null () {buf_.put ((char) 0xc0);}
+    void boolean (bool b) {buf_.put ((char) (b ? 0xc3 : 0xc2));}
+    void int64 (int64_t n, bool quoted = false);
+    void uint64 (uint64_t n, bool quoted = false);
+    void float64 (double d);
+    void str (const char *s, size_t len);
+    void str (const std::string &s) {str (s.data (), s.size ());}
+    void bytes (const unsigned char *p, size_t len);
+    // timestamps go as strings, just like in json
+    void time (const MYSQL_TIME &t);
+    void column (const MYSQL_BIND &bd);
+    void raw (const char *p, size_t len) {buf_.append (p, len);}
+
+private:
+    void header (unsigned char fix, unsigned char c16, unsigned char c32,
+                 size_t fixmax, size_t n);
+
+private:
+    res_buf &buf_;
+};
+
+#endif // INCLUDED_MP_WRITER_HPP
@@ -0,0 +1,105 @@
+/// mpmc_queue.hpp -- bounded lock free multi producer multi consumer queue
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-19
+///
+
+#ifndef INCLUDED_MPMC_QUEUE_HPP
+#define INCLUDED_MPMC_QUEUE_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+// dmitry vyukov's bounded mpmc queue
+// every cell carries a sequence number, telling whether it's ready to be
+// pushed into or popped from for the current lap, so producers and consumers
+// only contend on their own position counters, each with a single cas
+// an element is visible to consumers in the order the pushes began, so with
+// concurrent producers a pop may fail while a later push has completed
+template <typename T>
+class mpmc_queue
+{
+public:
+    // size has to be a power of 2
+    explicit mpmc_queue (size_t size)
+        : cells_ (size), mask_ (size - 1), push_pos_ (0), pop_pos_ (0)
+        {
+            if (size < 2 || (size & mask_))
+                throw std::invalid_argument ("bad queue size");
+            for (size_t i = 0; i < size; ++i)
+                cells_[i].seq = i;
+        }
+
+public:
+    // returns false if the queue is full
+    bool push (const T &v)
+        {
+            cell *c;
+            size_t pos = push_pos_;
+            while (true) {
+                c = &cells_[pos & mask_];
+                size_t seq = __sync_fetch_and_add (&c->seq, 0);
+                long diff = (long) seq - (long) pos;
+                if (!diff) {
+                    if (__sync_bool_compare_and_swap (&push_pos_, pos, pos + 1))
+                        break;
+                    pos = push_pos_;
+                } else if (diff < 0)
+                    return false;
+                else
+                    pos = push_pos_;
+            }
+            c->val = v;
+            // publishes the value
+            __sync_synchronize ();
+            c->seq = pos + 1;
+            return true;
+        }
+    // returns false if the queue is empty
+    bool pop (T &v)
+        {
+            cell *c;
+            size_t pos = pop_pos_;
+            while (true) {
+                c = &cells_[pos & mask_];
+                size_t seq = __sync_fetch_and_add (&c->seq, 0);
+                long diff = (long) seq - (long) (pos + 1);
+                if (!diff) {
+                    if (__sync_bool_compare_and_swap (&pop_pos_, pos, pos + 1))
+                        break;
+                    pos = pop_pos_;
+                } else if (diff < 0)
+                    return false;
+                else
+                    pos = pop_pos_;
+            }
+            v = c->val;
+            __sync_synchronize ();
+            c->seq = pos + mask_ + 1;
+            return true;
+        }
+
+private:
+    struct cell
+    {
+        volatile size_t seq;
+        T val;
+    };
+
+private:
+    mpmc_queue (const mpmc_queue &);
+    mpmc_queue &operator = (const mpmc_queue &);
+
+private:
+    std::vector<cell> cells_;
+    const size_t mask_;
+    // on separate cache lines, so producers and consumers don't fight
+    char pad0_[64];
+    volatile size_t push_pos_;
+    char pad1_[64];
+    volatile size_t pop_pos_;
+    char pad2_[64];
+};
+
+#endif // INCLUDED_MPMC_QUEUE_HPP
@@ -0,0 +1,42 @@
+/// mysql_call.hpp -- calls to the mysql client yielding instead of blocking
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-22
+///
+
+#ifndef INCLUDED_MYSQL_CALL_HPP
+#define INCLUDED_MYSQL_CALL_HPP
+
+#include "fiber_loop.hpp"
+
+#include <mysql/mysql.h>
+
+// waits on the fiber for what the non-blocking client asks for, and returns
+// what's ready, in the terms of the client
+int wait_mysql (MYSQL *conn, int status);
+
+// closes the statement, and the connection, which both talk to the server
+void close_stmt (MYSQL *conn, MYSQL_STMT *ps);
+void close_mysql (MYSQL *conn);
+
+// on a fiber, the call is split into its _start and _cont halves, and the
+// fiber yields to the others whenever the client would block, which needs
+// the connection to have been made non-blocking before connecting
+// everywhere else, it's the plain blocking call
+// h is the handle the call is made on, and conn the connection it belongs to
+#ifdef HAVE_MYSQL_NONBLOCK
+#define MYSQL_CALL(ret, fn, conn, h, ...)                               \
+    do {                                                                \
+        if (!fiber_loop::current ()) {                                  \
+            ret = fn (h, ##__VA_ARGS__);                                \
+            break;                                                      \
+        }                                                               \
+        int status_ = fn##_start (&ret, h, ##__VA_ARGS__);              \
+        while (status_)                                                 \
+            status_ = fn##_cont (&ret, h, wait_mysql (conn, status_));  \
+    } while (0)
+#else
+#define MYSQL_CALL(ret, fn, conn, h, ...) (ret = fn (h, ##__VA_ARGS__))
+#endif
+
+#endif // INCLUDED_MYSQL_CALL_HPP
@@ -4,33 +4,97 @@
 /// Created: 2011-08-03
 ///
 
+#include "json_writer.hpp"
+#include "mp_writer.hpp"
+#include "mysql_call.hpp"
 #include "mysql_conn.hpp"
+#include "res_buf.hpp"
 
 #include <mysql/errmsg.h>
 #include <mysql/mysqld_error.h>
 
-#include <boost/lexical_cast.hpp>
+#include <poll.h>
 
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
-#include <iomanip>
-#include <sstream>
 #include <vector>
 
 #include <iostream>
 
 using namespace std;
-using namespace boost;
+
+#ifdef HAVE_MYSQL_NONBLOCK
+int wait_mysql (MYSQL *conn, int status)
+{
+    short events = 0;
+    if (status & MYSQL_WAIT_READ)
+        events |= POLLIN;
+    if (status & MYSQL_WAIT_WRITE)
+        events |= POLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT)
+        events |= POLLPRI;
+    int timeout = -1;
+    if (status & MYSQL_WAIT_TIMEOUT)
+        timeout = mysql_get_timeout_value_ms (conn);
+
+    short ready = fiber_loop::poll (mysql_get_socket (conn), events, timeout);
+    if (!ready)
+        return MYSQL_WAIT_TIMEOUT;
+    // errors are left for the client to find when it reads
+    int ret = 0;
+    if (ready & (POLLIN | POLLERR | POLLHUP))
+        ret |= MYSQL_WAIT_READ;
+    if (ready & POLLOUT)
+        ret |= MYSQL_WAIT_WRITE;
+    if (ready & POLLPRI)
+        ret |= MYSQL_WAIT_EXCEPT;
+    return ret;
+}
+#endif
+
+void close_stmt (MYSQL *conn, MYSQL_STMT *ps)
+{
+#ifdef HAVE_MYSQL_NONBLOCK
+    if (fiber_loop::current ()) {
+        my_bool ret;
+        int status = mysql_stmt_close_start (&ret, ps);
+        while (status)
+            status = mysql_stmt_close_cont (&ret, ps,
+                                            wait_mysql (conn, status));
+        return;
+    }
+#endif
+    mysql_stmt_close (ps);
+}
+
+void close_mysql (MYSQL *conn)
+{
+#ifdef HAVE_MYSQL_NONBLOCK
+    if (fiber_loop::current ()) {
+        int status = mysql_close_start (conn);
+        while (status)
+            status = mysql_close_cont (conn, wait_mysql (conn, status));
+        return;
+    }
+#endif
+    mysql_close (conn);
+}
 
 void mysql_conn::close ()
 {
     if (conn_) {
-        tr1::unordered_map<string, MYSQL_STMT *>::iterator it;
-        for (it = stmts_.begin (); it != stmts_.end (); ++it)
-            mysql_stmt_close (it->second);
+        for (size_t i = 0; i < stmts_.size (); ++i) {
+            if (!stmts_[i].ps)
+                continue;
+            // the binds go first, like in unprepare
+            stmts_[i].binds.reset ();
+            close_stmt (conn_, stmts_[i].ps);
+        }
         stmts_.clear ();
-        mysql_close (conn_);
+        lru_.clear ();
+        lru_size_ = 0;
+        close_mysql (conn_);
         conn_ = 0;
     }
 }
@@ -40,7 +104,11 @@ void mysql_conn::rollback ()
     if (!conn_)
         return;
 
-    if (mysql_rollback (conn_) || mysql_autocommit (conn_, 1))
+    my_bool ret;
+    MYSQL_CALL (ret, mysql_rollback, conn_, conn_);
+    if (!ret)
+        MYSQL_CALL (ret, mysql_autocommit, conn_, conn_, 1);
+    if (ret)
         close ();
 }
 
@@ -85,200 +153,40 @@ static void checked_call (my_bool ret, MYSQL_STMT *ps)
         throw_db_err (mysql_stmt_errno (ps), mysql_stmt_error (ps));
 }
 
-static bind_type parse_type (const string &s)
-{
-    if (s == "long")
-        return integer;
-    else if (s == "unsigned")
-        return unsigned_int;
-    else if (s == "timestamp")
-        return timestamp;
-    else
-        throw coded_error (bad_arg, "unrecognized parameter type");
-}
-
-static bind_type param_type (struct json_object *param)
-{
-    switch (json_object_get_type (param)) {
-    case json_type_null:
-        return null;
-    case json_type_int:
-        return integer;
-    case json_type_double:
-        return floating_point;
-    case json_type_array:
-        if (json_object_array_length (param) != 2)
-            return binary;
-        if (json_object_is_type (json_object_array_get_idx (param, 0),
-                                 json_type_string)
-            && json_object_is_type (json_object_array_get_idx (param, 1),
-                                    json_type_string)) {
-            return parse_type (json_object_get_string (
-                                   json_object_array_get_idx (param, 0)));
-        } else
-            return binary;
-    case json_type_string:
-        return text;
-    default:
-        throw coded_error (bad_arg, "unsupported parameter type");
-    }
-}
-
-static unsigned parse_bidigit (const char *s)
-{
-    assert (isdigit (s[0]) && isdigit (s[1]));
-    return (s[0] - '0') * 10 + s[1] - '0';
-}
-
-static MYSQL_TIME *parse_time (const char *s)
-{
-    static const char format[] = "0000-00-00T00:00:00";
-    if (strlen (s) != sizeof (format) - 1
-        || (s[4] != format[4] && s[7] != format[7] && s[10] != format[10]
-            && s[13] != format[13] && s[16] != format[16]))
-        throw coded_error (bad_arg, "bad parameter value");
-    unsigned year, month, day, hour, min, sec;
-    year = parse_bidigit (s) * 100 + parse_bidigit (&s[2]);
-    month = parse_bidigit (&s[5]);
-    day = parse_bidigit (&s[5]);
-    hour = parse_bidigit (&s[5]);
-    min = parse_bidigit (&s[5]);
-    sec = parse_bidigit (&s[5]);
-    MYSQL_TIME *time = (MYSQL_TIME *) calloc (1, sizeof (*time));
-    time->year = year;
-    time->month = month;
-    time->day = day;
-    time->hour = hour;
-    time->minute = min;
-    time->second = sec;
-    return time;
-}
-
-static void *param_value (struct json_object *param, bind_type type,
-                          unsigned long *len = 0)
-{
-    switch (json_object_get_type (param)) {
-    case json_type_null:
-        return 0;
-    case json_type_int:
-        if (true) {
-            int64_t *ret = (int64_t *) malloc (8);
-            *ret = json_object_get_int (param);
-            return ret;
-        }
-    case json_type_double:
-        if (true) {
-            double *ret = (double *) malloc (sizeof (double));
-            *ret = json_object_get_double (param);
-            return ret;
-        }
-    case json_type_array:
-        if (true) {
-            size_t l = json_object_array_length (param);
-            if (type == binary) {
-                for (size_t i = 0; i < l; ++i) {
-                    if (!json_object_is_type (
-                            json_object_array_get_idx (param, i),
-                            json_type_int)) {
-                        throw coded_error (bad_arg,
-                                           "unrecognized parameter type");
-                    }
-                }
-                unsigned char *buf = (unsigned char *) malloc (l);
-                for (size_t i = 0; i < l; ++i) {
-                    buf[i] = json_object_get_int (
-                        json_object_array_get_idx (param, i));
-                }
-                if (len)
-                    *len = l;
-                return buf;
-            } else {
-                const char *s = json_object_get_string (
-                    json_object_array_get_idx (param, 1));
-                if (!*s)
-                    throw coded_error (bad_arg, "bad parameter value");
-                switch (type) {
-                case integer:
-                    if (true) {
-                        char *p;
-                        int64_t n = strtoll (s, &p, 0);
-                        while (*p && isspace (*p))
-                            ++p;
-                        if (*p)
-                            throw coded_error (bad_arg, "bad parameter value");
-                        int64_t *ret = (int64_t *) malloc (8);
-                        *ret = n;
-                        return ret;
-                    }
-                case unsigned_int:
-                    if (true) {
-                        char *p;
-                        uint64_t n = strtoull (s, &p, 0);
-                        while (*p && isspace (*p))
-                            ++p;
-                        if (*p)
-                            throw coded_error (bad_arg, "bad parameter value");
-                        uint64_t *ret = (uint64_t *) malloc (8);
-                        *ret = n;
-                        return ret;
-                    }
-                case timestamp:
-                    return parse_time (s);
-                default:
-                    assert (0);
-                    throw coded_error (bad_arg, "unsupported parameter type");
-                }
-            }
-        }
-    case json_type_string:
-        if (true) {
-            char *s = strdup (json_object_get_string (param));
-            if (len)
-                *len = strlen (s);
-            return s;
-        }
-    default:
-        assert (0);
-        throw coded_error (bad_arg, "unsupported parameter type");
-    }
-}
-
-static void bind_param (MYSQL_BIND *bd, struct json_object *param)
+// the values are not copied, the binds point into the params
+static void bind_param (MYSQL_BIND *bd, sql_param &param)
 {
     memset (bd, 0, sizeof (*bd));
-    bind_type type = param_type (param);
-    switch (type) {
+    switch (param.type) {
     case null:
         bd->buffer_type = MYSQL_TYPE_NULL;
         break;
     case integer: case unsigned_int:
         bd->buffer_type = MYSQL_TYPE_LONGLONG;
-        bd->buffer = malloc (8);
-        bd->buffer = param_value (param, type);
+        bd->buffer = &param.i;
         bd->buffer_length = 8;
-        bd->is_unsigned = type == unsigned_int;
+        bd->is_unsigned = param.type == unsigned_int;
         break;
     case floating_point:
         bd->buffer_type = MYSQL_TYPE_DOUBLE;
-        bd->buffer = malloc (sizeof (double));
-        bd->buffer = param_value (param, type);
+        bd->buffer = &param.d;
         bd->buffer_length = sizeof (double);
         break;
     case text:
         bd->buffer_type = MYSQL_TYPE_STRING;
-        bd->buffer = param_value (param, type, &bd->buffer_length);
-        bd->length = new unsigned long;
-        *bd->length = bd->buffer_length;
+        bd->buffer = (void *) param.str;
+        bd->buffer_length = param.len;
+        bd->length = &param.len;
         break;
     case binary:
         bd->buffer_type = MYSQL_TYPE_BLOB;
-        bd->buffer = param_value (param, type, &bd->buffer_length);
-        bd->length = new unsigned long;
-        *bd->length = bd->buffer_length;
+        bd->buffer = (void *) param.str;
+        bd->buffer_length = param.len;
+        bd->length = &param.len;
         break;
     case timestamp:
         bd->buffer_type = MYSQL_TYPE_TIMESTAMP;
-        bd->buffer = param_value (param, type);
+        bd->buffer = &param.t;
         bd->buffer_length = sizeof (MYSQL_TIME);
         break;
     default:
@@ -287,45 +195,39 @@ static void bind_param (MYSQL_BIND *bd, struct json_object *param)
     }
 }
 
-static void bind_res (MYSQL_BIND *bd, bind_type type)
+// the text and binary columns are given no buffers, they get theirs when
+// their first values are fetched
+static void bind_res (MYSQL_BIND *bd, bind_type type, res_column &col)
 {
     memset (bd, 0, sizeof (*bd));
+    bd->is_null = &col.is_null;
     switch (type) {
     case null:
         bd->buffer_type = MYSQL_TYPE_NULL;
         break;
     case integer: case unsigned_int:
         bd->buffer_type = MYSQL_TYPE_LONGLONG;
-        bd->buffer = new int64_t;
+        bd->buffer = &col.i;
         bd->buffer_length = 8;
         bd->is_unsigned = type == unsigned_int;
-        bd->is_null = new my_bool;
         break;
     case floating_point:
         bd->buffer_type = MYSQL_TYPE_DOUBLE;
-        bd->buffer = new double;
+        bd->buffer = &col.d;
         bd->buffer_length = sizeof (double);
-        bd->is_null = new my_bool;
         break;
     case text:
         bd->buffer_type = MYSQL_TYPE_STRING;
-        bd->buffer = 0;
-        bd->buffer_length = 0;
-        bd->length = new unsigned long;
-        bd->is_null = new my_bool;
+        bd->length = &col.length;
         break;
     case binary:
         bd->buffer_type = MYSQL_TYPE_BLOB;
-        bd->buffer = 0;
-        bd->buffer_length = 0;
-        bd->length = new unsigned long;
-        bd->is_null = new my_bool;
+        bd->length = &col.length;
         break;
     case timestamp:
         bd->buffer_type = MYSQL_TYPE_TIMESTAMP;
-        bd->buffer = new MYSQL_TIME;
+        bd->buffer = &col.t;
         bd->buffer_length = sizeof (MYSQL_TIME);
-        bd->is_null = new my_bool;
         break;
     default:
         assert (0);
@@ -333,76 +235,315 @@ static void bind_res (MYSQL_BIND *bd, bind_type type)
     }
 }
 
-static void print_json_str (ostream &rs, const char *s, size_t len)
+stmt_binds::stmt_binds (MYSQL_STMT *ps, const mysql_stmt &stmt)
+    : params (mysql_stmt_param_count (ps)), results (stmt.results.size ()),
+      cols (stmt.results.size ()), meta (0)
 {
-    struct json_object *o = json_object_new_string_len (s, len);
-    if (!o)
-        throw bad_alloc ();
-    rs << json_object_to_json_string (o);
-    json_object_put (o);
+    for (size_t i = 0; i < results.size (); ++i)
+        bind_res (&results[i], stmt.results[i], cols[i]);
+    if (results.empty ())
+        return;
+
+    my_bool update = 1;
+    if (mysql_stmt_attr_set (ps, STMT_ATTR_UPDATE_MAX_LENGTH, &update)
+        || !(meta = mysql_stmt_result_metadata (ps))
+        || mysql_num_fields (meta) != results.size ()) {
+        // fetched the slow way, refetching the values truncated
+        if (meta)
+            mysql_free_result (meta);
+        meta = 0;
+    }
 }
 
-static void gen_row_res (ostream &rs, MYSQL_STMT *ps, vector<MYSQL_BIND> &binds)
+stmt_binds::~stmt_binds ()
 {
+    if (meta)
+        mysql_free_result (meta);
+    for (size_t i = 0; i < results.size (); ++i) {
+        if (results[i].buffer_type == MYSQL_TYPE_STRING
+            || results[i].buffer_type == MYSQL_TYPE_BLOB)
+            free (results[i].buffer);
+    }
+}
+
+// grows the text and binary buffers to fit the longest values of the
+// results stored, so each row is fetched in a single call
+static void fit_buffers (vector<MYSQL_BIND> &binds, MYSQL_RES *meta)
+{
+    if (!meta)
+        return;
     for (size_t i = 0; i < binds.size (); ++i) {
-        if (i)
-            rs << ",";
-        if (*binds[i].is_null) {
-            rs << "null";
+        if (binds[i].buffer_type != MYSQL_TYPE_STRING
+            && binds[i].buffer_type != MYSQL_TYPE_BLOB)
+            continue;
+        size_t len = mysql_fetch_field_direct (meta, i)->max_length;
+        if (len <= binds[i].buffer_length)
             continue;
+        void *buf = realloc (binds[i].buffer, len);
+        if (!buf)
+            throw bad_alloc ();
+        binds[i].buffer = buf;
+        binds[i].buffer_length = len;
+    }
+}
+
+// the buffers kept for the next results are no larger than this, so a
+// single large result doesn't hold its memory for as long as the statement
+// stays prepared
+static const size_t max_kept_buffer = 64 * 1024;
+
+static void trim_buffers (vector<MYSQL_BIND> &binds)
+{
+    for (size_t i = 0; i < binds.size (); ++i) {
+        if (binds[i].buffer_length > max_kept_buffer) {
+            free (binds[i].buffer);
+            binds[i].buffer = 0;
+            binds[i].buffer_length = 0;
         }
+    }
+}
 
-        void *&buf = binds[i].buffer;
-        size_t len = binds[i].length ? *binds[i].length : 0;
+// refetches the columns truncated for lack of room in the buffers, into
+// buffers grown to fit
+// returns true if any buffer has grown, and the results must be bound again
+static bool fetch_truncated (MYSQL_STMT *ps, vector<MYSQL_BIND> &binds)
+{
+    bool grown = false;
+    for (size_t i = 0; i < binds.size (); ++i) {
+        if (*binds[i].is_null || !binds[i].length)
+            continue;
+
+        size_t len = *binds[i].length;
         if (len > binds[i].buffer_length) {
-            if (binds[i].buffer) {
-                assert (binds[i].buffer_type == MYSQL_TYPE_STRING
-                        || binds[i].buffer_type == MYSQL_TYPE_BLOB);
-            }
-            buf = realloc (buf, len);
+            assert (binds[i].buffer_type == MYSQL_TYPE_STRING
+                    || binds[i].buffer_type == MYSQL_TYPE_BLOB);
+            void *buf = realloc (binds[i].buffer, len);
+            if (!buf)
+                throw bad_alloc ();
+            binds[i].buffer = buf;
             binds[i].buffer_length = len;
+            grown = true;
             int ret = mysql_stmt_fetch_column (ps, &binds[i], i, 0);
             assert (ret != MYSQL_DATA_TRUNCATED && ret != MYSQL_NO_DATA);
             checked_call (ret, ps);
         }
-        switch (binds[i].buffer_type) {
-        case MYSQL_TYPE_NULL:
-            rs << "null";
-            break;
-        case MYSQL_TYPE_LONGLONG:
-            if (binds[i].is_unsigned)
-                rs << "\"" << *(uint64_t *) buf << "\"";
-            else
-                rs << "\"" << *(int64_t *) buf << "\"";
-            break;
-        case MYSQL_TYPE_DOUBLE:
-            rs << (double *) buf;
-            break;
-        case MYSQL_TYPE_STRING:
-            print_json_str (rs, (char *) buf, len);
-            break;
-        case MYSQL_TYPE_BLOB:
-            rs << "[";
-            for (size_t j = 0; j < len; ++j) {
-                if (j)
-                    rs << ",";
-                rs << ((unsigned char *) buf)[j];
-            }
-            rs << "]";
+    }
+    return grown;
+}
+
+static void free_blob (void *data, void *)
+{
+    free (data);
+}
+
+// hands the fetched blob over to a frame, instead of copying it into the
+// results, and leaves a reference to the frame in its place
+// the bind gets a fresh buffer when the next blob is fetched
+template <typename Writer>
+static void blob_frame (Writer &w, MYSQL_BIND &bd, cppzmq::packet_t &blobs)
+{
+    w.begin_object (1);
+    w.key ("blob");
+    w.uint64 (blobs.size ());
+    w.end_object ();
+
+    size_t len = *bd.length;
+    if (!len)
+        blobs.push_back (cppzmq::message_t ());
+    else {
+        blobs.push_back (cppzmq::message_t (bd.buffer, len, free_blob));
+        bd.buffer = 0;
+        bd.buffer_length = 0;
+    }
+}
+
+// blobs go as frames if given somewhere to put them
+// returns true if any blob is handed over, and the results must be bound
+// again
+template <typename Writer>
+static bool gen_row (Writer &w, vector<MYSQL_BIND> &binds,
+                     cppzmq::packet_t *blobs)
+{
+    bool given = false;
+    w.begin_array (binds.size ());
+    for (size_t i = 0; i < binds.size (); ++i) {
+        if (blobs && binds[i].buffer_type == MYSQL_TYPE_BLOB
+            && !*binds[i].is_null) {
+            void *buf = binds[i].buffer;
+            blob_frame (w, binds[i], *blobs);
+            given = given || buf != binds[i].buffer;
+        } else
+            w.column (binds[i]);
+    }
+    w.end_array ();
+    return given;
+}
+
+// the buffers are sized to the longest values beforehand, if the fields of
+// the results are known, and are only grown, by refetching the values
+// truncated, if they aren't
+// the buffers grown, or handed over to frames, are bound again before the
+// next row, so the rows after it are fetched right into them
+template <typename Writer>
+static void gen_results (Writer &w, MYSQL_STMT *ps, vector<MYSQL_BIND> &binds,
+                         MYSQL_RES *meta, cppzmq::packet_t *blobs)
+{
+    size_t rows = mysql_stmt_affected_rows (ps);
+    w.begin_array (rows);
+    for (size_t r = 0; r < rows; ++r) {
+        bool rebind = false;
+        switch (mysql_stmt_fetch (ps)) {
+        case 0: case MYSQL_DATA_TRUNCATED:
+            rebind = fetch_truncated (ps, binds);
             break;
-        case MYSQL_TYPE_TIMESTAMP:
-            if (true) {
-                MYSQL_TIME *t = (MYSQL_TIME *) buf;
-                rs << "\"" << setw (4) << setfill ('0') << t->year
-                   << "-" << setw (2) << t->month << "-" << t->day
-                   << "T" << t->hour << ":" << t->minute << ":" << t->second
-                   << "\"";
-            }
+        case 1:
+            checked_call (true, ps);
             break;
-        default:
+        case MYSQL_NO_DATA: default:
             assert (0);
         }
+        rebind = gen_row (w, binds, blobs) || rebind;
+        if (rebind && r + 1 < rows) {
+            fit_buffers (binds, meta);
+            checked_call (mysql_stmt_bind_result (ps, &binds[0]), ps);
+        }
     }
+    w.end_array ();
+}
+
+// arrays not counted until they're done, as the rows of a chunk, which
+// the chunk is filled with until full, so msgpack has the size of the array
+// put in front of them afterwards, while json needs no size at all
+// only for arrays written at the top of the buffer
+static void begin_unsized (json_writer &w) {w.begin_array ();}
+static void begin_unsized (mp_writer &) {}
+static void end_unsized (json_writer &w, res_buf &, size_t) {w.end_array ();}
+
+static void end_unsized (mp_writer &, res_buf &rb, size_t n)
+{
+    char stack[8];
+    res_buf head (stack, sizeof (stack));
+    mp_writer (head).begin_array (n);
+    if (rb.prepend (head.data (), head.size ()))
+        return;
+    // nothing in the array, or no room left in front of it
+    head.append (rb.data (), rb.size ());
+    rb = move (head);
+}
+
+// a streamed result is encoded in chunks of about this size
+static const size_t chunk_size = 64 * 1024;
+
+// fetches the rows one by one from the server, without storing them first,
+// and sends them in chunks to the sink as they fill up
+// returns the last chunk, which is sent as the response, and tells the
+// caller there are no more
+template <typename Writer>
+static res_buf stream_results (MYSQL *conn, MYSQL_STMT *ps,
+                               vector<MYSQL_BIND> &binds, sql_stmt &stmt,
+                               cppzmq::packet_t &blobs)
+{
+    cppzmq::packet_t *bp = stmt.blob_frames ? &blobs : 0;
+    while (true) {
+        res_buf rb;
+        Writer w (rb);
+        begin_unsized (w);
+        size_t rows = 0;
+        bool done = false;
+        while (rb.size () < chunk_size) {
+            int ret;
+            MYSQL_CALL (ret, mysql_stmt_fetch, conn, ps);
+            if (ret == MYSQL_NO_DATA) {
+                done = true;
+                break;
+            } else if (ret == 1)
+                checked_call (true, ps);
+            bool rebind = fetch_truncated (ps, binds);
+            rebind = gen_row (w, binds, bp) || rebind;
+            ++rows;
+            if (rebind)
+                checked_call (mysql_stmt_bind_result (ps, &binds[0]), ps);
+        }
+        end_unsized (w, rb, rows);
+        if (done)
+            return rb;
+
+        sql_res chunk (cppzmq::packet_t (stmt.addr), stmt.enc, stmt.txn_seq,
+                       success);
+        chunk.id = stmt.id;
+        chunk.res = move (rb);
+        chunk.blobs = move (blobs);
+        chunk.more = true;
+        stmt.sink->send (move (chunk));
+    }
+}
+
+// a row of the name and the id of each statement
+template <typename Writer>
+static void gen_ids (Writer &w, const stmt_list &ids)
+{
+    size_t rows = 0;
+    for (size_t i = 0; i < ids.size (); ++i)
+        rows += ids[i] ? 1 : 0;
+    w.begin_array (rows);
+    for (size_t i = 0; i < ids.size (); ++i) {
+        if (!ids[i])
+            continue;
+        w.begin_array (2);
+        w.str (ids[i]->name);
+        w.uint64 (i);
+        w.end_array ();
+    }
+    w.end_array ();
+}
+
+template <typename Writer>
+static void gen_insert_id (Writer &w, uint64_t id)
+{
+    w.begin_array (1);
+    w.begin_array (1);
+    w.uint64 (id);
+    w.end_array ();
+    w.end_array ();
+}
+
+// an entry of a batch failing
+template <typename Writer>
+static void gen_error (Writer &w, error err, const string &msg)
+{
+    w.begin_object (2);
+    w.key ("code");
+    w.int64 (err);
+    w.key ("message");
+    w.str (msg);
+    w.end_object ();
+}
+
+// a query has results, and so has a statement asked for the insert id
+static bool has_output (const mysql_stmt &stmt)
+{
+    return stmt.is_query || stmt.insert_id;
+}
+
+// the insert id, or the results stored, into the buffers left from the
+// last time, which may have changed since they were last bound
+template <typename Writer>
+static void gen_output (Writer &w, MYSQL *conn, MYSQL_STMT *ps,
+                        stmt_binds &b, const mysql_stmt &stmt,
+                        cppzmq::packet_t *blobs)
+{
+    if (stmt.insert_id) {
+        gen_insert_id (w, mysql_insert_id (conn));
+        return;
+    }
+
+    vector<MYSQL_BIND> &binds = b.results;
+    if (!binds.empty ()) {
+        fit_buffers (binds, b.meta);
+        checked_call (mysql_stmt_bind_result (ps, &binds[0]), ps);
+    }
+    gen_results (w, ps, binds, b.meta, blobs);
+    trim_buffers (binds);
 }
 
 sql_res mysql_conn::execute (sql_stmt &&stmt)
@@ -425,107 +566,415 @@ void mysql_conn::connect ()
         || mysql_options (conn_, MYSQL_OPT_READ_TIMEOUT, (char *) &timeout_)
         || mysql_options (conn_, MYSQL_OPT_WRITE_TIMEOUT, (char *) &timeout_))
         throw coded_error (db_txn, mysql_error (conn_));
-    if (!mysql_real_connect (conn_, host_.c_str (), user_.c_str (),
-                             password_.c_str (), db_.c_str (), port_, 0,
-                             CLIENT_IGNORE_SIGPIPE))
+#ifdef HAVE_MYSQL_NONBLOCK
+    // talked to from fibers, the connection must never block the thread
+    // it's still usable by the blocking calls, as when warmed up
+    if (nonblock_ && mysql_options (conn_, MYSQL_OPT_NONBLOCK, 0))
+        throw coded_error (db_txn, mysql_error (conn_));
+#endif
+    MYSQL *ret;
+    MYSQL_CALL (ret, mysql_real_connect, conn_, conn_, host_.c_str (),
+                user_.c_str (), password_.c_str (), db_.c_str (), port_, 0,
+                CLIENT_IGNORE_SIGPIPE);
+    if (!ret)
         throw coded_error (db_txn, mysql_error (conn_));
 }
 
-static void clear_binds (vector<MYSQL_BIND> &binds)
+// the binds go first, as the fields of the results belong to the statement
+void mysql_conn::unprepare (prepared &p)
 {
-    for (size_t i = 0; i < binds.size (); ++i) {
-        if (binds[i].buffer)
-            free (binds[i].buffer);
-        if (binds[i].length)
-            delete binds[i].length;
-        if (binds[i].is_null)
-            delete binds[i].is_null;
+    p.binds.reset ();
+    close_stmt (conn_, p.ps);
+    p.ps = 0;
+    p.stmt.reset ();
+    lru_.erase (p.lru);
+    --lru_size_;
+}
+
+// closes the statement least recently run, to make room for another
+// returns false if there's none to close
+bool mysql_conn::evict ()
+{
+    if (lru_.empty ())
+        return false;
+    unprepare (stmts_[lru_.back ()]);
+    ++stats_.evicts;
+    return true;
+}
+
+// the statements reloaded are prepared again when next run, and the
+// statements dropped stay prepared until evicted, or the connection is
+// closed
+// if the server has as many statements prepared as it allows, by this
+// connection and the others, the ones of this connection are closed one by
+// one, until there's room
+mysql_conn::prepared &
+mysql_conn::prepare (const tr1::shared_ptr<mysql_stmt> &stmt)
+{
+    if (stmt->id >= stmts_.size ())
+        stmts_.resize (stmt->id + 1);
+    prepared &p = stmts_[stmt->id];
+    if (p.stmt == stmt) {
+        ++stats_.hits;
+        lru_.splice (lru_.begin (), lru_, p.lru);
+        return p;
+    }
+
+    ++stats_.misses;
+    if (p.ps)
+        unprepare (p);
+    while (stmt_cap_ && lru_size_ >= stmt_cap_)
+        evict ();
+    MYSQL_STMT *ps;
+    while (!(ps = stmt->prepare (conn_))) {
+        if (!evict ())
+            throw coded_error (db_stmt, "too many statements prepared");
     }
-    binds.clear ();
+    try {
+        p.binds.reset (new stmt_binds (ps, *stmt));
+    } catch (...) {
+        close_stmt (conn_, ps);
+        throw;
+    }
+    p.ps = ps;
+    p.stmt = stmt;
+    lru_.push_front (stmt->id);
+    p.lru = lru_.begin ();
+    ++lru_size_;
+    return p;
 }
 
-struct binds_clearer
+// the statements beyond what's kept prepared would only push out the ones
+// prepared before them
+void mysql_conn::warm_up (const stmt_map &stmts)
 {
-    binds_clearer (vector<MYSQL_BIND> &binds) : binds_ (binds) {}
-    ~binds_clearer () {clear_binds (binds_);}
-private:
-    vector<MYSQL_BIND> &binds_;
-};
+    if (!conn_)
+        connect ();
+
+    for (stmt_map::const_iterator it = stmts.begin ();
+         it != stmts.end () && (!stmt_cap_ || lru_size_ < stmt_cap_); ++it)
+        prepare (it->second);
+}
+
+static res_buf results_buf (const sql_stmt &stmt)
+{
+    return stmt.bufs ? res_buf (*stmt.bufs) : res_buf ();
+}
 
 sql_res mysql_conn::real_exec (sql_stmt &&stmt)
 {
+    if (stmt.builtin == sql_stmt::list_ids) {
+        // no need to talk to the server
+        res_buf rb = results_buf (stmt);
+        if (stmt.enc == msgpack_codec) {
+            mp_writer w (rb);
+            gen_ids (w, *stmt.ids);
+        } else {
+            json_writer w (rb);
+            gen_ids (w, *stmt.ids);
+        }
+        return sql_res (move (stmt), move (rb));
+    }
+
     if (!conn_)
         connect ();
 
+    my_bool ret;
     if (stmt.builtin == sql_stmt::begin) {
-        checked_call (mysql_autocommit (conn_, 0), conn_);
+        MYSQL_CALL (ret, mysql_autocommit, conn_, conn_, 0);
+        checked_call (ret, conn_);
         return sql_res (stmt);
     } else if (stmt.builtin == sql_stmt::commit
                || stmt.builtin == sql_stmt::rollback) {
-        typedef my_bool (*txn_ender) (MYSQL *);
-        txn_ender f =
-            stmt.builtin == sql_stmt::commit ? &mysql_commit : &mysql_rollback;
-        checked_call (f (conn_), conn_);
+        if (stmt.builtin == sql_stmt::commit)
+            MYSQL_CALL (ret, mysql_commit, conn_, conn_);
+        else
+            MYSQL_CALL (ret, mysql_rollback, conn_, conn_);
+        checked_call (ret, conn_);
 
         // set auto commit to default: true
-        checked_call (mysql_autocommit (conn_, 1), conn_);
+        MYSQL_CALL (ret, mysql_autocommit, conn_, conn_, 1);
+        checked_call (ret, conn_);
         return sql_res (stmt);
     }
 
-    MYSQL_STMT *ps = 0;
-    if (conn_ && stmts_.find (stmt.stmt->name) != stmts_.end ())
-        ps = stmts_[stmt.stmt->name];
-    else
-        ps = stmts_[stmt.stmt->name] = stmt.stmt->prepare (conn_);
-    size_t pc = mysql_stmt_param_count (ps);
-    if ((pc && !stmt.params)
-        || (pc && pc != (size_t) json_object_array_length (stmt.params)))
-        throw coded_error (bad_arg, "wrong number of params");
+    if (stmt.batch || stmt.bulk)
+        return batch_exec (move (stmt));
+
+    bool stream = stmt.stream && stmt.sink && stmt.stmt->is_query
+        && !stmt.stmt->insert_id;
+    sql_params *sp = stmt.params;
+    prepared &p = run (stmt.stmt, sp ? sp->params.data () : 0,
+                       sp ? sp->params.size () : 0, !stream);
+    if (stream)
+        return stream_exec (move (stmt), p);
+    else if (!has_output (*stmt.stmt))
+        return sql_res (stmt);
 
-    vector<MYSQL_BIND> binds (pc);
-    binds_clearer bc (binds);
+    res_buf rb = results_buf (stmt);
+    cppzmq::packet_t blobs;
+    cppzmq::packet_t *bp = stmt.blob_frames ? &blobs : 0;
+    if (stmt.enc == msgpack_codec) {
+        mp_writer w (rb);
+        gen_output (w, conn_, p.ps, *p.binds, *stmt.stmt, bp);
+    } else {
+        json_writer w (rb);
+        gen_output (w, conn_, p.ps, *p.binds, *stmt.stmt, bp);
+    }
+    return sql_res (move (stmt), move (rb), move (blobs));
+}
 
-    for (size_t i = 0; i < pc; ++i)
-        bind_param (&binds[i], json_object_array_get_idx (stmt.params, i));
+// prepares the statement if not prepared yet, binds the params, and runs it
+// the results are stored, unless they're to be fetched one by one
+mysql_conn::prepared &
+mysql_conn::run (const tr1::shared_ptr<mysql_stmt> &stmt, sql_param *params,
+                 size_t n, bool store)
+{
+    prepared &p = prepare (stmt);
+    MYSQL_STMT *ps = p.ps;
+    vector<MYSQL_BIND> &binds = p.binds->params;
+    size_t pc = binds.size ();
+    if (pc && pc != n)
+        throw coded_error (bad_arg, "wrong number of params");
 
-    checked_call (mysql_stmt_bind_param (ps, &binds[0]), ps);
-    checked_call (mysql_stmt_execute (ps), ps);
+    // bound again for each request, as the binds point into the request
+    if (pc) {
+        for (size_t i = 0; i < pc; ++i)
+            bind_param (&binds[i], params[i]);
+        checked_call (mysql_stmt_bind_param (ps, &binds[0]), ps);
+    }
+    int err;
+    MYSQL_CALL (err, mysql_stmt_execute, conn_, ps);
+    checked_call (err, ps);
+    if (store) {
+        MYSQL_CALL (err, mysql_stmt_store_result, conn_, ps);
+        checked_call (err, ps);
+    }
+    return p;
+}
 
-    clear_binds (binds);
+// a statement of a batch is answered by its code, the message if it fails,
+// and the results if it has any, so a failure spoils no results of the
+// others
+// returns the code, with the message if it fails
+template <typename Writer>
+error mysql_conn::gen_entry (Writer &w, sql_params &area, sql_entry &e,
+                             cppzmq::packet_t *bp, string &msg)
+{
+    error err = e.req.err;
+    msg = e.req.msg;
+    prepared *p = 0;
+    if (!err) {
+        try {
+            p = &run (e.stmt, area.params.data () + e.first, e.count, true);
+        } catch (const coded_error &ex) {
+            err = ex.code ();
+            msg = ex.what ();
+        }
+    }
 
-    checked_call (mysql_stmt_store_result (ps), ps);
+    bool has = !err && has_output (*e.stmt);
+    w.begin_object (1 + !!err + has);
+    w.key ("code");
+    w.int64 (err);
+    if (err) {
+        w.key ("message");
+        w.str (msg);
+    }
+    if (has) {
+        w.key ("results");
+        gen_output (w, conn_, p->ps, *p->binds, *e.stmt, bp);
+    }
+    w.end_object ();
+    if (err == db_txn)
+        close ();
+    return err;
+}
 
-    if (stmt.stmt->insert_id) {
-        uint64_t n = mysql_insert_id (conn_);
-        return sql_res (move (stmt), string ("[[") + lexical_cast<string> (n)
-                        + "]]");
-    } else if (!stmt.stmt->is_query)
-        return sql_res (stmt);
+// the batch is answered by the code of its first failure
+// it stops at the first failure, unless told to go on, and always when the
+// connection is lost
+template <typename Writer>
+error mysql_conn::gen_batch (Writer &w, res_buf &rb, sql_stmt &stmt,
+                             cppzmq::packet_t *bp, string &msg)
+{
+    sql_params &area = *stmt.params;
+    error first = success;
+    string m;
+    size_t n = 0;
+    begin_unsized (w);
+    while (n < area.entries.size ()) {
+        error err = gen_entry (w, area, area.entries[n++], bp, m);
+        if (err && !first) {
+            first = err;
+            msg = m;
+        }
+        if (err == db_txn || (err && stmt.stop_on_error))
+            break;
+    }
+    end_unsized (w, rb, n);
+    return first;
+}
 
-    // query, fetch the results
-    binds.resize (stmt.stmt->results.size ());
-    for (size_t i = 0; i < binds.size (); ++i)
-        bind_res (&binds[i], stmt.stmt->results[i]);
-    checked_call (mysql_stmt_bind_result (ps, &binds[0]), ps);
-    ostringstream rs;
-    rs << "[";
-    size_t rows = mysql_stmt_affected_rows (ps);
-    for (size_t r = 0; r < rows; ++r) {
-        if (r)
-            rs << ",";
-        rs << "[";
-        switch (mysql_stmt_fetch (ps)) {
-        case 0: case MYSQL_DATA_TRUNCATED:
-            gen_row_res (rs, ps, binds);
+// a row of the results for each run, the code, the rows affected, and the
+// insert id, if any, or 0
+// each row is run on its own, as the server tells the rows affected and
+// the insert id of a run of arrays only as a whole, so running in bulk
+// saves decoding the request, and dispatching the rows, and the statement
+// is looked up, and the binds set up, only once for all
+template <typename Writer>
+error mysql_conn::gen_bulk (Writer &w, res_buf &rb, sql_stmt &stmt,
+                            string &msg)
+{
+    sql_params &area = *stmt.params;
+    error first = success;
+    size_t n = 0;
+    begin_unsized (w);
+    while (n < area.entries.size ()) {
+        sql_entry &e = area.entries[n++];
+        error err = e.req.err;
+        string m = e.req.msg;
+        uint64_t affected = 0, id = 0;
+        if (!err) {
+            try {
+                prepared &p = run (stmt.stmt, area.params.data () + e.first,
+                                   e.count, false);
+                affected = mysql_stmt_affected_rows (p.ps);
+                id = mysql_stmt_insert_id (p.ps);
+            } catch (const coded_error &ex) {
+                err = ex.code ();
+                m = ex.what ();
+            }
+        }
+        w.begin_array (3);
+        w.int64 (err);
+        w.uint64 (affected);
+        w.uint64 (id);
+        w.end_array ();
+
+        if (err && !first) {
+            first = err;
+            msg = m;
+        }
+        if (err == db_txn) {
+            close ();
             break;
-        case 1:
-            checked_call (true, ps);
+        } else if (err && stmt.stop_on_error)
             break;
-        case MYSQL_NO_DATA: default:
-            assert (0);
+    }
+    end_unsized (w, rb, n);
+    return first;
+}
+
+// the blobs go inline, as the results of the entries are put together
+// by the caller
+// a failure halfway through the results leaves only the code, and the
+// message
+error mysql_conn::execute (sql_stmt &stmt, sql_entry &e, res_buf &rb,
+                           string &msg)
+{
+    try {
+        if (!conn_)
+            connect ();
+        if (stmt.enc == msgpack_codec) {
+            mp_writer w (rb);
+            return gen_entry (w, *stmt.params, e, 0, msg);
+        } else {
+            json_writer w (rb);
+            return gen_entry (w, *stmt.params, e, 0, msg);
         }
-        rs << "]";
+    } catch (const coded_error &ex) {
+        if (ex.code () == db_txn)
+            close ();
+        msg = ex.what ();
+        rb.clear ();
+        if (stmt.enc == msgpack_codec) {
+            mp_writer w (rb);
+            gen_error (w, ex.code (), msg);
+        } else {
+            json_writer w (rb);
+            gen_error (w, ex.code (), msg);
+        }
+        return ex.code ();
+    }
+}
+
+// an atomic batch is run in a txn of its own, from the first statement to
+// the last, without the caller waiting in between, and the results of the
+// statements run are sent even if the txn is rolled back
+// and so is an atomic bulk run, while one that isn't atomic commits each
+// row as it's run, like the statements run one by one
+sql_res mysql_conn::batch_exec (sql_stmt &&stmt)
+{
+    my_bool ret;
+    if (stmt.atomic) {
+        MYSQL_CALL (ret, mysql_autocommit, conn_, conn_, 0);
+        checked_call (ret, conn_);
+    }
+
+    res_buf rb = results_buf (stmt);
+    cppzmq::packet_t blobs;
+    cppzmq::packet_t *bp = stmt.blob_frames ? &blobs : 0;
+    string msg;
+    error err;
+    try {
+        if (stmt.enc == msgpack_codec) {
+            mp_writer w (rb);
+            err = stmt.bulk ? gen_bulk (w, rb, stmt, msg)
+                : gen_batch (w, rb, stmt, bp, msg);
+        } else {
+            json_writer w (rb);
+            err = stmt.bulk ? gen_bulk (w, rb, stmt, msg)
+                : gen_batch (w, rb, stmt, bp, msg);
+        }
+
+        if (stmt.atomic && !err) {
+            try {
+                MYSQL_CALL (ret, mysql_commit, conn_, conn_);
+                checked_call (ret, conn_);
+                MYSQL_CALL (ret, mysql_autocommit, conn_, conn_, 1);
+                checked_call (ret, conn_);
+            } catch (const coded_error &e) {
+                err = e.code ();
+                msg = e.what ();
+            }
+        }
+    } catch (...) {
+        // the connection never goes back to the pool with autocommit off
+        if (stmt.atomic)
+            rollback ();
+        throw;
+    }
+    // closes the connection if it can't be rolled back, or was lost
+    if (stmt.atomic && err)
+        rollback ();
+
+    sql_res res (move (stmt), move (rb), move (blobs));
+    res.err = err;
+    res.msg = msg;
+    return res;
+}
+
+// the rows left unread are read and thrown away if streaming fails halfway,
+// or the connection is out of sync for whatever is run on it next
+sql_res mysql_conn::stream_exec (sql_stmt &&stmt, prepared &p)
+{
+    MYSQL_STMT *ps = p.ps;
+    vector<MYSQL_BIND> &binds = p.binds->results;
+    checked_call (mysql_stmt_bind_result (ps, &binds[0]), ps);
+    cppzmq::packet_t blobs;
+    res_buf rb;
+    try {
+        if (stmt.enc == msgpack_codec)
+            rb = stream_results<mp_writer> (conn_, ps, binds, stmt, blobs);
+        else
+            rb = stream_results<json_writer> (conn_, ps, binds, stmt, blobs);
+    } catch (...) {
+        my_bool ret;
+        MYSQL_CALL (ret, mysql_stmt_free_result, conn_, ps);
+        trim_buffers (binds);
+        throw;
     }
-    rs << "]";
-    return sql_res (move (stmt), rs.str ());
+    trim_buffers (binds);
+    return sql_res (move (stmt), move (rb), move (blobs));
 }
@@ -7,29 +7,129 @@
 #ifndef INCLUDED_MYSQL_CONN_HPP
 #define INCLUDED_MYSQL_CONN_HPP
 
+#include "mysql_stmt.hpp"
 #include "sql_res.hpp"
 
 #include <mysql/mysql.h>
 
+#include <stdint.h>
+
+#include <list>
 #include <string>
+#include <tr1/memory>
 #include <tr1/unordered_map>
+#include <vector>
+
+// how the prepared statements of a connection have been found
+// counted by the thread using the connection, and read by others only
+// roughly, without locking
+struct stmt_stats
+{
+    stmt_stats () : hits (0), misses (0), evicts (0) {}
+    size_t hits;
+    size_t misses;
+    size_t evicts;
+};
+
+// where a column of the results is fetched into, besides the text and
+// binary values, which go into buffers of their own
+struct res_column
+{
+    union
+    {
+        int64_t i;
+        double d;
+        MYSQL_TIME t;
+    };
+    unsigned long length;
+    my_bool is_null;
+};
+
+// the binds of a prepared statement, kept from execution to execution, so
+// running it again allocates nothing
+// the params are bound to the values in each request, and the results to
+// the columns, and to the text and binary buffers, which grow to fit the
+// longest values stored, and are freed along with the binds
+struct stmt_binds
+{
+    stmt_binds (MYSQL_STMT *ps, const mysql_stmt &stmt);
+    ~stmt_binds ();
+
+    std::vector<MYSQL_BIND> params;
+    std::vector<MYSQL_BIND> results;
+    std::vector<res_column> cols;
+    // the fields of the results, with the max lengths of the values updated
+    // each time the results are stored, null if not a query, or not known
+    MYSQL_RES *meta;
+
+private:
+    stmt_binds (const stmt_binds &);
+    stmt_binds &operator = (const stmt_binds &);
+};
 
 struct sql_stmt;
 class mysql_conn
 {
 public:
+    // a nonblock connection is talked to from fibers
+    // at most stmt_cap statements are kept prepared, the ones least
+    // recently run being closed to make room, or as many as the server
+    // allows if 0
     mysql_conn (const std::string &host, unsigned short port,
                 const std::string &user, const std::string &password,
-                const std::string &db, size_t timeout)
+                const std::string &db, size_t timeout, bool nonblock = false,
+                size_t stmt_cap = 0)
         : host_ (host), port_ (port), user_ (user), password_ (password),
-          db_ (db), timeout_ (timeout), conn_ (0) {}
+          db_ (db), timeout_ (timeout), nonblock_ (nonblock),
+          stmt_cap_ (stmt_cap), conn_ (0), lru_size_ (0) {}
     sql_res execute (sql_stmt &&stmt);
+    // runs a statement of the batch alone, and encodes the answer to it
+    // into rb, as it would be in the results of the batch
+    // returns the code, with the message if it fails
+    error execute (sql_stmt &stmt, sql_entry &e, res_buf &rb,
+                   std::string &msg);
     void rollback ();
     void close ();
+    bool is_open () const {return conn_;}
+    // connects, and prepares the statements not prepared yet, so the first
+    // requests don't have to, as many as are kept prepared
+    void warm_up (const stmt_map &stmts);
+    const stmt_stats &stats () const {return stats_;}
+
+private:
+    // a statement as prepared on the connection, along with what it was
+    // prepared from, so it's prepared again if the statement is reloaded
+    struct prepared
+    {
+        prepared () : ps (0) {}
+        std::tr1::shared_ptr<mysql_stmt> stmt;
+        MYSQL_STMT *ps;
+        // shared, as the binds point into themselves, and can't be copied
+        // along with the rest when the table grows
+        std::tr1::shared_ptr<stmt_binds> binds;
+        // where the statement is in the lru list, if prepared
+        std::list<size_t>::iterator lru;
+    };
 
 private:
     void connect ();
+    prepared &prepare (const std::tr1::shared_ptr<mysql_stmt> &stmt);
+    void unprepare (prepared &p);
+    bool evict ();
+    prepared &run (const std::tr1::shared_ptr<mysql_stmt> &stmt,
+                   sql_param *params, size_t n, bool store);
     sql_res real_exec (sql_stmt &&stmt);
+    sql_res stream_exec (sql_stmt &&stmt, prepared &p);
+    sql_res batch_exec (sql_stmt &&stmt);
+    template <typename Writer>
+    error gen_entry (Writer &w, sql_params &area, sql_entry &e,
+                     cppzmq::packet_t *bp, std::string &msg);
+    template <typename Writer>
+    error gen_bulk (Writer &w, res_buf &rb, sql_stmt &stmt,
+                    std::string &msg);
+    template <typename Writer>
+    error gen_batch (Writer &w, res_buf &rb, sql_stmt &stmt,
+                     cppzmq::packet_t *bp, std::string &msg);
 
 private:
     std::string host_;
@@ -38,10 +138,18 @@ private:
     std::string password_;
     std::string db_;
     size_t timeout_;
+    bool nonblock_;
+    size_t stmt_cap_;
 
 private:
     MYSQL *conn_;
-    std::tr1::unordered_map<std::string, MYSQL_STMT *> stmts_;
+    // indexed by the ids of the statements
+    std::vector<prepared> stmts_;
+    // the ids of the statements prepared, the most recently run first
+    // counted apart, as the size of a list may take walking it
+    std::list<size_t> lru_;
+    size_t lru_size_;
+    stmt_stats stats_;
 };
 
 #endif // INCLUDED_MYSQL_CONN_HPP
@@ -5,8 +5,11 @@
 ///
 
 #include "exception.hpp"
+#include "mysql_call.hpp"
 #include "mysql_stmt.hpp"
 
+#include <mysql/mysqld_error.h>
+
 #include <vconf/vconf.h>
 
 #include <cstdlib>
@@ -20,9 +23,15 @@ MYSQL_STMT *mysql_stmt::prepare (MYSQL *conn) const
     MYSQL_STMT *ps = mysql_stmt_init (conn);
     if (!ps)
         throw bad_alloc ();
-    if (mysql_stmt_prepare (ps, sql.data (), sql.size ())) {
-        mysql_stmt_close (ps);
-        throw coded_error (db_stmt, mysql_stmt_error (ps));
+    int err;
+    MYSQL_CALL (err, mysql_stmt_prepare, conn, ps, sql.data (), sql.size ());
+    if (err) {
+        unsigned code = mysql_stmt_errno (ps);
+        string msg = mysql_stmt_error (ps);
+        close_stmt (conn, ps);
+        if (code == ER_MAX_PREPARED_STMT_COUNT_REACHED)
+            return 0;
+        throw coded_error (db_stmt, msg);
     }
     return ps;
 }
@@ -46,54 +55,56 @@ bind_type mysql_stmt::translate_type (MYSQL_FIELD *field)
     case MYSQL_TYPE_TIMESTAMP:
         return timestamp;
     default:
-        cerr << file << ":" << lineno << ": " << name
-             << ": unsupported column type in results: " << endl << sql << endl
-             << flush;
-        throw runtime_error ("");
+        throw runtime_error ("unsupported column type in results");
     }
 }
 
-static MYSQL *reconnect (const string &host, unsigned short port,
-                         const string &user, const string &password,
-                         const string &db, size_t timeout)
+MYSQL *connect_mysql (const string &host, unsigned short port,
+                      const string &user, const string &password,
+                      const string &db, size_t timeout)
 {
     MYSQL *conn = mysql_init (0);
     if (!conn)
         throw bad_alloc ();
 
+    // the statements are looked into by several threads at once, so the
+    // errors are left for the caller to report
     if (mysql_options (conn, MYSQL_OPT_CONNECT_TIMEOUT, (char *) &timeout)
         || mysql_options (conn, MYSQL_OPT_READ_TIMEOUT, (char *) &timeout)
         || mysql_options (conn, MYSQL_OPT_WRITE_TIMEOUT, (char *) &timeout)) {
-        cerr << "failed to configure mysql connection, cannot proceed" << endl
-             << flush;
-        throw runtime_error ("");
+        mysql_close (conn);
+        throw runtime_error ("failed to configure mysql connection");
     }
     if (!mysql_real_connect (conn, host.c_str (), user.c_str (),
                              password.c_str (), db.c_str (), port, 0,
                              CLIENT_IGNORE_SIGPIPE)) {
-        cerr << "failed to connect to mysql server, cannot proceed" << endl
-             << flush;
-        throw runtime_error ("");
+        string msg = string ("failed to connect to mysql server: ")
+            + mysql_error (conn);
+        mysql_close (conn);
+        throw runtime_error (msg);
     }
 
     return conn;
 }
 
-void mysql_stmt::init_results (MYSQL *&conn, const string &host,
-                               unsigned short port, const string &user,
-                               const string &password, const string &db,
-                               size_t timeout)
+string mysql_stmt::init_results (MYSQL *&conn, const string &host,
+                                 unsigned short port, const string &user,
+                                 const string &password, const string &db,
+                                 size_t timeout)
 {
     if (insert_id)
-        return;
+        return "";
 
+    string err;
     for (size_t i = 0; i < 3; ++i) {
         MYSQL_STMT *ps = 0;
         if (!conn)
-            conn = reconnect (host, port, user, password, db, timeout);
+            conn = connect_mysql (host, port, user, password, db, timeout);
 
         try {
             ps = prepare (conn);
+            if (!ps)
+                throw runtime_error ("too many statements prepared");
             MYSQL_RES *res = mysql_stmt_result_metadata (ps);
             if (!res && mysql_stmt_errno (ps))
                 throw runtime_error (mysql_stmt_error (ps));
@@ -110,18 +121,16 @@ void mysql_stmt::init_results (MYSQL *&conn, const string &host,
 
             mysql_free_result (res);
             mysql_stmt_close (ps);
-            break;
+            return "";
         } catch (const exception &e) {
-            cerr << file << ":" << lineno << ": " << name
-                 << ": failed to init result info due to: " << e.what ()
-                 << "; sql: " << endl << sql << endl << flush;
-
+            err = e.what ();
             if (ps)
                 mysql_stmt_close (ps);
 
+            // the connection may be what's wrong
             mysql_close (conn);
-            conn = reconnect (host, port, user, password, db, timeout);
+            conn = 0;
         }
     }
+    return err;
 }
-
@@ -11,6 +11,9 @@
 
 #include <deque>
 #include <string>
+#include <tr1/memory>
+#include <tr1/unordered_map>
+#include <vector>
 
 struct vconf_url;
 
@@ -22,21 +25,30 @@ enum bind_type
 struct mysql_stmt
 {
     mysql_stmt (const std::string &n, const std::string &s, bool i,
-                const std::string &f, size_t l)
-        : name (n), sql (s), insert_id (i), file (f), lineno (l),
-          is_query (true) {}
+                const std::string &f, size_t l, bool st = false)
+        : name (n), sql (s), insert_id (i), stream (st), file (f),
+          lineno (l), id (0), is_query (true) {}
+    // returns null if the server has as many statements prepared as it
+    // allows
     MYSQL_STMT *prepare (MYSQL *conn) const;
-    void init_results (MYSQL *&conn, const std::string &host,
-                       unsigned short port, const std::string &user,
-                       const std::string &password, const std::string &db,
-                       size_t timeout);
+    // returns why the results couldn't be found out, empty if they were
+    // throws if the server can't be connected to at all
+    std::string init_results (MYSQL *&conn, const std::string &host,
+                              unsigned short port, const std::string &user,
+                              const std::string &password,
+                              const std::string &db, size_t timeout);
 
     std::string name;
     std::string sql;
     bool insert_id;
+    // if the results are always streamed, in chunks, as they're fetched
+    bool stream;
 
     std::string file;
     size_t lineno;
+    // given out when loaded, for the requests to refer to the statement by,
+    // and the connections to index their prepared statements by
+    size_t id;
 
     bool is_query;
     std::deque<bind_type> results;
@@ -45,4 +57,29 @@ private:
     bind_type translate_type (MYSQL_FIELD *field);
 };
 
+// the statements known, by name
+typedef std::tr1::unordered_map<std::string, std::tr1::shared_ptr<mysql_stmt>
+                                > stmt_map;
+typedef std::vector<std::tr1::shared_ptr<mysql_stmt> > stmt_list;
+
+// the statements known, by name, and by id
+// a statement keeps its id across reloads, even if changed, and the ids of
+// the statements dropped are never given out again, so an id kept by a
+// client finds either the statement it was given for, or nothing
+struct stmt_registry
+{
+    stmt_registry () : by_id (new stmt_list) {}
+    stmt_map by_name;
+    // with holes for the statements dropped
+    // never changed once the registry is in use, and shared with the
+    // requests listing the ids, which may outlive the registry
+    std::tr1::shared_ptr<stmt_list> by_id;
+};
+
+// a blocking connection, for looking into the statements
+// throws if the server can't be connected to
+MYSQL *connect_mysql (const std::string &host, unsigned short port,
+                      const std::string &user, const std::string &password,
+                      const std::string &db, size_t timeout);
+
 #endif // INCLUDED_MYSQL_STMT_HPP
@@ -0,0 +1,187 @@
+/// res_buf.cpp -- growable response buffer impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-15
+///
+
+#include "res_buf.hpp"
+
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+// the pool a buffer belongs to is kept in front of it, so zmq can give it
+// back knowing the buffer only, and the room is kept aligned for anything
+static const size_t pool_header = 16;
+
+buf_pool::buf_pool (size_t size, size_t blocks)
+    : size_ (size), free_ (blocks)
+{
+}
+
+buf_pool::~buf_pool ()
+{
+    char *buf;
+    while (free_.pop (buf))
+        free (buf - pool_header);
+}
+
+char *buf_pool::get ()
+{
+    char *buf;
+    if (free_.pop (buf))
+        return buf;
+    char *p = (char *) malloc (pool_header + size_);
+    if (!p)
+        throw bad_alloc ();
+    *(buf_pool **) p = this;
+    return p + pool_header;
+}
+
+void buf_pool::put (char *buf)
+{
+    if (!free_.push (buf))
+        free (buf - pool_header);
+}
+
+void buf_pool::put_buf (void *, void *hint)
+{
+    char *buf = (char *) hint;
+    (*(buf_pool **) (buf - pool_header))->put (buf);
+}
+
+res_buf::res_buf (res_buf &&rhs)
+    : base_ (rhs.base_), cap_ (rhs.cap_), begin_ (rhs.begin_),
+      end_ (rhs.end_), headroom_ (rhs.headroom_), owned_ (rhs.owned_),
+      pool_ (rhs.pool_), pooled_ (rhs.pooled_)
+{
+    if (!owned_) {
+        // the storage belongs to the other guy, can only copy
+        base_ = 0;
+        cap_ = 0;
+        begin_ = end_ = headroom_ = 0;
+        owned_ = true;
+        append (rhs.data (), rhs.size ());
+        rhs.clear ();
+        return;
+    }
+    rhs.base_ = 0;
+    rhs.reset ();
+}
+
+// gives the buffer back to where it came from
+void res_buf::free_base ()
+{
+    if (pooled_)
+        pool_->put (base_);
+    else if (owned_)
+        free (base_);
+}
+
+res_buf::~res_buf ()
+{
+    free_base ();
+}
+
+res_buf &res_buf::operator = (res_buf &&rhs)
+{
+    if (this == &rhs)
+        return *this;
+
+    if (!rhs.owned_) {
+        clear ();
+        append (rhs.data (), rhs.size ());
+        rhs.clear ();
+        return *this;
+    }
+
+    free_base ();
+    base_ = rhs.base_;
+    cap_ = rhs.cap_;
+    begin_ = rhs.begin_;
+    end_ = rhs.end_;
+    headroom_ = rhs.headroom_;
+    owned_ = true;
+    pool_ = rhs.pool_;
+    pooled_ = rhs.pooled_;
+    rhs.base_ = 0;
+    rhs.reset ();
+    return *this;
+}
+
+void res_buf::reset ()
+{
+    cap_ = 0;
+    begin_ = end_ = headroom_;
+    pooled_ = false;
+}
+
+void res_buf::grow (size_t n)
+{
+    if (!base_ && pool_ && end_ + n <= pool_->size ()) {
+        base_ = pool_->get ();
+        cap_ = pool_->size ();
+        pooled_ = true;
+        return;
+    }
+
+    size_t cap = cap_ ? cap_ * 2 : initial_size + headroom_;
+    while (cap - end_ < n)
+        cap *= 2;
+
+    char *p;
+    if (pooled_) {
+        // off the pool, which only has buffers of the one size
+        p = (char *) malloc (cap);
+        if (p) {
+            memcpy (p, base_, end_);
+            pool_->put (base_);
+            pooled_ = false;
+        }
+    } else if (owned_)
+        p = (char *) realloc (base_, cap);
+    else {
+        p = (char *) malloc (cap);
+        if (p)
+            memcpy (p, base_ + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = headroom_ = 0;
+        owned_ = true;
+    }
+    if (!p)
+        throw bad_alloc ();
+    base_ = p;
+    cap_ = cap;
+}
+
+bool res_buf::prepend (const void *p, size_t n)
+{
+    if (begin_ < n || !base_)
+        return false;
+    begin_ -= n;
+    memcpy (base_ + begin_, p, n);
+    return true;
+}
+
+static void free_buf (void *data, void *hint)
+{
+    free (hint);
+}
+
+cppzmq::message_t res_buf::release ()
+{
+    if (empty ())
+        return cppzmq::message_t ();
+    if (!owned_) {
+        cppzmq::message_t msg (data (), size ());
+        clear ();
+        return msg;
+    }
+
+    cppzmq::message_t msg (base_ + begin_, size (),
+                           pooled_ ? &buf_pool::put_buf : &free_buf, base_);
+    base_ = 0;
+    reset ();
+    return msg;
+}
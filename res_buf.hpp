@@ -0,0 +1,122 @@
+/// res_buf.hpp -- growable response buffer decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-15
+///
+
+#ifndef INCLUDED_RES_BUF_HPP
+#define INCLUDED_RES_BUF_HPP
+
+#include "mpmc_queue.hpp"
+
+#include <cppzmq.hpp>
+
+#include <cstring>
+
+// buffers of the same size, kept for reuse instead of being freed
+// taken by a single thread, the one encoding responses into them, and given
+// back by whichever thread zmq frees the messages on, so the pool must
+// outlive all the messages made of its buffers
+class buf_pool
+{
+public:
+    // keeps at most blocks buffers, which has to be a power of 2
+    buf_pool (size_t size, size_t blocks);
+    ~buf_pool ();
+
+public:
+    size_t size () const {return size_;}
+    // a buffer of the pool, or a new one if none is left
+    char *get ();
+    // the buffer is freed if the pool is full
+    void put (char *buf);
+    // for zmq to give the buffer back, the hint being the buffer
+    static void put_buf (void *data, void *hint);
+
+private:
+    buf_pool (const buf_pool &);
+    buf_pool &operator = (const buf_pool &);
+
+private:
+    size_t size_;
+    mpmc_queue<char *> free_;
+};
+
+// a flat byte buffer responses are encoded into
+// some room is kept before the data, so the envelope can be prepended after
+// the results are generated, and the buffer is finally handed over to zmq
+// without being copied
+class res_buf
+{
+public:
+    static const size_t default_headroom = 128;
+    static const size_t initial_size = 4096;
+
+public:
+    explicit res_buf (size_t headroom = default_headroom)
+        : base_ (0), cap_ (0), begin_ (headroom), end_ (headroom),
+          headroom_ (headroom), owned_ (true), pool_ (0), pooled_ (false) {}
+    // starts on a buffer of the pool, if the pool's buffers are large enough
+    // for the headroom, and moves off the pool only when it overflows
+    explicit res_buf (buf_pool &pool)
+        : base_ (0), cap_ (0), begin_ (default_headroom),
+          end_ (default_headroom), headroom_ (default_headroom),
+          owned_ (true), pool_ (&pool), pooled_ (false) {}
+    // starts on storage provided by the caller, e.g. on the stack, and moves
+    // to the heap only when it overflows
+    res_buf (char *storage, size_t size)
+        : base_ (storage), cap_ (size), begin_ (0), end_ (0), headroom_ (0),
+          owned_ (false), pool_ (0), pooled_ (false) {}
+    res_buf (res_buf &&rhs);
+    ~res_buf ();
+    res_buf &operator = (res_buf &&rhs);
+
+public:
+    bool empty () const {return begin_ == end_;}
+    size_t size () const {return end_ - begin_;}
+    const char *data () const {return base_ + begin_;}
+
+    char *reserve (size_t n)
+        {
+            if (!base_ || cap_ - end_ < n)
+                grow (n);
+            return base_ + end_;
+        }
+    void commit (size_t n) {end_ += n;}
+    void append (const void *p, size_t n)
+        {
+            memcpy (reserve (n), p, n);
+            end_ += n;
+        }
+    void put (char c)
+        {
+            *reserve (1) = c;
+            ++end_;
+        }
+    // returns false if there's not enough headroom left
+    bool prepend (const void *p, size_t n);
+    void clear () {begin_ = end_ = headroom_;}
+
+    // gives the data to zmq, and the buffer is left empty
+    cppzmq::message_t release ();
+
+private:
+    res_buf (const res_buf &);
+    res_buf &operator = (const res_buf &);
+    void grow (size_t n);
+    void reset ();
+    void free_base ();
+
+private:
+    char *base_;
+    size_t cap_;
+    size_t begin_;
+    size_t end_;
+    size_t headroom_;
+    bool owned_;
+    // where the buffer is taken from, if anywhere, and if it's from there
+    buf_pool *pool_;
+    bool pooled_;
+};
+
+#endif // INCLUDED_RES_BUF_HPP
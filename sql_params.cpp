@@ -0,0 +1,66 @@
+/// sql_params.cpp -- decoded request impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-16
+///
+
+#include "exception.hpp"
+#include "sql_params.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static unsigned parse_bidigit (const char *s)
+{
+    if (!isdigit (s[0]) || !isdigit (s[1]))
+        throw coded_error (bad_arg, "bad parameter value");
+    return (s[0] - '0') * 10 + s[1] - '0';
+}
+
+static void parse_time (MYSQL_TIME &t, const char *s)
+{
+    static const char format[] = "0000-00-00T00:00:00";
+    if (strlen (s) != sizeof (format) - 1
+        || s[4] != format[4] || s[7] != format[7] || s[10] != format[10]
+        || s[13] != format[13] || s[16] != format[16])
+        throw coded_error (bad_arg, "bad parameter value");
+    memset (&t, 0, sizeof (t));
+    t.year = parse_bidigit (s) * 100 + parse_bidigit (&s[2]);
+    t.month = parse_bidigit (&s[5]);
+    t.day = parse_bidigit (&s[8]);
+    t.hour = parse_bidigit (&s[11]);
+    t.minute = parse_bidigit (&s[14]);
+    t.second = parse_bidigit (&s[17]);
+}
+
+static void check_end (const char *p)
+{
+    while (*p && isspace (*p))
+        ++p;
+    if (*p)
+        throw coded_error (bad_arg, "bad parameter value");
+}
+
+void set_typed_param (sql_param &param, const char *type, const char *value)
+{
+    if (!*value)
+        throw coded_error (bad_arg, "bad parameter value");
+
+    char *p;
+    if (!strcmp (type, "long")) {
+        param.type = integer;
+        param.i = strtoll (value, &p, 0);
+        check_end (p);
+    } else if (!strcmp (type, "unsigned")) {
+        param.type = unsigned_int;
+        param.u = strtoull (value, &p, 0);
+        check_end (p);
+    } else if (!strcmp (type, "timestamp")) {
+        param.type = timestamp;
+        parse_time (param.t, value);
+    } else
+        throw coded_error (bad_arg, "unrecognized parameter type");
+}
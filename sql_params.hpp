@@ -0,0 +1,118 @@
+/// sql_params.hpp -- decoded request decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-16
+///
+
+#ifndef INCLUDED_SQL_PARAMS_HPP
+#define INCLUDED_SQL_PARAMS_HPP
+
+#include "exception.hpp"
+#include "mysql_stmt.hpp"
+
+#include <mysql/mysql.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <tr1/memory>
+#include <vector>
+
+// a typed parameter value, ready to be bound
+struct sql_param
+{
+    bind_type type;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double d;
+        MYSQL_TIME t;
+    };
+    // text and binary values, pointing into the request, or into the blob
+    // frame following it
+    const char *str;
+    unsigned long len;
+};
+
+// the fields of a request besides the params
+struct sql_req
+{
+    sql_req ()
+        : id (0), sql (0), sql_len (0), by_id (false), stmt_id (0),
+          txn_seq (0), has_params (false), blob_frames (false),
+          stream (false), batch (false), stop_on_error (true),
+          atomic (false), parallel (false), bulk (false), err (success) {}
+
+    size_t id;
+    // the statement, by name, or by the id given out when it was loaded
+    const char *sql;
+    size_t sql_len;
+    bool by_id;
+    size_t stmt_id;
+    size_t txn_seq;
+    bool has_params;
+    // if blob results shall be sent as frames following the response
+    bool blob_frames;
+    // if the results shall be streamed, in chunks, as they're fetched
+    bool stream;
+    // if the statements are given as a batch, in the params area, and if
+    // the batch stops at the first of them failing
+    bool batch;
+    bool stop_on_error;
+    // if the batch is run in a txn of its own, or spread over connections
+    bool atomic;
+    bool parallel;
+    // if the statement is run once for each row of params, in the params
+    // area like the statements of a batch
+    bool bulk;
+    // errors in params are only reported after the statement is looked up
+    error err;
+    std::string msg;
+};
+
+// a statement of a batch, or a run of the statement in bulk, along with
+// its own params, which are decoded with those of the others, from first to
+// first + count
+struct sql_entry
+{
+    sql_entry () : first (0), count (0) {}
+
+    // only what names the statement, and the errors in its params
+    sql_req req;
+    size_t first;
+    size_t count;
+    // looked up after the whole request is read
+    std::tr1::shared_ptr<mysql_stmt> stmt;
+};
+
+// the area requests are decoded into
+// each worker owns one, and it's cleared but never freed between requests,
+// so decoding small requests does not touch the heap at all
+struct sql_params
+{
+    void clear ()
+        {
+            params.clear ();
+            bytes.clear ();
+            blob_refs.clear ();
+            entries.clear ();
+        }
+
+    std::vector<sql_param> params;
+    // binaries sent as arrays of byte values are collected here
+    std::vector<unsigned char> bytes;
+    // binaries sent out of band as {"blob": k}, indices of the params
+    // the frame index is kept in u until the frames are attached
+    std::vector<size_t> blob_refs;
+    // the statements of a batch, in order
+    std::vector<sql_entry> entries;
+    // scratch for looking up statements by name
+    std::string name;
+};
+
+// for params sent as [type, value] pairs, value being nul terminated
+// throws coded_error if the type is unknown or the value cannot be parsed
+void set_typed_param (sql_param &param, const char *type, const char *value);
+
+#endif // INCLUDED_SQL_PARAMS_HPP
@@ -8,6 +8,7 @@
 #define INCLUDED_SQL_RES_HPP
 
 #include "exception.hpp"
+#include "res_buf.hpp"
 #include "sql_stmt.hpp"
 
 #include <cppzmq.hpp>
@@ -16,51 +17,79 @@
 
 struct sql_res
 {
-    sql_res () : empty (true), id (0), err (success), txn_seq (0) {}
+    sql_res ()
+        : empty (true), enc (json_codec), id (0), err (success), txn_seq (0),
+          more (false) {}
     sql_res (sql_res &&rhs)
-        : empty (rhs.empty), addr (std::move (rhs.addr)), id (rhs.id),
-          err (rhs.err), msg (rhs.msg), txn_seq (rhs.txn_seq),
-          res (std::move (rhs.res)) {}
-    sql_res (cppzmq::packet_t &&a, size_t txn, error e,
+        : empty (rhs.empty), addr (std::move (rhs.addr)), enc (rhs.enc),
+          id (rhs.id), err (rhs.err), msg (std::move (rhs.msg)),
+          txn_seq (rhs.txn_seq), res (std::move (rhs.res)),
+          blobs (std::move (rhs.blobs)), more (rhs.more) {}
+    sql_res (cppzmq::packet_t &&a, codec c, size_t txn, error e,
              const std::string &m = "")
-        : empty (false), addr (a), id (0), err (e), msg (m), txn_seq (txn)
-        {
-            if (msg.empty ())
-                msg = err_to_str (err);
-        }
-    sql_res (sql_stmt &&stmt, const std::string &&r = "")
-        : empty (false), addr (std::move (stmt.addr)), id (stmt.id),
-          err (stmt.err), msg (stmt.msg), txn_seq (stmt.txn_seq), res (r)
-        {
-            if (msg.empty ())
-                msg = err_to_str (err);
-        }
+        : empty (false), addr (std::move (a)), enc (c), id (0), err (e),
+          msg (m), txn_seq (txn), more (false)
+        {}
+    sql_res (sql_stmt &&stmt)
+        : empty (false), addr (std::move (stmt.addr)), enc (stmt.enc),
+          id (stmt.id), err (stmt.err), msg (stmt.msg), txn_seq (stmt.txn_seq),
+          more (false)
+        {}
+    sql_res (sql_stmt &&stmt, res_buf &&r)
+        : empty (false), addr (std::move (stmt.addr)), enc (stmt.enc),
+          id (stmt.id), err (stmt.err), msg (stmt.msg), txn_seq (stmt.txn_seq),
+          res (std::move (r)), more (false)
+        {}
+    sql_res (sql_stmt &&stmt, res_buf &&r, cppzmq::packet_t &&b)
+        : empty (false), addr (std::move (stmt.addr)), enc (stmt.enc),
+          id (stmt.id), err (stmt.err), msg (stmt.msg), txn_seq (stmt.txn_seq),
+          res (std::move (r)), blobs (std::move (b)), more (false)
+        {}
     sql_res (sql_stmt &&stmt, error e, const std::string &m = "")
-        : empty (false), addr (std::move (stmt.addr)), id (stmt.id), err (e),
-          msg (m), txn_seq (stmt.txn_seq)
-        {
-            if (msg.empty ())
-                msg = err_to_str (err);
-        }
+        : empty (false), addr (std::move (stmt.addr)), enc (stmt.enc),
+          id (stmt.id), err (e), msg (m), txn_seq (stmt.txn_seq),
+          more (false)
+        {}
     sql_res &operator = (sql_res &&rhs)
         {
             empty = rhs.empty;
             addr = std::move (rhs.addr);
+            enc = rhs.enc;
             id = rhs.id;
             err = rhs.err;
-            msg = rhs.msg;
+            msg = std::move (rhs.msg);
             txn_seq = rhs.txn_seq;
             res = std::move (rhs.res);
+            blobs = std::move (rhs.blobs);
+            more = rhs.more;
             return *this;
         }
 
     bool empty;
     cppzmq::packet_t addr;
+    codec enc;
     size_t id;
     error err;
+    // the message of the code if empty, so no string is made for a success
     std::string msg;
     size_t txn_seq;
-    std::string res;
+    // the encoded results, with room left for the envelope
+    res_buf res;
+    // blob columns sent out of band, as frames following the response
+    cppzmq::packet_t blobs;
+    // a chunk of the results streamed, with more to follow
+    bool more;
+};
+
+// takes the chunks of the results streamed, as they're fetched, and sends
+// them on to the caller, in the order they're taken
+// may block until the caller has acked the chunks sent before, so the chunks
+// in flight take bounded memory, and throws if the caller takes too long
+class res_sink
+{
+public:
+    virtual ~res_sink () {}
+    virtual void send (sql_res &&chunk) = 0;
 };
 
 #endif // INCLUDED_SQL_RES_HPP
@@ -5,70 +5,142 @@
 ///
 
 #include "exception.hpp"
+#include "json_reader.hpp"
+#include "mp_reader.hpp"
 #include "sql_stmt.hpp"
 
 using namespace std;
 
-struct json_putter
+static sql_stmt::builtin_stmt builtin_of (const string &name)
 {
-    json_putter (struct json_object *p) : p_ (p) {}
-    ~json_putter () {json_object_put (p_);}
-private:
-    struct json_object *p_;
-};
+    if (name == "begin")
+        return sql_stmt::begin;
+    else if (name == "commit")
+        return sql_stmt::commit;
+    else if (name == "rollback")
+        return sql_stmt::rollback;
+    else if (name == "stmt_ids")
+        return sql_stmt::list_ids;
+    return sql_stmt::none;
+}
 
-sql_stmt::sql_stmt (cppzmq::packet_t &&a, const cppzmq::message_t &sql,
-                    const tr1::unordered_map<string, tr1::shared_ptr<mysql_stmt>
-                                             > &stmts)
-    : addr (a), id (0), err (success), txn_seq (0), builtin (none), params (0)
+// by the id of the request, or else by the name, which is the statement
+// of the request already
+// the builtins have no ids, and aren't looked up here
+// throws coded_error if there's no such statement
+static tr1::shared_ptr<mysql_stmt> find_stmt (const sql_req &rq,
+                                              const stmt_registry &stmts,
+                                              string &name)
 {
-    try {
-        struct json_tokener *parser = json_tokener_new ();
-        if (!parser)
-            throw bad_alloc ();
-
-        struct json_object *parsed =
-            json_tokener_parse_ex (parser, (char *) sql.data (), sql.size ());
-        json_tokener_free (parser);
-        if (!parsed)
-            throw coded_error (bad_req, "malformed json");
+    if (rq.by_id) {
+        const stmt_list &by_id = *stmts.by_id;
+        if (rq.stmt_id >= by_id.size () || !by_id[rq.stmt_id])
+            throw coded_error (bad_req, "unknown statement");
+        name.clear ();
+        return by_id[rq.stmt_id];
+    }
 
-        json_putter jf (parsed);
-        struct json_object *p = json_object_object_get (parsed, "id");
-        if (!p)
-            throw coded_error (bad_req, "no id specified");
-        id = json_object_get_int (p);
-        if (!id)
-            throw coded_error (bad_req, "no id specified");
+    stmt_map::const_iterator it = stmts.by_name.find (name);
+    if (it == stmts.by_name.end ())
+        throw coded_error (bad_req, "unknown statement");
+    return it->second;
+}
 
-        p = json_object_object_get (parsed, "sql");
-        if (!p)
+// a statement of a batch failing to be looked up fails alone, as it would
+// if it failed to run
+// the statements run in parallel must not depend on one another, and
+// only queries are sure not to
+static void find_entry (sql_entry &e, const stmt_registry &stmts,
+                        string &name, bool parallel)
+{
+    if (e.req.err)
+        return;
+    try {
+        if (!e.req.sql && !e.req.by_id)
             throw coded_error (bad_req, "no statement specified");
-        string name = json_object_get_string (p);
-        if (name == "begin")
-            builtin = begin;
-        else if (name == "commit")
-            builtin = commit;
-        else if (name == "rollback")
-            builtin = rollback;
+        if (!e.req.by_id) {
+            name.assign (e.req.sql, e.req.sql_len);
+            if (builtin_of (name) != sql_stmt::none)
+                throw coded_error (bad_req, "builtins not allowed in batches");
+        }
+        e.stmt = find_stmt (e.req, stmts, name);
+        if (parallel && (!e.stmt->is_query || e.stmt->insert_id))
+            throw coded_error (bad_req, "only queries can be run in parallel");
+    } catch (const coded_error &ex) {
+        e.req.err = ex.code ();
+        e.req.msg = ex.what ();
+    }
+}
+
+sql_stmt::sql_stmt (cppzmq::packet_t &&a, cppzmq::message_t &&r,
+                    cppzmq::packet_t &&b, sql_params &area,
+                    const stmt_registry &stmts)
+    : addr (std::move (a)), req (std::move (r)), blobs (std::move (b)),
+      blob_frames (false), enc (sniff_codec (req.data (), req.size ())),
+      id (0), err (success), txn_seq (0), builtin (none), params (0),
+      bufs (0), stream (false), sink (0), batch (false), stop_on_error (true),
+      atomic (false), parallel (false), bulk (false)
+{
+    sql_req rq;
+    try {
+        if (enc == msgpack_codec)
+            mp_reader ((const char *) req.data (), req.size ()).read (rq, area);
+        else
+            json_reader ((char *) req.data (), req.size ()).read (rq, area);
+        id = rq.id;
+        txn_seq = rq.txn_seq;
+        blob_frames = rq.blob_frames;
+
+        string &name = area.name;
+        batch = rq.batch;
+        atomic = rq.atomic;
+        parallel = rq.parallel;
+        bulk = rq.bulk;
+        stop_on_error = (rq.stop_on_error || atomic) && !parallel;
+        if (batch && bulk)
+            throw coded_error (bad_req, "batches can't be run in bulk");
+        if (atomic && !batch && !bulk)
+            throw coded_error (bad_req, "only batches can be atomic");
+        if (parallel && !batch)
+            throw coded_error (bad_req, "only batches can be parallel");
+        if (atomic && parallel)
+            throw coded_error (bad_req, "atomic batches can't be parallel");
+        if (batch) {
+            for (size_t i = 0; i < area.entries.size (); ++i)
+                find_entry (area.entries[i], stmts, name, rq.parallel);
+        } else if (rq.by_id)
+            stmt = find_stmt (rq, stmts, name);
         else {
-            if (stmts.find (name) == stmts.end ())
-                throw coded_error (bad_req, "unknown statement");
-            stmt = stmts.find (name)->second;
+            name.assign (rq.sql, rq.sql_len);
+            builtin = builtin_of (name);
+            if (builtin == list_ids)
+                ids = stmts.by_id;
+            else if (builtin == none)
+                stmt = find_stmt (rq, stmts, name);
         }
 
-        p = json_object_object_get (parsed, "txn");
-        if (p)
-            txn_seq = json_object_get_int (p);
+        if (bulk && !stmt)
+            throw coded_error (bad_req, "builtins can't be run in bulk");
+        else if (bulk && stmt->is_query && !stmt->insert_id)
+            throw coded_error (bad_req, "queries can't be run in bulk");
+
+        stream = !batch && !bulk && (rq.stream || (stmt && stmt->stream));
 
-        params = json_object_object_get (parsed, "params");
-        if (params) {
-            if (!json_object_is_type (params, json_type_array))
-                throw coded_error (bad_arg, "params must be an array");
-            json_object_get (params);
-            json_object_object_del (parsed, "params");
+        if (rq.err)
+            throw coded_error (rq.err, rq.msg);
+        for (size_t i = 0; i < area.blob_refs.size (); ++i) {
+            sql_param &param = area.params[area.blob_refs[i]];
+            if (param.u >= blobs.size ())
+                throw coded_error (bad_arg, "no such blob frame");
+            const cppzmq::message_t &blob = blobs[param.u];
+            param.str = (const char *) blob.data ();
+            param.len = blob.size ();
         }
+        if (rq.has_params || batch || bulk)
+            params = &area;
     } catch (const coded_error &e) {
+        id = rq.id;
+        txn_seq = rq.txn_seq;
         err = e.code ();
         msg = e.what ();
     }
@@ -7,10 +7,12 @@
 #ifndef INCLUDED_SQL_STMT_HPP
 #define INCLUDED_SQL_STMT_HPP
 
+#include "codec.hpp"
 #include "exception.hpp"
 #include "mysql_stmt.hpp"
+#include "res_buf.hpp"
+#include "sql_params.hpp"
 
-#include <json/json.h>
 #include <cppzmq.hpp>
 
 #include <string>
@@ -18,29 +20,71 @@
 #include <tr1/unordered_map>
 
 struct mysql_stmt;
+class res_sink;
 struct sql_stmt
 {
-    sql_stmt (cppzmq::packet_t &&a, const cppzmq::message_t &sql,
-              const std::tr1::unordered_map<std::string,
-                                            std::tr1::shared_ptr<mysql_stmt>
-                                            > &stmts);
+    // the params are decoded into the area given, which belongs to the
+    // worker, and are valid until the next statement is read
+    // binary params may refer to the blob frames following the request
+    sql_stmt (cppzmq::packet_t &&a, cppzmq::message_t &&r,
+              cppzmq::packet_t &&b, sql_params &area,
+              const stmt_registry &stmts);
     sql_stmt (sql_stmt &&rhs)
-        : addr (std::move (rhs.addr)), id (rhs.id), err (rhs.err),
-          msg (std::move (rhs.msg)), txn_seq (rhs.txn_seq),
-          builtin (rhs.builtin), stmt (rhs.stmt)
-        {std::swap (params, rhs.params);}
-    ~sql_stmt () {if (params) json_object_put (params);}
+        : addr (std::move (rhs.addr)), req (std::move (rhs.req)),
+          blobs (std::move (rhs.blobs)), blob_frames (rhs.blob_frames),
+          enc (rhs.enc), id (rhs.id), err (rhs.err), msg (std::move (rhs.msg)),
+          txn_seq (rhs.txn_seq), builtin (rhs.builtin), stmt (rhs.stmt),
+          ids (rhs.ids), params (rhs.params), bufs (rhs.bufs),
+          stream (rhs.stream), sink (rhs.sink), batch (rhs.batch),
+          stop_on_error (rhs.stop_on_error), atomic (rhs.atomic),
+          parallel (rhs.parallel), bulk (rhs.bulk) {}
     bool begins_txn () const {return builtin == begin;}
     bool ends_txn () const {return builtin == commit || builtin == rollback;}
 
     mutable cppzmq::packet_t addr;
+    // the request, which the string params point into
+    cppzmq::message_t req;
+    // the frames following the request, which the blob params point into
+    cppzmq::packet_t blobs;
+    // if blob results shall be sent as frames, instead of inline
+    bool blob_frames;
+    // how the request is encoded, and the response shall be
+    codec enc;
     size_t id;
     error err;
     std::string msg;
     size_t txn_seq;
-    enum builtin_stmt {none, begin, commit, rollback} builtin;
+    enum builtin_stmt {none, begin, commit, rollback, list_ids} builtin;
     std::tr1::shared_ptr<mysql_stmt> stmt;
-    struct json_object *params;
+    // the statements by id, for listing their ids
+    std::tr1::shared_ptr<const stmt_list> ids;
+    // the params, and the statements of a batch along with theirs, or the
+    // rows of params the statement is run with in bulk
+    sql_params *params;
+    // where the response is encoded into, the heap if null
+    buf_pool *bufs;
+    // if the results are streamed, in chunks sent to the sink as they're
+    // fetched, the last one sent as the response
+    // only streamed if there's a sink to send the chunks to
+    bool stream;
+    res_sink *sink;
+    // if the statements of the batch in the params are run in place of a
+    // single one, and if they stop at the first failure
+    // the builtins are never run in batches
+    bool batch;
+    bool stop_on_error;
+    // if the batch, or the bulk run, is run in a txn of its own, which is
+    // rolled back at the first failure, so it never goes on after one
+    bool atomic;
+    // if the statements of the batch, all queries, are spread over several
+    // connections, and run all at once, each whether the others fail or not
+    // in txns, and on the inproc fallback, they're run one after another
+    bool parallel;
+    // if the statement, which has no results, is run once for each row of
+    // params, answered by the code, the rows affected and the insert id of
+    // each run, as a row of the results
+    // stops at the first failure like a batch, and may be atomic like one
+    bool bulk;
 };
 
 #endif // INCLUDED_SQL_STMT_HPP
@@ -0,0 +1,143 @@
+/// stmt_cache.cpp -- statement results kept on disk across restarts impl
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-23
+///
+
+#include "stmt_cache.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+static const char *cache_magic = "mysqlcp-stmts-cache 1";
+
+// FNV-1a
+uint64_t stmt_cache::hash (const string &sql)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < sql.size (); ++i) {
+        h ^= (unsigned char) sql[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// one statement a line: the hash of the sql, q for queries and n for the
+// others, and the types of the results
+void stmt_cache::load (const string &path, const string &version)
+{
+    entries_.clear ();
+    ifstream f (path.c_str ());
+    if (!f.is_open ())
+        return;
+
+    string line;
+    if (!getline (f, line) || line != cache_magic)
+        return;
+    if (!getline (f, line) || line != "version " + version)
+        return;
+
+    tr1::unordered_map<uint64_t, entry> entries;
+    while (getline (f, line)) {
+        istringstream iss (line);
+        uint64_t h;
+        string kind;
+        if (!(iss >> hex >> h >> kind) || (kind != "q" && kind != "n"))
+            // a broken cache is no cache
+            return;
+
+        entry &e = entries[h];
+        e.is_query = kind == "q";
+        unsigned type;
+        while (iss >> dec >> type) {
+            if (type > timestamp)
+                return;
+            e.results.push_back ((bind_type) type);
+        }
+        if (!iss.eof ())
+            return;
+    }
+    entries_.swap (entries);
+}
+
+void stmt_cache::save (const string &path, const string &version) const
+{
+    string tmp = path + ".tmp";
+    {
+        ofstream f (tmp.c_str ());
+        f << cache_magic << "\n" << "version " << version << "\n";
+        tr1::unordered_map<uint64_t, entry>::const_iterator it;
+        for (it = entries_.begin (); it != entries_.end (); ++it) {
+            f << hex << it->first << (it->second.is_query ? " q" : " n")
+              << dec;
+            for (size_t i = 0; i < it->second.results.size (); ++i)
+                f << " " << it->second.results[i];
+            f << "\n";
+        }
+        f.flush ();
+        if (!f)
+            throw runtime_error ("failed to write statements cache: " + tmp);
+    }
+    if (rename (tmp.c_str (), path.c_str ()))
+        throw runtime_error ("failed to write statements cache: " + path);
+}
+
+bool stmt_cache::find (mysql_stmt &stmt) const
+{
+    if (stmt.insert_id)
+        return true;
+    tr1::unordered_map<uint64_t, entry>::const_iterator it =
+        entries_.find (hash (stmt.sql));
+    if (it == entries_.end ())
+        return false;
+    stmt.is_query = it->second.is_query;
+    stmt.results = it->second.results;
+    return true;
+}
+
+// the same sql may be an insert-id statement, as well as not
+void stmt_cache::add (const mysql_stmt &stmt)
+{
+    if (stmt.insert_id)
+        return;
+    entry &e = entries_[hash (stmt.sql)];
+    e.is_query = stmt.is_query;
+    e.results = stmt.results;
+}
+
+void stmt_cache::remove (const mysql_stmt &stmt)
+{
+    if (!stmt.insert_id)
+        entries_.erase (hash (stmt.sql));
+}
+
+// the sum of the checksums doesn't depend on the order the columns are
+// listed in, and is never cut short, like a concatenation may be
+string schema_version (MYSQL *conn)
+{
+    static const char *sql =
+        "select count(*), coalesce(sum(crc32(concat_ws(' ', table_schema,"
+        " table_name, ordinal_position, column_name, column_type))), 0)"
+        " from information_schema.columns where table_schema not in"
+        " ('mysql', 'information_schema', 'performance_schema', 'sys')";
+
+    if (mysql_query (conn, sql))
+        throw runtime_error (mysql_error (conn));
+    MYSQL_RES *res = mysql_store_result (conn);
+    if (!res)
+        throw runtime_error (mysql_error (conn));
+    MYSQL_ROW row = mysql_fetch_row (res);
+    if (!row || !row[0] || !row[1]) {
+        mysql_free_result (res);
+        throw runtime_error ("no schema version");
+    }
+
+    string version = string (mysql_get_server_info (conn)) + " " + row[0]
+        + " " + row[1];
+    mysql_free_result (res);
+    return version;
+}
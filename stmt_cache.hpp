@@ -0,0 +1,60 @@
+/// stmt_cache.hpp -- statement results kept on disk across restarts decls
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-23
+///
+
+#ifndef INCLUDED_STMT_CACHE_HPP
+#define INCLUDED_STMT_CACHE_HPP
+
+#include "mysql_stmt.hpp"
+
+#include <mysql/mysql.h>
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <tr1/unordered_map>
+
+// what the server says of the results of each statement, so a restart
+// doesn't have to ask again
+// the statements are known by a hash of their sql, with the db names
+// expanded, and the whole cache by the version of the schema it was made
+// against, so any change to any column throws it all away
+class stmt_cache
+{
+public:
+    // loads the cache made against the version, or nothing if it was made
+    // against another, or can't be read
+    void load (const std::string &path, const std::string &version);
+    // writes the cache over the file as a whole, or not at all
+    void save (const std::string &path, const std::string &version) const;
+
+public:
+    // sets the results of the statement, if found
+    // the results of insert-id statements are never asked, and always found
+    bool find (mysql_stmt &stmt) const;
+    void add (const mysql_stmt &stmt);
+    void remove (const mysql_stmt &stmt);
+
+private:
+    struct entry
+    {
+        bool is_query;
+        std::deque<bind_type> results;
+    };
+
+private:
+    static uint64_t hash (const std::string &sql);
+
+private:
+    std::tr1::unordered_map<uint64_t, entry> entries_;
+};
+
+// the version of the columns of all the tables the server has, besides the
+// system ones, and of the server itself
+// throws if the server can't tell
+std::string schema_version (MYSQL *conn);
+
+#endif // INCLUDED_STMT_CACHE_HPP
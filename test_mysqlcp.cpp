@@ -4,6 +4,7 @@
 #include <boost/lexical_cast.hpp>
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -11,19 +12,21 @@
 using namespace std;
 using namespace boost;
 
-static struct json_object *exec_sql (zmq::socket_t &sock,
+// fields are the fields of the request besides the id and the txn
+// the blob, if any, is sent in a frame following the request
+// if code is given, it's told the code, and the results are returned even
+// if the request fails, as a batch has results either way
+static struct json_object *exec_req (zmq::socket_t &sock,
                                      cppzmq::message_t &txn, size_t id,
-                                     size_t &seq, const string &stmt,
-                                     const string &params = "")
+                                     size_t &seq, const string &fields,
+                                     const string &blob = "",
+                                     int *code = 0)
 {
     ostringstream ss;
     ss << "{\"id\": " << id;
     if (seq)
         ss << ", \"txn\": " << seq;
-    ss << ", \"sql\": \"" << stmt << "\"";
-    if (!params.empty ())
-        ss << ", \"params\": ";
-    ss << params << "}";
+    ss << ", " << fields << "}";
     string s = ss.str ();
     cout << "req: " << s << endl << flush;
     cppzmq::message_t req (s);
@@ -31,6 +34,8 @@ static struct json_object *exec_sql (zmq::socket_t &sock,
     if (!txn.empty ())
         p.push_back (txn);
     p.push_back (req);
+    if (!blob.empty ())
+        p.push_back (cppzmq::message_t (blob));
 
     sock << p;
 
@@ -49,12 +54,16 @@ static struct json_object *exec_sql (zmq::socket_t &sock,
     seq = json_object_object_get (o, "txn")
         ? json_object_get_int (json_object_object_get (o, "txn")) : 0;
     int err = json_object_get_int (json_object_object_get (o, "code"));
+    if (code)
+        *code = err;
     if (err) {
         cerr << "got error: "
              << json_object_get_string (json_object_object_get (o, "message"))
              << endl << flush;
-        json_object_put (o);
-        return 0;
+        if (!code) {
+            json_object_put (o);
+            return 0;
+        }
     }
 
     struct json_object *res = json_object_object_get (o, "results");
@@ -70,6 +79,57 @@ static struct json_object *exec_sql (zmq::socket_t &sock,
     return res;
 }
 
+static struct json_object *exec_sql (zmq::socket_t &sock,
+                                     cppzmq::message_t &txn, size_t id,
+                                     size_t &seq, const string &stmt,
+                                     const string &params = "")
+{
+    string fields = "\"sql\": \"" + stmt + "\"";
+    if (!params.empty ())
+        fields += ", \"params\": " + params;
+    return exec_req (sock, txn, id, seq, fields);
+}
+
+// the entry of a batch answered, with the code, and the rows if any
+static void check_entry (struct json_object *res, size_t i, int code,
+                         int rows)
+{
+    struct json_object *e = json_object_array_get_idx (res, i);
+    assert (e);
+    assert (json_object_get_int (json_object_object_get (e, "code")) == code);
+    struct json_object *r = json_object_object_get (e, "results");
+    if (rows < 0)
+        assert (!r);
+    else
+        assert (r && json_object_array_length (r) == rows);
+}
+
+// {"id": id, "sql": "test_select", "params": [0]} in msgpack, which is
+// answered in msgpack
+static void exec_mp (zmq::socket_t &sock, size_t id)
+{
+    assert (id < 0x80);
+    const char req[] = "\x83\xa2id\x00\xa3sql\xabtest_select"
+        "\xa6params\x91\x00";
+    string s (req, sizeof (req) - 1);
+    s[4] = id;
+    cout << "msgpack req: " << s.size () << " bytes" << endl << flush;
+    cppzmq::packet_t p;
+    p.push_back (cppzmq::message_t (s));
+    sock << p;
+
+    cppzmq::packet_t resp;
+    sock >> resp;
+    const char *r = (const char *) resp.back ().data ();
+    size_t len = resp.back ().size ();
+    // a map, answering the id, with a code of 0
+    assert (len > 12 && (r[0] & 0xf0) == 0x80);
+    assert (!memcmp (r + 1, "\xa2id", 3) && r[4] == (char) id);
+    const char ok[] = "\xa4" "code\x00";
+    assert (memmem (r, len, ok, sizeof (ok) - 1));
+    cout << "got msgpack response: " << len << " bytes" << endl << flush;
+}
+
 int main ()
 {
     zmq::context_t ctx (1);
@@ -108,13 +168,100 @@ int main ()
     sel_param = string ("[") + lexical_cast<string> (iid) + "]";
     res = exec_sql (sock, txn, id++, seq, "test_select", sel_param);
     json_object_put (res);
+    res = exec_req (sock, txn, id++, seq,
+                    "\"sql\": \"test_insert\", "
+                    "\"rows\": [[124, \"def\"], [125, \"ghi\"]]");
+    // a row each, [code, affected, insert id]
+    assert (res && json_object_array_length (res) == 2);
+    size_t last = 0;
+    for (size_t i = 0; i < 2; ++i) {
+        struct json_object *row = json_object_array_get_idx (res, i);
+        assert (json_object_array_length (row) == 3);
+        assert (!json_object_get_int (json_object_array_get_idx (row, 0)));
+        assert (json_object_get_int (json_object_array_get_idx (row, 1)) == 1);
+        size_t rid = json_object_get_int (json_object_array_get_idx (row, 2));
+        assert (rid > last);
+        last = rid;
+    }
+    json_object_put (res);
+    res = exec_sql (sock, txn, id++, seq, "rollback");
+
+    // no txn
+    seq = 0;
+    txn = cppzmq::message_t ();
+    res = exec_sql (sock, txn, id++, seq, "test_select", sel_param);
+    json_object_put (res);
+
+    // third txn, with a batch seeing a row inserted, and one that isn't
+    seq = 0;
+    txn = cppzmq::message_t ();
+    res = exec_sql (sock, txn, id++, seq, "begin");
+    // the name given in a blob frame
+    res = exec_req (sock, txn, id++, seq,
+                    "\"sql\": \"test_insert\", "
+                    "\"params\": [126, {\"blob\": 0}]", "jkl");
+    assert (res);
+    iid = json_object_get_int (json_object_array_get_idx (
+                                   json_object_array_get_idx (res, 0), 0));
+    json_object_put (res);
+    sel_param = string ("[") + lexical_cast<string> (iid) + "]";
+    res = exec_req (sock, txn, id++, seq,
+                    "\"batch\": [{\"sql\": \"test_select\", \"params\": "
+                    + sel_param + "}, {\"sql\": \"test_select\", "
+                    "\"params\": [0]}]");
+    assert (res && json_object_array_length (res) == 2);
+    check_entry (res, 0, 0, 1);
+    check_entry (res, 1, 0, 0);
+    json_object_put (res);
     res = exec_sql (sock, txn, id++, seq, "rollback");
 
     // no txn
     seq = 0;
     txn = cppzmq::message_t ();
+
+    // an atomic batch failing halfway leaves nothing inserted
+    int code;
+    res = exec_req (sock, txn, id++, seq,
+                    "\"atomic\": true, \"batch\": ["
+                    "{\"sql\": \"test_insert\", "
+                    "\"params\": [127, \"mno\"]}, "
+                    "{\"sql\": \"test_select\", \"params\": []}]",
+                    "", &code);
+    assert (code && res && json_object_array_length (res) == 2);
+    check_entry (res, 0, 0, 1);
+    check_entry (res, 1, code, -1);
+    iid = json_object_get_int (json_object_array_get_idx (
+                                   json_object_array_get_idx (
+                                       json_object_object_get (
+                                           json_object_array_get_idx (res, 0),
+                                           "results"), 0), 0));
+    json_object_put (res);
+    sel_param = string ("[") + lexical_cast<string> (iid) + "]";
     res = exec_sql (sock, txn, id++, seq, "test_select", sel_param);
+    assert (res && !json_object_array_length (res));
+    json_object_put (res);
+
+    // a parallel batch is answered in the order of its statements
+    res = exec_req (sock, txn, id++, seq,
+                    "\"parallel\": true, \"batch\": ["
+                    "{\"sql\": \"test_select\", \"params\": [0]}, "
+                    "{\"sql\": \"test_select\", \"params\": []}, "
+                    "{\"sql\": \"test_select\", \"params\": [0]}]",
+                    "", &code);
+    assert (code && res && json_object_array_length (res) == 3);
+    check_entry (res, 0, 0, 0);
+    check_entry (res, 1, code, -1);
+    check_entry (res, 2, 0, 0);
     json_object_put (res);
 
+    // a result small enough is streamed in a single response
+    res = exec_req (sock, txn, id++, seq,
+                    "\"sql\": \"test_select\", \"params\": [0], "
+                    "\"stream\": true");
+    assert (res && !json_object_array_length (res));
+    json_object_put (res);
+
+    exec_mp (sock, id++);
+
     return 0;
 }
@@ -0,0 +1,100 @@
+/// timer_wheel.hpp -- hashed timing wheel of second granularity
+
+/// Author: Zhang Yichao <echaozh@gmail.com>
+/// Created: 2011-08-20
+///
+
+#ifndef INCLUDED_TIMER_WHEEL_HPP
+#define INCLUDED_TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <list>
+#include <stdexcept>
+#include <vector>
+
+// timers are hashed into slots by the second they expire at, so adding and
+// cancelling a timer is O(1), and each second only one slot is looked at
+// timers further away than the wheel is long stay in their slot for rounds
+// not thread safe, it's meant to be owned by a single broker thread
+template <typename T>
+class timer_wheel
+{
+private:
+    struct entry
+    {
+        entry (const T &v, size_t d) : val (v), deadline (d) {}
+        T val;
+        size_t deadline;
+    };
+    typedef std::list<entry> slot_t;
+
+public:
+    // what's needed to cancel a timer
+    struct timer
+    {
+        timer () : armed (false), slot (0) {}
+        bool armed;
+        size_t slot;
+        typename slot_t::iterator it;
+    };
+
+public:
+    // size has to be a power of 2, now is the current time in seconds
+    timer_wheel (size_t size, size_t now)
+        : slots_ (size), mask_ (size - 1), now_ (now)
+        {
+            if (size < 2 || (size & mask_))
+                throw std::invalid_argument ("bad wheel size");
+        }
+
+public:
+    // fires the timer timeout seconds from the last advance
+    void add (timer &t, const T &v, size_t timeout)
+        {
+            cancel (t);
+            size_t deadline = now_ + (timeout ? timeout : 1);
+            t.slot = deadline & mask_;
+            slot_t &s = slots_[t.slot];
+            t.it = s.insert (s.end (), entry (v, deadline));
+            t.armed = true;
+        }
+    void cancel (timer &t)
+        {
+            if (!t.armed)
+                return;
+            slots_[t.slot].erase (t.it);
+            t.armed = false;
+        }
+    // moves the wheel on to now, collecting the values of the timers fired
+    // the timers fired are disarmed, which has to be reflected in their
+    // timer handles by the caller, as the handles are not known here
+    template <typename Out>
+    void advance (size_t now, Out out)
+        {
+            // a long pause is caught up with by a single lap of the wheel
+            if (now > now_ + mask_)
+                now_ = now - mask_ - 1;
+            while (now_ < now) {
+                slot_t &s = slots_[++now_ & mask_];
+                typename slot_t::iterator it = s.begin ();
+                while (it != s.end ()) {
+                    if (it->deadline <= now) {
+                        *out++ = it->val;
+                        it = s.erase (it);
+                    } else
+                        ++it;
+                }
+            }
+        }
+
+private:
+    timer_wheel (const timer_wheel &);
+    timer_wheel &operator = (const timer_wheel &);
+
+private:
+    std::vector<slot_t> slots_;
+    const size_t mask_;
+    size_t now_;
+};
+
+#endif // INCLUDED_TIMER_WHEEL_HPP